@@ -0,0 +1,63 @@
+#ifndef _CALIBRATION_
+#define _CALIBRATION_
+
+#include <mrpdi/BaseDriver.h>
+
+//most touched points kept for a solve
+#define CALIBRATION_POINTS 16
+
+
+/**
+ * Screen mapping of a device, a 3x3 homography applied to the normalized
+ * position of its pointer events before they reach the host:
+ *
+ *	x' = (m0 x + m1 y + m2) / (m6 x + m7 y + m8)
+ *	y' = (m3 x + m4 y + m5) / (m6 x + m7 y + m8)
+ *
+ * The host sets it up through per device parameters, with fixed point
+ * positions packed as x<<16 | y, 0..65535 each:
+ *
+ *	calibration.raw@address		position the device reported for a touch
+ *	calibration.screen@address	where that touch was on screen, adds the pair
+ *	calibration.solve@address	solves and applies the pairs: an affine map
+ *					from 3, a homography from 4 or more
+ *	calibration.reset@address	back to no mapping, pairs dropped
+ *	calibration.points@address	pairs so far, read only
+ *	calibration.active@address	whether a mapping applies, read only
+ *
+ * The matrix is published through a sequence count, so the threads reading
+ * it never wait on the one writing it
+ */
+struct calibration_point
+{
+	float x;
+	float y;
+	float screen_x;
+	float screen_y;
+};
+
+struct calibration
+{
+	//odd while the matrix is being written
+	unsigned int sequence;
+	float matrix[9];
+	int active;
+
+	//writer side only, serialized by the caller
+	calibration_point points[CALIBRATION_POINTS];
+	int count;
+	float raw_x;
+	float raw_y;
+};
+
+void calibration_init(calibration * cal);
+int calibration_solve(const calibration_point * points,int count,float * matrix);
+void calibration_publish(calibration * cal,const float * matrix);
+void calibration_transform(const float * matrix,float * x,float * y,unsigned int count);
+void calibration_apply(calibration * cal,driver_event * events,unsigned int count);
+
+int calibration_set(calibration * cal,const char * name,unsigned int value);
+int calibration_get(calibration * cal,const char * name,unsigned int * value);
+
+
+#endif
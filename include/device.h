@@ -0,0 +1,361 @@
+#ifndef _DEVICE_
+#define _DEVICE_
+
+#include "reactor.h"
+#include "events.h"
+#include "registry.h"
+#include "stats.h"
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+/**
+ * Supported models of a driver as policy types. Each model is a struct with
+ * its id, the type of its own state and static init, close and decode
+ * functions taking a device_instance of itself. device_model provides an
+ * empty state, init and close:
+ *
+ *	struct my_board : public device_model
+ *	{
+ *		static const unsigned int id=0x12345678;
+ *		typedef device_instance<driver_instance_info,my_board> instance;
+ *		struct state { int button; };
+ *
+ *		static void init(instance * info);
+ *		static void decode(instance * info,unsigned char * buffer,int length);
+ *	};
+ *
+ * The driver lists its models in a device_ops table, and the model of an
+ * instance is picked once at start(). Report readers are templates over the
+ * model, so decoding is a direct call the compiler may inline instead of a
+ * switch on the id for every report
+ */
+
+
+/**
+ * Defaults for models without state, or nothing to do on init or close
+ */
+struct device_model
+{
+	struct state
+	{
+	};
+
+	template <class Instance>
+	static void init(Instance * info)
+	{
+	}
+
+	template <class Instance>
+	static void close(Instance * info)
+	{
+	}
+};
+
+/**
+ * Driver instance of a given model, with the model own state
+ */
+template <class Info,class Device>
+struct device_instance : public Info
+{
+	typename Device::state state;
+};
+
+/**
+ * Entry points of a model, as seen by the code shared by every model
+ */
+template <class Info>
+struct device_ops
+{
+	unsigned int id;
+	Info * (*create)();
+	void (*destroy)(Info * info);
+	void (*init)(Info * info);
+	void (*close)(Info * info);
+	void (*decode)(Info * info,unsigned char * buffer,int length);
+
+	//reactor callback reading the device, instantiated for the model
+	reactor_callback read;
+};
+
+template <class Info,class Device>
+struct device_binding
+{
+	typedef device_instance<Info,Device> instance;
+
+	//zeroed, a replayed device is never set up by init
+	static Info * create()
+	{
+		return new instance();
+	}
+
+	static void destroy(Info * info)
+	{
+		delete (instance *)info;
+	}
+
+	static void init(Info * info)
+	{
+		Device::init((instance *)info);
+	}
+
+	static void close(Info * info)
+	{
+		Device::close((instance *)info);
+	}
+
+	static void decode(Info * info,unsigned char * buffer,int length)
+	{
+		Device::decode((instance *)info,buffer,length);
+	}
+};
+
+/**
+ * Table entry for a model, read being its reader
+ */
+template <class Info,class Device>
+device_ops<Info> bind_device(reactor_callback read)
+{
+	device_ops<Info> ops;
+
+	ops.id=Device::id;
+	ops.create=device_binding<Info,Device>::create;
+	ops.destroy=device_binding<Info,Device>::destroy;
+	ops.init=device_binding<Info,Device>::init;
+	ops.close=device_binding<Info,Device>::close;
+	ops.decode=device_binding<Info,Device>::decode;
+	ops.read=read;
+
+	return ops;
+}
+
+/**
+ * Looks a model up. Tables end with an 0xffffffff id entry, returned for
+ * unknown ids when it has a model bound (a generic one), NULL otherwise
+ */
+template <class Info>
+const device_ops<Info> * find_device(const device_ops<Info> * table,unsigned int id)
+{
+	int n;
+
+	for(n=0;table[n].id!=0xffffffff;n++)
+	{
+		if(table[n].id==id)
+			return &table[n];
+	}
+
+	return (table[n].create!=NULL) ? &table[n] : NULL;
+}
+
+
+/**
+ * Start up shared by every driver: registers info, opens it with
+ * open_device on the calling thread, as that may block, and then has the
+ * reactor thread watch it with start_device. Info needs id, address,
+ * started, start_lock and events. Returns -1, with nothing done, when the
+ * device is already running
+ */
+template <class Info>
+int device_start(device_registry * registry,Info * info,reactor_task open_device,reactor_task start_device)
+{
+	//held until started is final, a stop() found it published meanwhile
+	//waits for it in device_stop()
+	pthread_mutex_init(&info->start_lock,NULL);
+	pthread_mutex_lock(&info->start_lock);
+
+	//ready before anything can reach it through the registry
+	event_queue_attach(&info->events);
+
+	if(registry_insert(registry,info->id,info->address,info)!=0)
+	{
+		event_queue_detach(&info->events);
+		pthread_mutex_unlock(&info->start_lock);
+		pthread_mutex_destroy(&info->start_lock);
+		return -1;
+	}
+
+	//every device of the driver is served by the reactor thread
+	info->started=(reactor_acquire()==0);
+	if(info->started)
+	{
+		open_device(info);
+		reactor_call(start_device,info);
+	}
+	else
+	{
+		std::cerr<<"Failed to start the reactor"<<std::endl;
+	}
+
+	pthread_mutex_unlock(&info->start_lock);
+
+	return 0;
+}
+
+/**
+ * Shut down of an instance already taken out of the registry, the caller
+ * frees it afterwards
+ */
+template <class Info>
+void device_stop(Info * info,reactor_task stop_device)
+{
+	//its start may still be running
+	pthread_mutex_lock(&info->start_lock);
+
+	if(info->started)
+	{
+		//once stop_device returns the reactor no longer knows about it
+		reactor_call(stop_device,info);
+		reactor_release();
+	}
+
+	event_queue_detach(&info->events);
+
+	pthread_mutex_unlock(&info->start_lock);
+	pthread_mutex_destroy(&info->start_lock);
+}
+
+
+/**
+ * Applies the common.rt_policy, common.rt_priority, common.cpu_affinity
+ * and common.mlock parameters of a driver to its reactor thread, when key
+ * is one of them. Returns whether it is
+ */
+template <class Common>
+bool device_set_sched(const char * key,const Common & common)
+{
+	if(strcmp(key,"common.rt_policy")!=0 && strcmp(key,"common.rt_priority")!=0 &&
+		strcmp(key,"common.cpu_affinity")!=0 && strcmp(key,"common.mlock")!=0)
+		return false;
+
+	reactor_set_sched(common.rt_policy,common.rt_priority,common.cpu_affinity,common.mlock!=0);
+
+	return true;
+}
+
+/**
+ * Read only common.rt_status parameter: REACTOR_STATUS_ flags of the
+ * options in effect. Returns 0 when key is it
+ */
+inline int device_get_sched(const char * key,unsigned int * value)
+{
+	if(strcmp(key,"common.rt_status")!=0)
+		return -1;
+
+	*value=reactor_sched_status();
+
+	return 0;
+}
+
+
+struct device_stats_query
+{
+	char name[32];
+	unsigned int * value;
+	int res;
+};
+
+/**
+ * Reads a counter of an instance, with the registry locked
+ */
+template <class Info>
+void device_read_stats(void * value,void * data)
+{
+	Info * info = (Info *)value;
+	device_stats_query * query = (device_stats_query *)data;
+
+	query->res=stats_get(&info->stats,&info->events,query->name,query->value);
+}
+
+/**
+ * Read only "stats.<name>@address" parameters, see stats.h. Info needs
+ * stats and events. Returns 0 when key is one of them
+ */
+template <class Info>
+int device_get_stats(device_registry * registry,const char * key,unsigned int * value)
+{
+	device_stats_query query;
+	unsigned int address;
+
+	if(stats_parse_key(key,query.name,sizeof(query.name),&address)!=0)
+		return -1;
+
+	query.value=value;
+	query.res=-1;
+	registry_visit(registry,address,device_read_stats<Info>,&query);
+
+	return query.res;
+}
+
+
+struct device_calibration_query
+{
+	char name[32];
+	unsigned int value;
+
+	//NULL when setting
+	unsigned int * result;
+	int res;
+};
+
+/**
+ * Sets or gets a calibration parameter of an instance, with the registry
+ * locked. That lock is what keeps calibration writers one at a time
+ */
+template <class Info>
+void device_access_calibration(void * value,void * data)
+{
+	Info * info = (Info *)value;
+	device_calibration_query * query = (device_calibration_query *)data;
+
+	if(query->result==NULL)
+		query->res=calibration_set(&info->events.mapping,query->name,query->value);
+	else
+		query->res=calibration_get(&info->events.mapping,query->name,query->result);
+}
+
+/**
+ * "calibration.<name>@address" parameters, see calibration.h. Info needs
+ * events. Returns 0 when key is one of them, whether it applied or not
+ */
+template <class Info>
+int device_set_calibration(device_registry * registry,const char * key,unsigned int value)
+{
+	device_calibration_query query;
+	unsigned int address;
+
+	if(parse_device_key(key,"calibration.",query.name,sizeof(query.name),&address)!=0)
+		return -1;
+
+	query.value=value;
+	query.result=NULL;
+	query.res=-1;
+	registry_visit(registry,address,device_access_calibration<Info>,&query);
+
+	if(query.res!=0)
+		std::cerr<<"[calibration] no device or parameter for "<<key<<std::endl;
+
+	return 0;
+}
+
+/**
+ * Read only "calibration.<name>@address" parameters. Returns 0 when key
+ * is one of them
+ */
+template <class Info>
+int device_get_calibration(device_registry * registry,const char * key,unsigned int * value)
+{
+	device_calibration_query query;
+	unsigned int address;
+
+	if(parse_device_key(key,"calibration.",query.name,sizeof(query.name),&address)!=0)
+		return -1;
+
+	query.result=value;
+	query.res=-1;
+	registry_visit(registry,address,device_access_calibration<Info>,&query);
+
+	return query.res;
+}
+
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef _EVENTS_
+#define _EVENTS_
+
+#include <mrpdi/BaseDriver.h>
+#include "utils.h"
+#include "calibration.h"
+
+//events held per device until the host takes them
+#define EVENT_QUEUE_SIZE 256
+
+
+/**
+ * Receives the pending events of one device, oldest first. events is only
+ * valid during the call
+ */
+typedef void (*batch_callback)(const driver_event * events,unsigned int count);
+
+/**
+ * Events of a device waiting for the host. Filled by the thread reading the
+ * device and emptied by dispatch_events(), without a lock between them.
+ * While the host is behind, a plain move of a pointer replaces the queued
+ * move before it; presses, releases and status events are never merged
+ */
+struct event_queue
+{
+	driver_event events[EVENT_QUEUE_SIZE];
+	unsigned long long timestamps[EVENT_QUEUE_SIZE];
+
+	//free running counters, written by producer and consumer respectively
+	unsigned int head;
+	unsigned int tail;
+
+	//consumer: events up to here are being read. Producer: set while
+	//rewriting the newest queued event
+	unsigned int claim;
+	int merging;
+
+	//producer only: last event pushed, and whether the newest queued one is
+	//a plain move that later moves may be folded into
+	driver_event last;
+	bool mergeable;
+
+	//events pushed by the device, dropped or merged ones included
+	unsigned long pushed;
+
+	//events dropped because the host fell behind
+	unsigned long overflow;
+
+	//pointer moves folded into a queued one while the host was behind
+	unsigned long coalesced;
+
+	//from push_event() to the return of the batch callback
+	report_latency latency;
+
+	//screen mapping of the pointer events, reset on attach
+	calibration mapping;
+
+	event_queue * next;
+};
+
+void event_queue_attach(event_queue * queue);
+void event_queue_detach(event_queue * queue);
+void push_event(event_queue * queue,driver_event & event);
+
+
+/**
+ * Optional entry points. Once a batch callback is set, events are no longer
+ * passed to the set_callback() one: they wait in the device queue until the
+ * host calls dispatch_events(), whenever it suits it. get_event_fd() becomes
+ * readable while events are pending, for hosts running their own poll loop.
+ * The callback must not call dispatch_events() itself
+ */
+extern "C" {
+void set_batch_callback(batch_callback callback);
+int dispatch_events();
+int get_event_fd();
+}
+
+
+#endif
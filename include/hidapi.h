@@ -78,6 +78,171 @@ extern "C" {
 			struct hid_device_info *next;
 		};
 
+		/** Default number of interrupt IN transfers kept in flight */
+		#define HID_DEFAULT_TRANSFERS 4
+		/** Maximum number of interrupt IN transfers kept in flight */
+		#define HID_MAX_TRANSFERS 8
+
+		/** Maximum number of input reports queued per device */
+		#define HID_MAX_QUEUE 256
+
+		/** Maximum number of input reports held at once from
+		    hid_read_zc() */
+		#define HID_MAX_HELD_REPORTS 16
+
+		/** Maximum number of output reports queued per device by
+		    hid_write_async() */
+		#define HID_MAX_WRITES 16
+
+		/** Scheduling options in effect, see hid_get_thread_sched() */
+		#define HID_SCHED_REALTIME 0x01
+		#define HID_SCHED_AFFINITY 0x02
+
+		/** Input queue policies, see struct #hid_open_options */
+		enum hid_queue_policy {
+			/** Queue every report up to the queue capacity, dropping
+			    the oldest one when it is full */
+			HID_QUEUE_FIFO = 0,
+			/** Keep only the most recent report. Suited to devices
+			    which only report absolute positions */
+			HID_QUEUE_LATEST,
+			/** Like #HID_QUEUE_FIFO, but a report which only moves
+			    the pointer replaces the last unread one. Reports
+			    changing the button state are always kept */
+			HID_QUEUE_MERGE_MOVES
+		};
+
+		/** HID backends, see struct #hid_open_options */
+		enum hid_backend {
+			/** The one named by the MRPDI_HID_BACKEND environment
+			    variable ("libusb" or "hidraw"), libusb otherwise */
+			HID_BACKEND_DEFAULT = 0,
+			/** Claim the interface and read it through libusb */
+			HID_BACKEND_LIBUSB,
+			/** Leave the interface to usbhid and read its
+			    /dev/hidraw node. Only available when built with
+			    HID_HIDRAW_BACKEND, libusb is used otherwise */
+			HID_BACKEND_HIDRAW
+		};
+
+		/** hidapi open options, see hid_open_path_ex() */
+		struct hid_open_options {
+			/** Number of interrupt IN transfers kept submitted at
+			    the same time (1 to #HID_MAX_TRANSFERS). While one of
+			    them is being completed the others keep polling the
+			    endpoint. */
+			int num_transfers;
+			/** One of #hid_queue_policy */
+			int queue_policy;
+			/** Number of unread reports kept (1 to #HID_MAX_QUEUE) */
+			int queue_cap;
+			/** #HID_QUEUE_MERGE_MOVES: number of leading bytes (report
+			    ID, command) which must be equal to merge two reports */
+			int merge_prefix;
+			/** #HID_QUEUE_MERGE_MOVES: offset of the button state byte,
+			    or -1 if the reports carry none */
+			int button_offset;
+			/** #HID_QUEUE_MERGE_MOVES: button bits of that byte */
+			unsigned char button_mask;
+			/** One of #hid_backend. num_transfers only applies to
+			    libusb */
+			int backend;
+			/** Non zero to read with hid_read_zc(). The completed
+			    transfer buffers are queued as they are and a free one
+			    is resubmitted, the payload is never copied */
+			int zero_copy;
+		};
+
+		/** hidapi hotplug events, see hid_hotplug_register() */
+		enum hid_hotplug_event {
+			/** A HID interface has been plugged in */
+			HID_HOTPLUG_ARRIVED = 1,
+			/** A HID interface has been removed */
+			HID_HOTPLUG_LEFT = 2
+		};
+
+		/** hidapi hotplug callback. @p path is the one to pass to
+		    hid_open_path(). Called from the event thread: it must
+		    not block, nor register or deregister callbacks, nor
+		    open or close devices. Hand the work to another thread
+		    instead. */
+		typedef void (*hid_hotplug_callback)(int event, const char *path, unsigned short vendor_id, unsigned short product_id, void *user_data);
+
+		/** hidapi write completion callback, see hid_write_async().
+		    @p result is the number of bytes written or -1 on error.
+		    Called from the event thread: it must not block. */
+		typedef void (*hid_write_callback)(hid_device *device, int result, void *user_data);
+
+		/** hidapi input report buffer, see hid_read_many() */
+		struct hid_report_buf {
+			/** Caller provided storage for one report, or the
+			    hidapi buffer set by hid_read_zc() */
+			unsigned char *data;
+			/** Size of @p data in bytes */
+			size_t size;
+			/** Number of bytes stored in @p data by hid_read_many() */
+			size_t len;
+			/** Completion time of the report, see hid_read_timed() */
+			unsigned long long timestamp;
+		};
+
+		/** Maximum number of input fields kept from a report
+		    descriptor */
+		#define HID_MAX_FIELDS 48
+
+		/** Input field of a report, compiled from the report
+		    descriptor. See hid_get_report_layout() */
+		struct hid_field {
+			/** Report ID carrying the field, 0 if the device
+			    doesn't use report IDs */
+			unsigned char report_id;
+			/** Usage Page */
+			unsigned short usage_page;
+			/** Usage */
+			unsigned short usage;
+			/** Position in the report, report ID byte included */
+			unsigned short bit_offset;
+			/** Size in bits (1 to 32) */
+			unsigned char bit_size;
+			/** Logical Minimum */
+			int logical_min;
+			/** Logical Maximum */
+			int logical_max;
+
+			/* Precomputed by the compiler for hid_field_value() */
+			unsigned short byte_offset;
+			unsigned char byte_count;
+			unsigned char shift;
+			unsigned char is_signed;
+			unsigned int mask;
+		};
+
+		/** Input fields of a device */
+		struct hid_report_layout {
+			/** Number of elements used in @p fields */
+			int num_fields;
+			/** Variable input fields, in descriptor order. Constant
+			    (padding) and array fields are left out */
+			struct hid_field fields[HID_MAX_FIELDS];
+		};
+
+		/** hidapi per device counters, see hid_get_stats() */
+		struct hid_device_stats {
+			/** Input reports received from the device */
+			unsigned long reports;
+			/** Reports received while another transfer was still
+			    submitted, so the endpoint was not left unpolled */
+			unsigned long gaps_avoided;
+			/** Transfers which completed ahead of an earlier one
+			    and were held back to keep the reports in order */
+			unsigned long reordered;
+			/** Unread reports dropped because the queue was full */
+			unsigned long dropped;
+			/** Unread reports replaced by a newer one, according to
+			    the queue policy */
+			unsigned long coalesced;
+		};
+
 
 		/** @brief Initialize the HIDAPI library.
 
@@ -172,6 +337,53 @@ extern "C" {
 		*/
 		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path);
 
+		/** @brief Fill a struct #hid_open_options with the defaults
+			used by hid_open_path().
+
+			@ingroup API
+			@param options The options to initialize.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_init_open_options(struct hid_open_options *options);
+
+		/** @brief Open a HID device by its path name with options.
+
+			Same as hid_open_path(), but allows tuning how the device
+			is read. Out of range values are clamped.
+
+			@ingroup API
+			@param path The path name of the device to open
+			@param options The open options, or NULL for the defaults.
+
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path_ex(const char *path, const struct hid_open_options *options);
+
+		/** @brief Register a callback for HID arrivals and removals.
+
+			Arrivals and removals are reported as soon as libusb sees
+			them, whether or not a device is open. Reads on an open
+			device which has been removed fail right away.
+
+			@ingroup API
+			@param callback The function to call.
+			@param user_data Passed as is to @p callback.
+
+			@returns
+				This function returns a handle for
+				hid_hotplug_deregister() or -1 on error, including when
+				the platform does not support hotplug.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_register(hid_hotplug_callback callback, void *user_data);
+
+		/** @brief Deregister a hotplug callback.
+
+			@ingroup API
+			@param handle A handle returned by hid_hotplug_register().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_hotplug_deregister(int handle);
+
 		/** @brief Write an Output report to a HID device.
 
 			The first byte of @p data[] must contain the Report ID. For
@@ -200,6 +412,32 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_write(hid_device *device, const unsigned char *data, size_t length);
 
+		/** @brief Queue an Output report for a HID device.
+
+			Like hid_write(), but returns at once. The reports are sent
+			one at a time, in order, by the event thread, so the
+			caller never waits for the device to acknowledge them. The
+			data is copied.
+
+			The callback is called once the report has been sent, or
+			has failed, including when the device is closed before
+			sending it. It is called from the event thread, or from
+			hid_close(). With the hidraw backend the report is handed
+			to the kernel before this returns.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data The data to send, starting with the report ID.
+			@param length The length in bytes of the data to send.
+			@param callback Called with the result, may be NULL.
+			@param user_data Passed to @p callback.
+
+			@returns
+				This function returns 0 if the report was queued and
+				-1 if the queue is full or the device is gone.
+		*/
+		int  HID_API_EXPORT HID_API_CALL hid_write_async(hid_device *device, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data);
+
 		/** @brief Read an Input report from a HID device with timeout.
 
 			Input reports are returned
@@ -220,6 +458,80 @@ extern "C" {
 		*/
 		int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds);
 
+		/** @brief Read an Input report with its completion time.
+
+			Like hid_read_timeout(), and also returns when the report
+			was received: the completion of its transfer, or its read
+			from the hidraw node. Comparing it to CLOCK_MONOTONIC
+			gives how long the report waited in the queue.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data A buffer to put the read data into.
+			@param length The number of bytes to read.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+			@param timestamp Where to store the completion time, in
+				nanoseconds of CLOCK_MONOTONIC. May be NULL.
+
+			@returns
+				This function returns the actual number of bytes read and
+				-1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_timed(hid_device *dev, unsigned char *data, size_t length, int milliseconds, unsigned long long *timestamp);
+
+		/** @brief Read all the queued Input reports from a HID device.
+
+			Waits like hid_read_timeout() for the first report, then
+			returns every report already queued (up to @p count) in one
+			call, oldest first. Reports longer than the size of their
+			buffer are truncated.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param reports Array of caller provided report buffers.
+			@param count The number of elements in @p reports.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of reports read, 0 on
+				timeout and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_many(hid_device *device, struct hid_report_buf *reports, size_t count, int milliseconds);
+
+		/** @brief Read the queued Input reports without copying them.
+
+			Like hid_read_many(), but @p data of each report is set to
+			the buffer the report was received in, @p size to its size.
+			The buffers stay owned by hidapi: return them with
+			hid_release_reports() once parsed, and before hid_close().
+			At most #HID_MAX_HELD_REPORTS can be held at once.
+
+			Only for devices opened with the zero_copy option.
+
+			@ingroup API
+			@param device A device handle returned from hid_open_path_ex().
+			@param reports Array of report descriptions to fill.
+			@param count The number of elements in @p reports.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of reports read, 0 on
+				timeout or if every buffer is held, and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_zc(hid_device *device, struct hid_report_buf *reports, size_t count, int milliseconds);
+
+		/** @brief Return report buffers obtained from hid_read_zc().
+
+			Reports with a NULL @p data are skipped, and @p data is
+			set to NULL once released.
+
+			@ingroup API
+			@param device A device handle returned from hid_open_path_ex().
+			@param reports The reports filled by hid_read_zc().
+			@param count The number of reports to release.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_release_reports(hid_device *device, struct hid_report_buf *reports, size_t count);
+
 		/** @brief Read an Input report from a HID device.
 
 			Input reports are returned
@@ -364,6 +676,111 @@ extern "C" {
 		*/
 		int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *device, int string_index, wchar_t *string, size_t maxlen);
 
+		/** @brief Get a file descriptor to wait for input reports.
+
+			The descriptor becomes readable when input reports are
+			queued and stays readable until they have all been read.
+			It is also readable once the device has been disconnected,
+			so the next read returns -1. It can be added to poll(),
+			select() or epoll, and is only valid until hid_close().
+			Do not read from it, use hid_read() and friends with a
+			timeout of 0.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns the file descriptor on success
+				and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_poll_fd(hid_device *device);
+
+		/** @brief Get the input fields of a HID device.
+
+			The report descriptor is read and compiled when the
+			device is opened.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param layout The structure to fill.
+
+			@returns
+				This function returns 0 on success and -1 if the
+				report descriptor couldn't be read or has no input
+				field.
+		*/
+		int HID_API_EXPORT_CALL hid_get_report_layout(hid_device *device, struct hid_report_layout *layout);
+
+		/** @brief Find a field of a report layout by usage.
+
+			@ingroup API
+			@param layout A layout filled by hid_get_report_layout().
+			@param report_id Report ID to look in, or -1 for any.
+			@param usage_page The Usage Page of the field.
+			@param usage The Usage of the field.
+
+			@returns
+				This function returns the first matching field, or
+				NULL if there is none.
+		*/
+		const struct hid_field HID_API_EXPORT_CALL * hid_layout_find(const struct hid_report_layout *layout, int report_id, unsigned short usage_page, unsigned short usage);
+
+		/** @brief Extract the value of a field from an input report.
+
+			@ingroup API
+			@param field A field of a layout.
+			@param report An input report, as read by hid_read().
+			@param length The length of @p report.
+			@param value Where to store the value, sign extended if
+				the field has a negative Logical Minimum.
+
+			@returns
+				This function returns 0 on success and -1 if the
+				report doesn't carry the field.
+		*/
+		int HID_API_EXPORT_CALL hid_field_value(const struct hid_field *field, const unsigned char *report, size_t length, int *value);
+
+		/** @brief Get the input counters of a HID device.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param stats The structure to fill.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_stats(hid_device *device, struct hid_device_stats *stats);
+
+		/** @brief Set the scheduling of the hidapi threads.
+
+			Input transfers are completed and their reports queued
+			by the libusb event thread, or the hidraw reader thread,
+			shared by every open device. Real time scheduling and
+			cpu affinity have to apply to them for the reports to
+			be read in time. Running threads get the options right
+			away, the others when they start. Options which can't
+			be applied, mostly for lack of privileges, are left at
+			their default.
+
+			@ingroup API
+			@param policy SCHED_OTHER, SCHED_FIFO or SCHED_RR.
+			@param priority Priority for SCHED_FIFO and SCHED_RR,
+				clamped to what the policy takes.
+			@param cpus Mask of the cpus the threads may run on, 0
+				for any.
+		*/
+		void HID_API_EXPORT_CALL hid_set_thread_sched(int policy, int priority, unsigned int cpus);
+
+		/** @brief Get the scheduling options in effect.
+
+			@ingroup API
+
+			@returns
+				This function returns the HID_SCHED_ flags of the
+				options in effect on every running hidapi thread.
+		*/
+		int HID_API_EXPORT_CALL hid_get_thread_sched(void);
+
 		/** @brief Get a string describing the last error which occurred.
 
 			@ingroup API
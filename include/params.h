@@ -0,0 +1,70 @@
+#ifndef _PARAMS_
+#define _PARAMS_
+
+#include <pthread.h>
+
+//most parameters of a driver, and slots of their hash table
+#define PARAM_MAX 32
+#define PARAM_SLOTS 64
+
+//most per device values set at once
+#define PARAM_OVERRIDES 32
+
+
+/**
+ * A driver parameter: its name, the variable holding its value for every
+ * device and its default. Drivers list them in a static table
+ */
+struct param_key
+{
+	const char * name;
+	unsigned int * value;
+	unsigned int def;
+};
+
+//value of a parameter for the device at address only
+struct param_override
+{
+	unsigned int address;
+	int key;
+	unsigned int value;
+};
+
+/**
+ * Parameters of a driver. Names are looked up through a perfect hash built
+ * at init, values are stored atomically. "name@address" keys set or get
+ * the value of one device, which only shows up in its snapshots.
+ * Every change bumps generation
+ */
+struct param_store
+{
+	const param_key * keys;
+	int count;
+	unsigned int seed;
+	signed char slots[PARAM_SLOTS];
+	
+	param_override overrides[PARAM_OVERRIDES];
+	int num_overrides;
+	pthread_mutex_t mutex;
+	
+	unsigned int generation;
+};
+
+/**
+ * Values of every parameter as seen by one device, indexed like the driver
+ * table. Read by the device thread without any locking
+ */
+struct param_snapshot
+{
+	unsigned int generation;
+	unsigned int values[PARAM_MAX];
+};
+
+int params_init(param_store * store,const param_key * keys,int count);
+int params_set(param_store * store,const char * key,unsigned int value);
+int params_get(param_store * store,const char * key,unsigned int * value);
+void params_snapshot(param_store * store,unsigned int address,param_snapshot * snapshot);
+bool params_refresh(param_store * store,unsigned int address,param_snapshot * snapshot);
+
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef _REACTOR_
+#define _REACTOR_
+
+#include <sys/epoll.h>
+
+/**
+ * Event loop shared by every instance of a driver: one thread waits on
+ * the file descriptors and timers of all the devices, and runs the
+ * callbacks and tasks one at a time, so callbacks never race each other.
+ * Callbacks must not block.
+ */
+
+typedef void (*reactor_callback)(int fd,unsigned int events,void * data);
+typedef void (*reactor_task)(void * data);
+
+//scheduling policies of the reactor thread
+#define REACTOR_SCHED_OTHER 0
+#define REACTOR_SCHED_FIFO 1
+#define REACTOR_SCHED_RR 2
+
+//options in effect, see reactor_sched_status()
+#define REACTOR_STATUS_REALTIME 0x01
+#define REACTOR_STATUS_AFFINITY 0x02
+#define REACTOR_STATUS_MLOCK 0x04
+
+int reactor_acquire();
+void reactor_release();
+
+int reactor_add_fd(int fd,unsigned int events,reactor_callback callback,void * data);
+void reactor_remove_fd(int fd);
+
+int reactor_add_timer(unsigned int first_ms,unsigned int period_ms,reactor_task callback,void * data);
+void reactor_remove_timer(int timer);
+int reactor_set_timer(int timer,unsigned int first_ms,unsigned int period_ms);
+
+int reactor_post(reactor_task task,void * data);
+void reactor_call(reactor_task task,void * data);
+bool reactor_in_loop();
+
+void reactor_set_sched(unsigned int policy,unsigned int priority,unsigned int cpus,bool lock_memory);
+int reactor_sched_policy(unsigned int policy);
+unsigned int reactor_sched_status();
+
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef _RECORD_
+#define _RECORD_
+
+#include <cstdio>
+
+#define RECORD_MAGIC "MRPDIREC"
+#define RECORD_VERSION 1
+
+//records fed per pass when replaying at full speed
+#define REPLAY_BATCH 256
+
+//longest record, the biggest HID report or serial read
+#define RECORD_MAX_LENGTH 1024
+
+
+/**
+ * Raw stream of a device: what was read from it (HID reports, interrupt
+ * transfers or serial bytes) with the time it was read. Files start with
+ * a record_header, followed by records of a timestamp in ns, a 16 bit
+ * length and the data, all in host byte order.
+ *
+ * Devices are recorded while the common.record parameter is set when they
+ * start, to $MRPDI_RECORD_DIR (/tmp by default) as
+ * <driver>-<id>-<address>.rec. A device whose id matches the file named
+ * by $MRPDI_REPLAY is fed from it instead of being opened, in real time,
+ * or as fast as possible with MRPDI_REPLAY_SPEED=0
+ */
+struct record_header
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int id;
+	unsigned int address;
+};
+
+struct record_file
+{
+	FILE * file;
+};
+
+/**
+ * Receives replayed data, on the reactor thread. timestamp is the time it
+ * is fed, not the recorded one
+ */
+typedef void (*replay_feed)(void * data,unsigned char * buffer,int length,unsigned long long timestamp);
+
+struct replay_file
+{
+	FILE * file;
+	int timer;
+	bool full_speed;
+
+	replay_feed feed;
+	void * data;
+
+	//recorded time of the first record, and when it was replayed
+	unsigned long long first;
+	unsigned long long start;
+
+	//next record, read ahead to know when it is due
+	unsigned long long timestamp;
+	unsigned short length;
+	unsigned char buffer[RECORD_MAX_LENGTH];
+	bool pending;
+};
+
+record_file * record_open(bool enabled,const char * driver,unsigned int id,unsigned int address);
+void record_write(record_file * record,const unsigned char * data,int length,unsigned long long timestamp);
+void record_close(record_file * record);
+
+replay_file * replay_open(unsigned int id,replay_feed feed,void * data);
+void replay_start(replay_file * replay);
+void replay_close(replay_file * replay);
+
+
+#endif
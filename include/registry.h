@@ -0,0 +1,41 @@
+#ifndef _REGISTRY_
+#define _REGISTRY_
+
+#include <pthread.h>
+
+//most devices a driver may run at once
+#define REGISTRY_BITS 6
+#define REGISTRY_SIZE (1<<REGISTRY_BITS)
+
+
+/**
+ * Running devices of a driver, keyed by id and address. Open addressing on
+ * the address, so get_status() lookups probe the same slots as the full
+ * key. Lookups don't lock: keys are published atomically and a removed
+ * slot keeps a tombstone. Inserts and removals are serialized by mutex
+ */
+struct registry_slot
+{
+	unsigned long long key;
+	void * value;
+};
+
+struct device_registry
+{
+	registry_slot slots[REGISTRY_SIZE];
+	unsigned int count;
+	pthread_mutex_t mutex;
+};
+
+typedef void (*registry_visitor)(void * value,void * data);
+
+void registry_init(device_registry * registry);
+int registry_insert(device_registry * registry,unsigned int id,unsigned int address,void * value);
+void * registry_remove(device_registry * registry,unsigned int id,unsigned int address);
+int registry_move(device_registry * registry,unsigned int id,unsigned int address,unsigned int new_address);
+bool registry_has_address(device_registry * registry,unsigned int address);
+int registry_list(device_registry * registry,void ** values,int max);
+int registry_visit(device_registry * registry,unsigned int address,registry_visitor visitor,void * data);
+
+
+#endif
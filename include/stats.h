@@ -0,0 +1,52 @@
+#ifndef _STATS_
+#define _STATS_
+
+#include "utils.h"
+#include "events.h"
+
+
+/**
+ * Counters of a device. Written by the reactor thread only, without locked
+ * instructions, and read by get_parameter() from any thread through the
+ * read only "stats.<name>@address" keys:
+ *
+ *	reports, reports_avg_per_s	reports or packets read
+ *	events, events_avg_per_s	events pushed
+ *	checksum_errors			corrupted serial packets
+ *	usb_errors			failed reads or transfers
+ *	drops, coalesced		events lost or merged while the host was
+ *					behind, and reports lost or merged while
+ *					the driver was, see stats_input()
+ *	latency_avg_us, latency_max_us, latency_p99_us
+ *					from reading a report to the return of its events
+ *	delivery_avg_us, delivery_max_us, delivery_p99_us
+ *					from push_event() to the return of the batch callback
+ *
+ * Rates are averages since the device started
+ */
+struct device_stats
+{
+	unsigned long long started;
+	unsigned long reports;
+	unsigned long checksum_errors;
+	unsigned long usb_errors;
+	report_latency latency;
+
+	//input queue below the driver: reports dropped or merged by the
+	//handles closed so far, and by the open one
+	unsigned long input_drops;
+	unsigned long input_coalesced;
+	unsigned long open_drops;
+	unsigned long open_coalesced;
+};
+
+void stats_init(device_stats * stats);
+void stats_report(device_stats * stats,unsigned long long timestamp);
+void stats_count(unsigned long * counter);
+void stats_input(device_stats * stats,unsigned long drops,unsigned long coalesced);
+void stats_input_closed(device_stats * stats);
+int stats_parse_key(const char * key,char * name,int size,unsigned int * address);
+int stats_get(device_stats * stats,event_queue * queue,const char * name,unsigned int * value);
+
+
+#endif
@@ -6,6 +6,30 @@
 
 unsigned char get_iface(unsigned int id,driver_device_info * supported_devices);
 void build_path(unsigned int address,unsigned char iface,char * out);
+int parse_path(const char * path,unsigned int * address,unsigned char * iface);
+int parse_device_key(const char * key,const char * prefix,char * name,int size,unsigned int * address);
+
+//histogram buckets of a latency, log2 of us
+#define LATENCY_BUCKETS 24
+
+/**
+ * Latency from the USB completion of the reports of a device to the
+ * return of its event callback, in ns. Written by one thread, other
+ * threads may read it at any time
+ */ 
+struct report_latency
+{
+	unsigned long long last;
+	unsigned long long max;
+	unsigned long long sum;
+	unsigned long count;
+	unsigned long buckets[LATENCY_BUCKETS];
+};
+
+//C linkage, hid-libusb.c uses it too
+extern "C" unsigned long long monotonic_ns();
+void update_latency(report_latency * latency,unsigned long long timestamp);
+unsigned long long latency_percentile(const report_latency * latency,unsigned int percent);
 
 
 #endif
@@ -1,15 +1,21 @@
 
 #include <mrpdi/BaseDriver.h>
 #include "utils.h"
+#include "reactor.h"
+#include "events.h"
+#include "registry.h"
+#include "params.h"
+#include "device.h"
+#include "record.h"
 #include <pthread.h>
 #include <stdint.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <cerrno>
 #include <cstring>
 #include <iostream>
 #include <sstream>
 #include <vector>
-#include <map>
 #include <unistd.h>
 
 #define MIN_X	440
@@ -23,16 +29,42 @@ struct driver_instance_info
 {
 	unsigned int id;
 	unsigned int address;
-	pthread_t thread;
-	bool quit_request;
+	bool started;
+	
+	//held while it starts, see device_start()
+	pthread_mutex_t start_lock;
 	int fd;
 	int wait;
+	
+	//packet being received
+	uint8_t buffer[8];
+	int pBuffer;
+	
+	//parameters as seen by this device
+	param_snapshot params;
+	
+	//counters, see stats.h
+	device_stats stats;
+	
+	//raw stream capture or replay, see record.h. NULL when not in use
+	record_file * record;
+	replay_file * replay;
+	
+	//events waiting for the host
+	event_queue events;
 };
 
 
 void (*pointer_callback) (driver_event);
 
-void * thread_core(void*);
+void open_device(void * param);
+void start_device(void * param);
+void stop_device(void * param);
+void send_header(driver_instance_info * info);
+void parse_packet(driver_instance_info * info);
+void read_data(int fd,unsigned int events,void * param);
+void receive_data(driver_instance_info * info,unsigned char * data,int length,unsigned long long timestamp);
+void replay_data(void * param,unsigned char * data,int length,unsigned long long timestamp);
 void init_driver(driver_instance_info * info);
 void close_driver(driver_instance_info * info);
 
@@ -50,6 +82,12 @@ driver_device_info supported_devices [] =
 driver_parameter_info supported_parameters [] = 
 {
 {0x00000000,"common.debug"},
+{0x00000000,"common.rt_policy"},
+{0x00000000,"common.rt_priority"},
+{0x00000000,"common.cpu_affinity"},
+{0x00000000,"common.mlock"},
+{0x00000000,"common.rt_status"},
+{0x00000000,"common.record"},
 {0x10c4ea60,"iqboard.pointers"},
 {0x10c4ea60,"iqboard.calibrate"},
 {0x10c4ea60,"iqboard.tty"},
@@ -57,9 +95,9 @@ driver_parameter_info supported_parameters [] =
 };
 
 
-vector<driver_instance_info *> driver_instances;
+device_registry driver_instances;
 
-map<string,unsigned int *> parameter_map;
+param_store parameters;
 
 
 uint8_t iqboard_header[]={0xce,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
@@ -71,6 +109,15 @@ uint8_t iqboard_header[]={0xce,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
 struct t_common
 {
 	unsigned int debug;
+	
+	//reactor thread scheduling, see reactor_set_sched()
+	unsigned int rt_policy;
+	unsigned int rt_priority;
+	unsigned int cpu_affinity;
+	unsigned int mlock;
+	
+	//raw stream capture, see record.h
+	unsigned int record;
 } common ;
 
 struct t_iqboard
@@ -81,22 +128,38 @@ struct t_iqboard
 }iqboard;
 
 
+//index of each parameter in the table below
+enum
+{
+	PARAM_COMMON_DEBUG,
+	PARAM_IQBOARD_POINTERS,
+	PARAM_IQBOARD_CALIBRATE,
+	PARAM_IQBOARD_TTY
+};
+
+//name, variable and default value of each parameter
+param_key parameter_table [] =
+{
+{"common.debug",&common.debug,0},
+{"iqboard.pointers",&iqboard.pointers,1},
+{"iqboard.calibrate",&iqboard.calibrate,1},
+{"iqboard.tty",&iqboard.tty,0},
+{"common.rt_policy",&common.rt_policy,0},
+{"common.rt_priority",&common.rt_priority,0},
+{"common.cpu_affinity",&common.cpu_affinity,0},
+{"common.mlock",&common.mlock,0},
+{"common.record",&common.record,0},
+};
+
 /**
 * global driver initialization
 */
 void init()
 {
 	
-	parameter_map["common.debug"]=&common.debug;
-	parameter_map["iqboard.pointers"]=&iqboard.pointers;
-	parameter_map["iqboard.calibrate"]=&iqboard.calibrate;
-	parameter_map["iqboard.tty"]=&iqboard.tty;
+	params_init(&parameters,parameter_table,sizeof(parameter_table)/sizeof(param_key));
 	
-	//default values
-	common.debug=0;
-	iqboard.pointers=1;
-	iqboard.calibrate=1;
-	iqboard.tty=0;
+	registry_init(&driver_instances);
 	
 	if(common.debug)
 		cout<<"[IQboardDriver]: init"<<endl;
@@ -119,45 +182,27 @@ void shutdown()
 */
 void start(unsigned int id,unsigned int address)
 {
-	bool found=false;
 	driver_instance_info * info;
-	char path[16];
 	
+	info = new driver_instance_info;
+	info->id=id;
+	info->address=address;
+	info->fd=-1;
+	info->pBuffer=0;
+	info->wait=0;
+	info->record=NULL;
+	info->replay=NULL;
+	stats_init(&info->stats);
 	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
-		{
-			found=true;
-			break;
-		}
-	}
+	if(common.debug)
+		cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
 	
-	if(!found)
-	{
-		if(common.debug)
-			cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
-						
-		info = new driver_instance_info;
-		info->id=id;
-		info->address=address;
-		info->quit_request=false;
-		driver_instances.push_back(info);
-		
-		if(pthread_create(&info->thread, NULL,  thread_core, info)!=0)
-		{
-			cerr<<"[IQboardDriver] Failed to spawn thread"<<endl;
-		}
-
-		
-		
-	}
-	else
+	//refused when the device is already running
+	if(device_start(&driver_instances,info,open_device,start_device)!=0)
 	{
 		cerr<<"[IQboardDriver] driver already loaded!"<<endl;
+		delete info;
 	}
-	
-
 }
 
 /**
@@ -165,37 +210,17 @@ void start(unsigned int id,unsigned int address)
 */
 void stop(unsigned int id,unsigned int address)
 {
-	bool found=false;
-	vector<driver_instance_info *> tmp;
 	driver_instance_info * info;
 	
+	info = (driver_instance_info *)registry_remove(&driver_instances,id,address);
 	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
-		{
-			found=true;
-			info=driver_instances[n];
-		}
-		else
-		{
-			tmp.push_back(driver_instances[n]);
-		}
-	}
-	
-	if(found)
+	if(info!=NULL)
 	{
 		
-		driver_instances=tmp;
-		
 		if(common.debug)
 			cout<<"stop:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
-		info->quit_request=true;
-		if(common.debug)
-			cout<<"[IQboardDriver] joining to:"<<info->address<<endl;
-		pthread_join(info->thread,NULL);
-		//once thread is already dead we don't need its instance reference anymore
+		
+		device_stop(info,stop_device);
 		delete info;
 	}
 	else
@@ -208,107 +233,224 @@ void stop(unsigned int id,unsigned int address)
 
 
 /**
-* Thread callback function
+* Opens the board, on the thread starting it as setting the port up blocks
 */
-void * thread_core(void* param)
+void open_device(void * param)
 {
 	driver_instance_info * info = (driver_instance_info *)param;
-	int res;
-	uint8_t buffer[8];
-	uint8_t checksum;
+	
+	//a board may have its own iqboard.tty@address
+	params_snapshot(&parameters,info->address,&info->params);
+	
+	//fed from a recording instead, when there is one
+	info->replay=replay_open(info->id,replay_data,info);
+	if(info->replay==NULL)
+		init_driver(info);
+}
+
+/**
+* Watches the opened board, runs on the reactor thread
+*/
+void start_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	if(info->replay!=NULL)
+	{
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_READY;
+		push_event(&info->events,event);
+		replay_start(info->replay);
+		return;
+	}
+	
+	if(reactor_add_fd(info->fd,EPOLLIN,read_data,info)!=0)
+	{
+		cerr<<"[IQboardDriver] Failed to watch serial port"<<endl;
+		return;
+	}
+	
+	info->record=record_open(common.record!=0,"iqboard",info->id,info->address);
+	send_header(info);
+}
 
-	init_driver(info);
+/**
+* Closes the board, runs on the reactor thread
+*/
+void stop_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
 	
-	if(common.debug)
-		cout<<"[IQboardDriver] thread_core::enter"<<endl;
+	if(info->replay!=NULL)
+	{
+		replay_close(info->replay);
+		info->replay=NULL;
 		
-	while(!info->quit_request)
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_SHUTDOWN;
+		push_event(&info->events,event);
+		return;
+	}
+	
+	reactor_remove_fd(info->fd);
+	close_driver(info);
+	
+	record_close(info->record);
+	info->record=NULL;
+}
+
+/**
+* Asks the board for the next packet, unless one is already pending
+*/
+void send_header(driver_instance_info * info)
+{
+	int res;
+	
+	//no board to ask when replaying
+	if(info->wait==0 && info->fd>=0)
 	{
-		if(info->wait==0)
+		res = write(info->fd,iqboard_header,8);
+		if(res<0)
+			cerr<<"[IQboardDriver] failed to send data"<<endl;
+		else
 		{
-			res = write(info->fd,iqboard_header,8);
-			if(res<0)
-				cerr<<"[IQboardDriver] failed to send data"<<endl;
-			else
-			{
-				//cout<<"[IQboardDriver] HEADER sent"<<endl;
-				info->wait=1;
-			}
+			//cout<<"[IQboardDriver] HEADER sent"<<endl;
+			info->wait=1;
 		}
-		
-		
-		res = read(info->fd,buffer,8);
-		if(res>0)
+	}
+}
+
+/**
+* Parses a full 8 bytes packet
+*/
+void parse_packet(driver_instance_info * info)
+{
+	uint8_t * buffer = info->buffer;
+	uint8_t checksum;
+	
+	checksum = buffer[0] ^ buffer[1] ^ buffer[2] ^ buffer[3] ^ buffer[4] ^ buffer[5] ^ buffer[6];
+	if(checksum==buffer[7])
+	{
+		if(buffer[0]==0xee && buffer[1]==0xee)
 		{
-			checksum = buffer[0] ^ buffer[1] ^ buffer[2] ^ buffer[3] ^ buffer[4] ^ buffer[5] ^ buffer[6];
-			if(checksum==buffer[7])
-			{
-				if(buffer[0]==0xee && buffer[1]==0xee)
-				{
-					//cout<<"[IQboardDriver] Position received"<<endl;
-					int x = ((buffer[5] & 0x3F) << 6) | (buffer[6] & 0x3F);
-					int y = ((buffer[3] & 0x3F) << 6) | (buffer[4] & 0x3F);
-					
-					int width = MAX_X - MIN_X;
-					int height = MAX_Y - MIN_Y;
-					x-=MIN_X;
-					y-=MIN_Y;
-					//cout<<dec<<"IQDebug:"<<x<<","<<y<<endl;
-					
-					driver_event event;
-					event.id=info->id;
-					event.address=info->address;
-					event.type=EVENT_POINTER;
-					event.pointer.button= (buffer[2]==0x51) ? 1 : 0;
-					event.pointer.pointer=0;
-					event.pointer.x= (float)x/(float)width;
-					event.pointer.y=(float)y/(float)height;
-					pointer_callback(event);
-					info->wait=0;
-				}
-				
-				if(buffer[0]==0xc8 && buffer[1]==0xca)
-				{
-					//cout<<"[IQboardDriver] ACK received"<<endl;
-					info->wait=0;
-				}
-			}
-			else
-			{
-				cerr<<"[IQboardDriver] Bad checksum"<<endl;
-				
-				//sending error event
-				driver_event event;
-				event.id=info->id;
-				event.address=info->address;
-				event.type=EVENT_STATUS;
-				event.status.id=STATUS_COMMERROR;
-				pointer_callback(event);
-			}
+			//cout<<"[IQboardDriver] Position received"<<endl;
+			int x = ((buffer[5] & 0x3F) << 6) | (buffer[6] & 0x3F);
+			int y = ((buffer[3] & 0x3F) << 6) | (buffer[4] & 0x3F);
 			
+			int width = MAX_X - MIN_X;
+			int height = MAX_Y - MIN_Y;
+			x-=MIN_X;
+			y-=MIN_Y;
+			//cout<<dec<<"IQDebug:"<<x<<","<<y<<endl;
 			
-		}
-		else
-		{
-			cerr<<"[IQboardDriver] failed to receive data"<<endl;
-			//sending error event
 			driver_event event;
 			event.id=info->id;
 			event.address=info->address;
-			event.type=EVENT_STATUS;
-			event.status.id=STATUS_COMMERROR;
-			pointer_callback(event);
+			event.type=EVENT_POINTER;
+			event.pointer.button= (buffer[2]==0x51) ? 1 : 0;
+			event.pointer.pointer=0;
+			event.pointer.x= (float)x/(float)width;
+			event.pointer.y=(float)y/(float)height;
+			push_event(&info->events,event);
+			info->wait=0;
+		}
+		
+		if(buffer[0]==0xc8 && buffer[1]==0xca)
+		{
+			//cout<<"[IQboardDriver] ACK received"<<endl;
+			info->wait=0;
 		}
+	}
+	else
+	{
+		cerr<<"[IQboardDriver] Bad checksum"<<endl;
+		stats_count(&info->stats.checksum_errors);
 		
+		//sending error event
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_COMMERROR;
+		push_event(&info->events,event);
+	}
+}
+
+/**
+* Serial port callback, runs on the reactor thread
+*/
+void read_data(int fd,unsigned int events,void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	int res;
+	unsigned char data[8];
+	unsigned long long timestamp = monotonic_ns();
+	
+	//no more than the rest of the packet, the board sends nothing else
+	//until asked again
+	res = read(fd,data,8-info->pBuffer);
+	if(res>0)
+	{
+		if(info->record!=NULL)
+			record_write(info->record,data,res,timestamp);
 		
-		usleep(500);
+		receive_data(info,data,res,timestamp);
 	}
+	else if(res==0 || errno!=EAGAIN)
+	{
+		cerr<<"[IQboardDriver] failed to receive data"<<endl;
+		stats_count(&info->stats.usb_errors);
+		//sending error event
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_COMMERROR;
+		push_event(&info->events,event);
 		
-	if(common.debug)
-		cout<<"[IQboardDriver] thread_core::exit"<<endl;
-	close_driver(info);
+		//stop watching it or it would fire forever
+		reactor_remove_fd(fd);
+	}
+}
+
+/**
+* Bytes from the board, read at timestamp
+*/
+void receive_data(driver_instance_info * info,unsigned char * data,int length,unsigned long long timestamp)
+{
+	int count;
 	
-	return NULL;	
+	//packets may come split, keep what arrived until the 8 bytes are there
+	while(length>0)
+	{
+		count = (length<8-info->pBuffer) ? length : 8-info->pBuffer;
+		memcpy(info->buffer+info->pBuffer,data,count);
+		info->pBuffer+=count;
+		data+=count;
+		length-=count;
+		
+		if(info->pBuffer==8)
+		{
+			parse_packet(info);
+			stats_report(&info->stats,timestamp);
+			info->pBuffer=0;
+			send_header(info);
+		}
+	}
+}
+
+/**
+* Recorded bytes, runs on the reactor thread
+*/
+void replay_data(void * param,unsigned char * data,int length,unsigned long long timestamp)
+{
+	receive_data((driver_instance_info *)param,data,length,timestamp);
 }
 
 
@@ -328,9 +470,9 @@ void init_driver(driver_instance_info * info)
 	if(common.debug)
 		cout<<"[IQboardDriver]init_driver"<<endl;
 	
-	ss<<"/dev/ttyUSB"<<iqboard.tty;
+	ss<<"/dev/ttyUSB"<<info->params.values[PARAM_IQBOARD_TTY];
 	info->fd = open(ss.str().c_str(),O_RDWR | O_NOCTTY | O_NONBLOCK);
-	fcntl(info->fd, F_SETFL, 0);
+	//stays non-blocking, the reactor tells when there is something to read
 	cout<<"status:"<<info->fd<<endl;
     tcgetattr(info->fd, &options);
     cfsetispeed(&options, B19200);
@@ -351,7 +493,7 @@ void init_driver(driver_instance_info * info)
 	event.address=info->address;
 	event.type=EVENT_STATUS;
 	event.status.id=STATUS_READY;
-	pointer_callback(event);
+	push_event(&info->events,event);
 }
 
 /**
@@ -371,7 +513,7 @@ void close_driver(driver_instance_info * info)
 	event.address=info->address;
 	event.type=EVENT_STATUS;
 	event.status.id=STATUS_SHUTDOWN;
-	pointer_callback(event);
+	push_event(&info->events,event);
 }
 
 
@@ -382,7 +524,16 @@ void set_parameter(const char * key,unsigned int value)
 {
 	if(common.debug)
 		cout<<"[IQboardDriver] set_parameter:"<<value<<endl;
-	*(parameter_map[key])=value;
+	
+	//per device screen mapping, see calibration.h
+	if(device_set_calibration<driver_instance_info>(&driver_instances,key,value)==0)
+		return;
+	
+	if(params_set(&parameters,key,value)!=0)
+		cerr<<"[IQboardDriver] unknown parameter:"<<key<<endl;
+	
+	//scheduling options go to the reactor thread right away
+	device_set_sched(key,common);
 }
 
 /**
@@ -390,13 +541,11 @@ void set_parameter(const char * key,unsigned int value)
 */
 int get_parameter(const char * key,unsigned int * value)
 {
-	map<string,unsigned int *>::iterator it;
-	
-	it=parameter_map.find(key);
-	
-	if(it==parameter_map.end())return -1;
-	
-	*value=*parameter_map[key];
+	if(device_get_sched(key,value)!=0 &&
+		device_get_stats<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		device_get_calibration<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		params_get(&parameters,key,value)!=0)
+		return -1;
 	
 	if(common.debug)
 		cout<<"[IQboardDriver] get_parameter:"<<*value<<endl;
@@ -408,18 +557,11 @@ int get_parameter(const char * key,unsigned int * value)
  */ 
 unsigned int get_status(unsigned int address)
 {
-	unsigned int ret = DEV_STATUS_STOP;
-	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-		if(driver_instances[n]->address==address)
-		{
-			ret=DEV_STATUS_RUNNING;
-			break;
-		}
-	}
+	//lock free, the host may poll it while devices start or stop
+	if(registry_has_address(&driver_instances,address))
+		return DEV_STATUS_RUNNING;
 	
-	return ret;
+	return DEV_STATUS_STOP;
 }
 
 
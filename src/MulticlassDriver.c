@@ -1,6 +1,12 @@
 
 #include <mrpdi/BaseDriver.h>
 #include "utils.h"
+#include "reactor.h"
+#include "events.h"
+#include "registry.h"
+#include "params.h"
+#include "device.h"
+#include "record.h"
 #include <pthread.h>
 #include <stdint.h>
 #include <termios.h>
@@ -9,7 +15,6 @@
 
 #include <sstream>
 #include <vector>
-#include <map>
 #include <iostream>
 #include <unistd.h>
 
@@ -19,19 +24,47 @@ struct driver_instance_info
 {
 	unsigned int id;
 	unsigned int address;
-	pthread_t thread;
-	pthread_t keep_alive_thread;
-	bool quit_request;
-	bool keep_alive_quit_request;
+	bool started;
+	
+	//held while it starts, see device_start()
+	pthread_mutex_t start_lock;
 	int fd;
 	int header;
+	
+	//reactor timers, -1 when not armed
+	int init_timer;
+	int keep_alive_timer;
+	
+	//packet being received
+	uint8_t buffer[32];
+	uint8_t pBuffer;
+	int lx,ly;
+	
+	//parameters as seen by this device
+	param_snapshot params;
+	
+	//counters, see stats.h
+	device_stats stats;
+	
+	//raw stream capture or replay, see record.h. NULL when not in use
+	record_file * record;
+	replay_file * replay;
+	
+	//events waiting for the host
+	event_queue events;
 };
 
 
 void (*pointer_callback) (driver_event);
 
-void * thread_core(void*);
-void * keep_alive(void*);
+void open_device(void * param);
+void start_device(void * param);
+void stop_device(void * param);
+void send_init(void * param);
+void keep_alive(void * param);
+void parse_byte(driver_instance_info * info,uint8_t data,unsigned long long timestamp);
+void read_data(int fd,unsigned int events,void * param);
+void replay_data(void * param,unsigned char * data,int length,unsigned long long timestamp);
 
 void init_driver(driver_instance_info * info);
 void close_driver(driver_instance_info * info);
@@ -51,6 +84,12 @@ driver_device_info supported_devices [] =
 driver_parameter_info supported_parameters [] = 
 {
 {0x00000000,"common.debug"},
+{0x00000000,"common.rt_policy"},
+{0x00000000,"common.rt_priority"},
+{0x00000000,"common.cpu_affinity"},
+{0x00000000,"common.mlock"},
+{0x00000000,"common.rt_status"},
+{0x00000000,"common.record"},
 {0x10c4ea60,"multiclass.pointers"},
 {0x10c4ea60,"multiclass.calibrate"},
 {0x10c4ea60,"multiclass.tty"},
@@ -58,9 +97,9 @@ driver_parameter_info supported_parameters [] =
 };
 
 
-vector<driver_instance_info *> driver_instances;
+device_registry driver_instances;
 
-map<string,unsigned int *> parameter_map;
+param_store parameters;
 
 
 /**
@@ -70,6 +109,15 @@ map<string,unsigned int *> parameter_map;
 struct t_common
 {
 	unsigned int debug;
+	
+	//reactor thread scheduling, see reactor_set_sched()
+	unsigned int rt_policy;
+	unsigned int rt_priority;
+	unsigned int cpu_affinity;
+	unsigned int mlock;
+	
+	//raw stream capture, see record.h
+	unsigned int record;
 } common ;
 
 struct t_multiclass
@@ -80,22 +128,38 @@ struct t_multiclass
 }multiclass;
 
 
+//index of each parameter in the table below
+enum
+{
+	PARAM_COMMON_DEBUG,
+	PARAM_MULTICLASS_POINTERS,
+	PARAM_MULTICLASS_CALIBRATE,
+	PARAM_MULTICLASS_TTY
+};
+
+//name, variable and default value of each parameter
+param_key parameter_table [] =
+{
+{"common.debug",&common.debug,0},
+{"multiclass.pointers",&multiclass.pointers,1},
+{"multiclass.calibrate",&multiclass.calibrate,1},
+{"multiclass.tty",&multiclass.tty,0},
+{"common.rt_policy",&common.rt_policy,0},
+{"common.rt_priority",&common.rt_priority,0},
+{"common.cpu_affinity",&common.cpu_affinity,0},
+{"common.mlock",&common.mlock,0},
+{"common.record",&common.record,0},
+};
+
 /**
 * global driver initialization
 */
 void init()
 {
 	
-	parameter_map["common.debug"]=&common.debug;
-	parameter_map["multiclass.pointers"]=&multiclass.pointers;
-	parameter_map["multiclass.calibrate"]=&multiclass.calibrate;
-	parameter_map["multiclass.tty"]=&multiclass.tty;
+	params_init(&parameters,parameter_table,sizeof(parameter_table)/sizeof(param_key));
 	
-	//default values
-	common.debug=0;
-	multiclass.pointers=1;
-	multiclass.calibrate=1;
-	multiclass.tty=0;
+	registry_init(&driver_instances);
 	
 	if(common.debug)
 		cout<<"[MultiClassDriver]: init"<<endl;
@@ -118,50 +182,27 @@ void shutdown()
 */
 void start(unsigned int id,unsigned int address)
 {
-	bool found=false;
 	driver_instance_info * info;
-	char path[16];
 	
+	info = new driver_instance_info;
+	info->id=id;
+	info->address=address;
+	info->fd=-1;
+	info->init_timer=-1;
+	info->keep_alive_timer=-1;
+	info->record=NULL;
+	info->replay=NULL;
+	stats_init(&info->stats);
 	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
-		{
-			found=true;
-			break;
-		}
-	}
+	if(common.debug)
+		cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
 	
-	if(!found)
-	{
-		if(common.debug)
-			cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
-						
-		info = new driver_instance_info;
-		info->id=id;
-		info->address=address;
-		info->quit_request=false;
-		info->keep_alive_quit_request=false;
-		driver_instances.push_back(info);
-		
-		if(pthread_create(&info->thread, NULL,  thread_core, info)!=0)
-		{
-			cerr<<"[MultiClassDriver] Failed to spawn thread"<<endl;
-		}
-		
-		if(pthread_create(&info->keep_alive_thread, NULL, keep_alive, info)!=0)
-		{
-			cerr<<"[MultiClassDriver] Failed to spawn keep alive thread"<<endl;
-		}
-		
-		
-	}
-	else
+	//refused when the device is already running
+	if(device_start(&driver_instances,info,open_device,start_device)!=0)
 	{
 		cerr<<"[MultiClassDriver] driver already loaded!"<<endl;
+		delete info;
 	}
-	
-
 }
 
 /**
@@ -169,39 +210,17 @@ void start(unsigned int id,unsigned int address)
 */
 void stop(unsigned int id,unsigned int address)
 {
-	bool found=false;
-	vector<driver_instance_info *> tmp;
 	driver_instance_info * info;
 	
+	info = (driver_instance_info *)registry_remove(&driver_instances,id,address);
 	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
-		{
-			found=true;
-			info=driver_instances[n];
-		}
-		else
-		{
-			tmp.push_back(driver_instances[n]);
-		}
-	}
-	
-	if(found)
+	if(info!=NULL)
 	{
 		
-		driver_instances=tmp;
-		
 		if(common.debug)
 			cout<<"stop:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
-		info->quit_request=true;
-		if(common.debug)
-			cout<<"[MultiClassDriver] joining to:"<<info->address<<endl;
-		pthread_join(info->thread,NULL);
-		pthread_join(info->keep_alive_thread,NULL);
 		
-		//once thread is already dead we don't need its instance reference anymore
+		device_stop(info,stop_device);
 		delete info;
 	}
 	else
@@ -213,161 +232,232 @@ void stop(unsigned int id,unsigned int address)
 }
 
 /**
- * Keep alive thread
- */ 
-void * keep_alive(void* param)
+ * Opens the board, on the thread starting it as setting the port up blocks
+ */
+void open_device(void * param)
 {
 	driver_instance_info * info = (driver_instance_info *)param;
-	int res;
 	
-	if(common.debug)
-		cout<<"[MultiClassDriver] keep_alive enter"<<endl;
+	//a board may have its own multiclass.tty@address
+	params_snapshot(&parameters,info->address,&info->params);
 	
-	while(!info->keep_alive_quit_request)
-	{
-		if(info->header==1)
-		{
-			res=write(info->fd,&cmd_keep_alive,1);
-			if(res<=0)cout<<"[MultiClassDriver]: Error sending keep alive message!"<<endl;
-		}	
+	//fed from a recording instead, when there is one
+	info->replay=replay_open(info->id,replay_data,info);
+	if(info->replay==NULL)
+		init_driver(info);
+}
+
+/**
+ * Starts talking to the opened board, runs on the reactor thread
+ */
+void start_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
 	
-		sleep(1);
+	if(info->replay!=NULL)
+	{
+		info->header=0;
+		info->pBuffer=0;
+		info->lx=0;
+		info->ly=0;
+		
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_READY;
+		push_event(&info->events,event);
+		replay_start(info->replay);
+		return;
 	}
 	
+	//from what I tested, I should wait at least one second before start reading the board
 	if(common.debug)
-		cout<<"[MultiClassDriver] keep_alive exit"<<endl;
+		cout<<"[MultiClassDriver] Waiting"<<endl;
+	info->init_timer=reactor_add_timer(1000,0,send_init,info);
+	if(info->init_timer<0)
+		cerr<<"[MultiClassDriver] Failed to arm init timer"<<endl;
+	
+	if(info->fd>=0)
+		info->record=record_open(common.record!=0,"multiclass",info->id,info->address);
 }
 
 /**
-* Thread callback function
-*/
-void * thread_core(void* param)
+ * Closes the board, runs on the reactor thread
+ */
+void stop_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	if(info->replay!=NULL)
+	{
+		replay_close(info->replay);
+		info->replay=NULL;
+		
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_SHUTDOWN;
+		push_event(&info->events,event);
+		return;
+	}
+	
+	reactor_remove_timer(info->init_timer);
+	reactor_remove_timer(info->keep_alive_timer);
+	info->init_timer=-1;
+	info->keep_alive_timer=-1;
+	reactor_remove_fd(info->fd);
+	
+	close_driver(info);
+	
+	record_close(info->record);
+	info->record=NULL;
+}
+
+/**
+ * Keep alive timer, every second
+ */ 
+void keep_alive(void * param)
 {
 	driver_instance_info * info = (driver_instance_info *)param;
 	int res;
-	uint8_t buffer[32];
-	uint8_t pBuffer=0;
-	uint8_t checksum;
 	
-	int x,y,lx,ly;
+	if(info->header==1)
+	{
+		res=write(info->fd,&cmd_keep_alive,1);
+		if(res<=0)cout<<"[MultiClassDriver]: Error sending keep alive message!"<<endl;
+	}
+}
 
-	init_driver(info);
+/**
+* Feeds one byte to the packet being received
+*/
+void parse_byte(driver_instance_info * info,uint8_t data,unsigned long long timestamp)
+{
+	uint8_t * buffer = info->buffer;
+	uint8_t checksum;
+	int x,y;
 	
-	if(common.debug)
-		cout<<"[MultiClassDriver] thread_core::enter"<<endl;
-		
-	while(!info->quit_request)
+	buffer[info->pBuffer]=data;
+	
+	//reached 8-bytes
+	if(info->pBuffer==7)
 	{
+		if(buffer[0]==0xA8)
+		{
+			if(__atomic_load_n(&common.debug,__ATOMIC_RELAXED))
+				cout<<"* header message, welcome Multiclass! ^_^"<<endl;
+			info->header=1;//mark header status as received
+		}
 		
-		res = read(info->fd,&(buffer[pBuffer]),1);
-		if(res>0)
+		if(buffer[0]==0xAA && buffer[1]==0xAA)
 		{
-			//reached 8-bytes
-			if(pBuffer==7)
+			
+			y = (buffer[3]<<6) | buffer[4];
+			x = (buffer[5]<<6) | buffer[6];
+			
+			checksum = buffer[2] ^ buffer[3] ^ buffer[4] ^ buffer[5] ^ buffer[6];
+			
+			//checksum validation
+			if(buffer[7]==checksum)
 			{
-				if(buffer[0]==0xA8)
-				{
-					if(common.debug)
-						cout<<"* header message, welcome Multiclass! ^_^"<<endl;
-					info->header=1;//mark header status as received
-				}
+				//Press
+				if(buffer[2]==0x41)
+				{						
 				
-				if(buffer[0]==0xAA && buffer[1]==0xAA)
-				{
+					driver_event event;
+					event.id=info->id;
+					event.address=info->address;
+					event.type=EVENT_POINTER;
+					event.pointer.button= 1;
+					event.pointer.pointer=0;
+					event.pointer.x=(float)x/4096.0f;
+					event.pointer.y=(float)y/4096.0f;
+					push_event(&info->events,event);
 					
-					y = (buffer[3]<<6) | buffer[4];
-					x = (buffer[5]<<6) | buffer[6];
+					//last good known coords
+					info->lx=x;
+					info->ly=y;
 					
-					checksum = buffer[2] ^ buffer[3] ^ buffer[4] ^ buffer[5] ^ buffer[6];
+				}
+				else
+				{
+					//Release
+					driver_event event;
+					event.id=info->id;
+					event.address=info->address;
+					event.type=EVENT_POINTER;
+					event.pointer.button=0;
+					event.pointer.pointer=0;
+					event.pointer.x=(float)info->lx/4096.0f;
+					event.pointer.y=(float)info->ly/4096.0f;
+					push_event(&info->events,event);
 					
-					//checksum validation
-					if(buffer[7]==checksum)
-					{
-						//Press
-						if(buffer[2]==0x41)
-						{						
-						
-							driver_event event;
-							event.id=info->id;
-							event.address=info->address;
-							event.type=EVENT_POINTER;
-							event.pointer.button= 1;
-							event.pointer.pointer=0;
-							event.pointer.x=(float)x/4096.0f;
-							event.pointer.y=(float)y/4096.0f;
-							pointer_callback(event);
-							
-							//last good known coords
-							lx=x;
-							ly=y;
-							
-						}
-						else
-						{
-							//Release
-							driver_event event;
-							event.id=info->id;
-							event.address=info->address;
-							event.type=EVENT_POINTER;
-							event.pointer.button=0;
-							event.pointer.pointer=0;
-							event.pointer.x=(float)lx/4096.0f;
-							event.pointer.y=(float)ly/4096.0f;
-							pointer_callback(event);
-							
-						}
-					}
-					else
-					{
-						cout<<"[MultiClassBoard]: Checksum error"<<endl;
-					}	
-			
 				}
-				
-				pBuffer=0;
 			}
 			else
 			{
-				pBuffer++;
-			}
-		}
-		else
-		{
-			/*
-			 * If there is no data we just wait for a 1/10 second in order to avoid a full idle loop
-			 * This cause a small latency after each idle state. There is some room for improvement here
-			 */
-			if(res==0)
-			{ 
-				usleep(100000);//100ms
-				cout<<"res==0"<<endl;
-			} 
-			else
-			{
-				usleep(10000);//10ms
-				//sending error event
-				/*
-				driver_event event;
-				event.id=info->id;
-				event.address=info->address;
-				event.type=EVENT_STATUS;
-				event.status.id=STATUS_COMMERROR;
-				pointer_callback(event);
-				*/ 
-			}
-			//cout<<"Error reading..."<<endl;
+				cout<<"[MultiClassBoard]: Checksum error"<<endl;
+				stats_count(&info->stats.checksum_errors);
+			}	
+	
 		}
-
+		
+		stats_report(&info->stats,timestamp);
+		info->pBuffer=0;
 	}
+	else
+	{
+		info->pBuffer++;
+	}
+}
+
+/**
+* Serial port callback, runs on the reactor thread
+*/
+void read_data(int fd,unsigned int events,void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	int res;
+	uint8_t data[32];
+	unsigned long long timestamp = monotonic_ns();
+	
+	//take whatever is there, the port is non-blocking
+	res = read(fd,data,sizeof(data));
+	if(res>0 && info->record!=NULL)
+		record_write(info->record,data,res,timestamp);
+	
+	for(int n=0;n<res;n++)
+		parse_byte(info,data[n],timestamp);
 	
-	//turn off keep_alive thread
-	info->keep_alive_quit_request=true;
+	if(res<=0 && (events & (EPOLLERR | EPOLLHUP)))
+	{
+		cerr<<"[MultiClassDriver] Serial port is gone"<<endl;
+		stats_count(&info->stats.usb_errors);
 		
-	if(common.debug)
-		cout<<"[MultiClassDriver] thread_core::exit"<<endl;
-	close_driver(info);
+		//sending error event
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_COMMERROR;
+		push_event(&info->events,event);
+		
+		//stop watching it or it would fire forever
+		reactor_remove_fd(fd);
+	}
+}
+
+/**
+* Recorded bytes, runs on the reactor thread
+*/
+void replay_data(void * param,unsigned char * data,int length,unsigned long long timestamp)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
 	
-	return NULL;	
+	for(int n=0;n<length;n++)
+		parse_byte(info,data[n],timestamp);
 }
 
 
@@ -382,13 +472,12 @@ void init_driver(driver_instance_info * info)
 	int found=-1;
 	unsigned int address; 
 	struct termios options;
-	int res;
 	stringstream ss;
 	
 	if(common.debug)
 		cout<<"[MultiClassDriver]init_driver"<<endl;
 	
-	ss<<"/dev/ttyUSB"<<multiclass.tty;
+	ss<<"/dev/ttyUSB"<<info->params.values[PARAM_MULTICLASS_TTY];
 	info->fd = open(ss.str().c_str(),O_RDWR | O_NOCTTY | O_NONBLOCK);
 	fcntl(info->fd, F_SETFL, FNDELAY); //set non-blocking reads
 	if(common.debug)
@@ -406,10 +495,23 @@ void init_driver(driver_instance_info * info)
     tcsetattr(info->fd, TCSANOW, &options);
     	
 	
-	//from what I tested, I should wait at least one second before start reading the board
-	if(common.debug)
-		cout<<"[MultiClassDriver] Waiting"<<endl;
-	sleep(1);
+	info->header=0;
+	info->pBuffer=0;
+	info->lx=0;
+	info->ly=0;
+}
+
+/**
+* Initializes the board once it had time to wake up, runs on the reactor thread
+*/
+void send_init(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	int res;
+	
+	reactor_remove_timer(info->init_timer);
+	info->init_timer=-1;
+	
 	if(common.debug)
 		cout<<"[MultiClassDriver] Initialiazing...";
 	
@@ -419,17 +521,19 @@ void init_driver(driver_instance_info * info)
 		if(res>0)cout<<"done"<<endl;
 			else cout<<"fail"<<endl;
 	}
-		
+	
+	if(reactor_add_fd(info->fd,EPOLLIN,read_data,info)!=0)
+		cerr<<"[MultiClassDriver] Failed to watch serial port"<<endl;
+	
+	info->keep_alive_timer=reactor_add_timer(1000,1000,keep_alive,info);
+	
 	//sending ready event
 	driver_event event;
 	event.id=info->id;
 	event.address=info->address;
 	event.type=EVENT_STATUS;
 	event.status.id=STATUS_READY;
-	pointer_callback(event);
-	
-
-	info->header=0;
+	push_event(&info->events,event);
 }
 
 /**
@@ -449,7 +553,7 @@ void close_driver(driver_instance_info * info)
 	event.address=info->address;
 	event.type=EVENT_STATUS;
 	event.status.id=STATUS_SHUTDOWN;
-	pointer_callback(event);
+	push_event(&info->events,event);
 }
 
 
@@ -460,7 +564,16 @@ void set_parameter(const char * key,unsigned int value)
 {
 	if(common.debug)
 		cout<<"[MultiClassDriver] set_parameter:"<<value<<endl;
-	*(parameter_map[key])=value;
+	
+	//per device screen mapping, see calibration.h
+	if(device_set_calibration<driver_instance_info>(&driver_instances,key,value)==0)
+		return;
+	
+	if(params_set(&parameters,key,value)!=0)
+		cerr<<"[MultiClassDriver] unknown parameter:"<<key<<endl;
+	
+	//scheduling options go to the reactor thread right away
+	device_set_sched(key,common);
 }
 
 /**
@@ -468,13 +581,11 @@ void set_parameter(const char * key,unsigned int value)
 */
 int get_parameter(const char * key,unsigned int * value)
 {
-	map<string,unsigned int *>::iterator it;
-	
-	it=parameter_map.find(key);
-	
-	if(it==parameter_map.end())return -1;
-	
-	*value=*parameter_map[key];
+	if(device_get_sched(key,value)!=0 &&
+		device_get_stats<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		device_get_calibration<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		params_get(&parameters,key,value)!=0)
+		return -1;
 	
 	if(common.debug)
 		cout<<"[MultiClassDriver] get_parameter:"<<*value<<endl;
@@ -486,18 +597,11 @@ int get_parameter(const char * key,unsigned int * value)
  */ 
 unsigned int get_status(unsigned int address)
 {
-	unsigned int ret = DEV_STATUS_STOP;
-	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-		if(driver_instances[n]->address==address)
-		{
-			ret=DEV_STATUS_RUNNING;
-			break;
-		}
-	}
+	//lock free, the host may poll it while devices start or stop
+	if(registry_has_address(&driver_instances,address))
+		return DEV_STATUS_RUNNING;
 	
-	return ret;
+	return DEV_STATUS_STOP;
 }
 
 
@@ -3,12 +3,17 @@
 #include <mrpdi/BaseDriver.h>
 #include <libusb-1.0/libusb.h>
 #include "utils.h"
+#include "reactor.h"
+#include "events.h"
+#include "registry.h"
+#include "params.h"
+#include "device.h"
+#include "record.h"
 #include <pthread.h>
 #include <cstring>
 #include <iostream>
 #include <sstream>
 #include <vector>
-#include <map>
 
 using namespace std;
 
@@ -16,13 +21,35 @@ struct driver_instance_info
 {
 	unsigned int id;
 	unsigned int address;
-	pthread_t thread;
-	bool quit_request;
+	bool started;
+	
+	//held while it starts, see device_start()
+	pthread_mutex_t start_lock;
 	libusb_device_handle * handle;
+	
+	//pending interrupt transfer, reading is false once it is back for good
+	libusb_transfer * transfer;
+	bool reading;
+	unsigned char buffer[64];
+	
+	//counters, see stats.h
+	device_stats stats;
+	
+	//raw stream capture or replay, see record.h. NULL when not in use
+	record_file * record;
+	replay_file * replay;
+	
+	//events waiting for the host
+	event_queue events;
 };
 
 void (*pointer_callback) (driver_event);
-void * thread_core(void*);
+void open_device(void * param);
+void start_device(void * param);
+void stop_device(void * param);
+void parse_report(driver_instance_info * info,unsigned char * buffer,int length);
+void read_callback(libusb_transfer * transfer);
+void replay_report(void * data,unsigned char * buffer,int length,unsigned long long timestamp);
 void init_driver(driver_instance_info * info);
 void close_driver(driver_instance_info * info);
 
@@ -40,16 +67,22 @@ driver_device_info supported_devices [] =
 driver_parameter_info supported_parameters [] = 
 {
 {0x00000000,"common.debug"},
+{0x00000000,"common.rt_policy"},
+{0x00000000,"common.rt_priority"},
+{0x00000000,"common.cpu_affinity"},
+{0x00000000,"common.mlock"},
+{0x00000000,"common.rt_status"},
+{0x00000000,"common.record"},
 {0x0d480001,"activeboard.calibrate"},
 {0x0d480001,"activeboard.pointers"},
 {0xffffffff,"EOL"}
 };
 
 
-vector<driver_instance_info *> driver_instances;
+device_registry driver_instances;
 
 
-map<string,unsigned int *> parameter_map;
+param_store parameters;
 
 /**
  * Parameters
@@ -58,6 +91,15 @@ map<string,unsigned int *> parameter_map;
 struct t_common
 {
 	unsigned int debug;
+	
+	//reactor thread scheduling, see reactor_set_sched()
+	unsigned int rt_policy;
+	unsigned int rt_priority;
+	unsigned int cpu_affinity;
+	unsigned int mlock;
+	
+	//raw stream capture, see record.h
+	unsigned int record;
 } common ;
 
 struct t_activeboard
@@ -68,20 +110,32 @@ struct t_activeboard
 
 libusb_context *ctx = NULL;
 
+//boards using the libusb fds and the timer used when they don't cover timeouts
+int usb_watchers=0;
+int usb_timer=-1;
+
+//name, variable and default value of each parameter
+param_key parameter_table [] =
+{
+{"common.debug",&common.debug,0},
+{"activeboard.calibrate",&activeboard.calibrate,1},
+{"activeboard.pointers",&activeboard.pointers,1},
+{"common.rt_policy",&common.rt_policy,0},
+{"common.rt_priority",&common.rt_priority,0},
+{"common.cpu_affinity",&common.cpu_affinity,0},
+{"common.mlock",&common.mlock,0},
+{"common.record",&common.record,0},
+};
+
 /**
 * global driver initialization
 */
 void init()
 {
 	
-	parameter_map["common.debug"]=&common.debug;
-	parameter_map["activeboard.calibrate"]=&activeboard.calibrate;
-	parameter_map["activeboard.pointers"]=&activeboard.pointers;
+	params_init(&parameters,parameter_table,sizeof(parameter_table)/sizeof(param_key));
 	
-	//default values
-	common.debug=0;
-	activeboard.calibrate=1;
-	activeboard.pointers=1;
+	registry_init(&driver_instances);
 	
 	if(libusb_init(&ctx)<0)
 	{
@@ -105,176 +159,327 @@ void shutdown()
 */
 void start(unsigned int id,unsigned int address)
 {
-	bool found=false;
 	driver_instance_info * info;
-	char path[16];
 	
+	info = new driver_instance_info;
+	info->id=id;
+	info->address=address;
+	info->handle=NULL;
+	info->transfer=NULL;
+	info->reading=false;
+	info->record=NULL;
+	info->replay=NULL;
+	stats_init(&info->stats);
+	
+	if(common.debug)
+		cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
 	
-	for(int n=0;n<driver_instances.size();n++)
+	//refused when the device is already running
+	if(device_start(&driver_instances,info,open_device,start_device)!=0)
 	{
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
-		{
-			found=true;
-			break;
-		}
+		cerr<<"driver already loaded!"<<endl;
+		delete info;
 	}
+}
+
+/**
+* device shut down
+*/
+void stop(unsigned int id,unsigned int address)
+{
+	driver_instance_info * info;
 	
-	if(!found)
+	info = (driver_instance_info *)registry_remove(&driver_instances,id,address);
+	
+	if(info!=NULL)
 	{
-		if(common.debug)
-			cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
-						
-		info = new driver_instance_info;
-		info->id=id;
-		info->address=address;
-		info->quit_request=false;
-		driver_instances.push_back(info);
-		
-		if(pthread_create(&info->thread, NULL,  thread_core, info)!=0)
-		{
-			cerr<<"Failed to spawn thread"<<endl;
-		}
-
 		
+		if(common.debug)
+			cout<<"stop:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
 		
+		device_stop(info,stop_device);
+		delete info;
 	}
 	else
 	{
-		cerr<<"driver already loaded!"<<endl;
+		cerr<<"driver already unloaded!"<<endl;
 	}
 	
 
 }
 
+
 /**
-* device shut down
+* libusb has work to do, runs on the reactor thread
 */
-void stop(unsigned int id,unsigned int address)
+void usb_events(int fd,unsigned int events,void * param)
 {
-	bool found=false;
-	vector<driver_instance_info *> tmp;
-	driver_instance_info * info;
+	struct timeval tv={0,0};
 	
+	libusb_handle_events_timeout(ctx,&tv);
+}
+
+/**
+* libusb timeouts, when it can't handle them through its own fds
+*/
+void usb_timeout(void * param)
+{
+	struct timeval tv={0,0};
 	
-	for(int n=0;n<driver_instances.size();n++)
-	{
+	libusb_handle_events_timeout(ctx,&tv);
+}
 
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
-		{
-			found=true;
-			info=driver_instances[n];
-		}
-		else
-		{
-			tmp.push_back(driver_instances[n]);
-		}
-	}
+/**
+* libusb opened a new fd
+*/
+void usb_fd_added(int fd,short events,void * user_data)
+{
+	//poll and epoll share the values of IN and OUT
+	if(reactor_add_fd(fd,events,usb_events,NULL)!=0)
+		cerr<<"[PrometheanDriver]: Failed to watch USB fd"<<endl;
+}
+
+/**
+* libusb closed a fd
+*/
+void usb_fd_removed(int fd,void * user_data)
+{
+	reactor_remove_fd(fd);
+}
+
+/**
+* Hands the libusb fds to the reactor while some board is running
+*/
+void watch_usb()
+{
+	const libusb_pollfd ** fds;
+	
+	if(usb_watchers++>0)
+		return;
 	
-	if(found)
+	fds=libusb_get_pollfds(ctx);
+	if(fds!=NULL)
 	{
-		
-		driver_instances=tmp;
-		
-		if(common.debug)
-			cout<<"stop:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
-		info->quit_request=true;
-		if(common.debug)
-			cout<<"joining to:"<<info->address<<endl;
-		pthread_join(info->thread,NULL);
-		//once thread is already dead we don't need its instance reference anymore
-		delete info;
+		for(int n=0;fds[n]!=NULL;n++)
+			usb_fd_added(fds[n]->fd,fds[n]->events,NULL);
+		libusb_free_pollfds(fds);
 	}
-	else
+	libusb_set_pollfd_notifiers(ctx,usb_fd_added,usb_fd_removed,NULL);
+	
+	if(libusb_pollfds_handle_timeouts(ctx)==0)
+		usb_timer=reactor_add_timer(100,100,usb_timeout,NULL);
+}
+
+/**
+* Takes the libusb fds back once the last board stops
+*/
+void unwatch_usb()
+{
+	const libusb_pollfd ** fds;
+	
+	if(--usb_watchers>0)
+		return;
+	
+	libusb_set_pollfd_notifiers(ctx,NULL,NULL,NULL);
+	fds=libusb_get_pollfds(ctx);
+	if(fds!=NULL)
 	{
-		cerr<<"driver already unloaded!"<<endl;
+		for(int n=0;fds[n]!=NULL;n++)
+			reactor_remove_fd(fds[n]->fd);
+		libusb_free_pollfds(fds);
 	}
 	
+	reactor_remove_timer(usb_timer);
+	usb_timer=-1;
+}
 
+/**
+* Opens the board, on the thread starting it as claiming it blocks
+*/
+void open_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	//fed from a recording instead, when there is one of this board
+	info->replay=replay_open(info->id,replay_report,info);
+	if(info->replay==NULL)
+		init_driver(info);
 }
 
+/**
+* Starts reading the opened board, runs on the reactor thread
+*/
+void start_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	if(info->replay!=NULL)
+	{
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_READY;
+		push_event(&info->events,event);
+		replay_start(info->replay);
+		return;
+	}
+	
+	if(info->handle==NULL)
+		return;
+	
+	info->record=record_open(common.record!=0,"promethean",info->id,info->address);
+	
+	watch_usb();
+	
+	info->transfer=libusb_alloc_transfer(0);
+	libusb_fill_interrupt_transfer(info->transfer,info->handle,(1 | LIBUSB_ENDPOINT_IN),info->buffer,64,read_callback,info,0);
+	info->reading=(libusb_submit_transfer(info->transfer)==0);
+	if(!info->reading)
+		cerr<<"[PrometheanDriver]: Failed to submit transfer"<<endl;
+}
 
 /**
-* Thread callback function
+* Stops reading and closes the board, runs on the reactor thread
 */
-void * thread_core(void* param)
+void stop_device(void * param)
 {
 	driver_instance_info * info = (driver_instance_info *)param;
-	int res;
-	int length;
-	unsigned char buffer[65];
+	struct timeval tv={0,100000};
+	
+	if(info->replay!=NULL)
+	{
+		replay_close(info->replay);
+		info->replay=NULL;
+		
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_SHUTDOWN;
+		push_event(&info->events,event);
+		return;
+	}
+	
+	if(info->transfer!=NULL)
+	{
+		//the transfer owns info until its callback sees the cancel
+		if(info->reading)
+			libusb_cancel_transfer(info->transfer);
+		while(info->reading)
+			libusb_handle_events_timeout(ctx,&tv);
+		
+		libusb_free_transfer(info->transfer);
+		info->transfer=NULL;
+		unwatch_usb();
+	}
+	
+	close_driver(info);
+	
+	record_close(info->record);
+	info->record=NULL;
+}
+
+/**
+* Parses one input report
+*/
+void parse_report(driver_instance_info * info,unsigned char * buffer,int length)
+{
 	int mx,my;
 	int in_range;
 	int button[6];
-
-	init_driver(info);
 	
-	if(common.debug)
-		cout<<"thread_core::enter"<<endl;
-		
-	while(!info->quit_request)
+	switch(info->id)
 	{
-		res=libusb_interrupt_transfer(info->handle,(1 | LIBUSB_ENDPOINT_IN),buffer,64,&length,1000);
-		switch(res)
-		{
-		
-			case 0:
-				switch(info->id)
-				{
-					case 0x0d480001:
-						mx = (int)(buffer[3]+(buffer[4]<<8));
-						my = (int)(buffer[5]+(buffer[6]<<8));
-						in_range = (buffer[7] & 0x04)>>2;
-						button[0] = buffer[7] & 0x01;
-						button[1] = (buffer[7] & 0x02)>>1;						
-						
-						if(common.debug==1)
-						{
-							for(int n=0;n<(length-1);n++)
-								cout<<hex<<(int)buffer[n]<<",";
-							
-							cout<<hex<<(int)buffer[length-1]<<endl;
-							
-						}
-						
-						driver_event event;
-						event.id=info->id;
-						event.address=info->address;
-						event.type=EVENT_POINTER;
-						event.pointer.pointer=0;
-						event.pointer.x=(float)mx/32767.0f;
-						event.pointer.y=(float)my/32767.0f;
-												
-						event.pointer.button=button[0] | (button[1]<<1);
-						pointer_callback(event);
-						
-						
-					break;
-				}
-			break;
+		case 0x0d480001:
+			mx = (int)(buffer[3]+(buffer[4]<<8));
+			my = (int)(buffer[5]+(buffer[6]<<8));
+			in_range = (buffer[7] & 0x04)>>2;
+			button[0] = buffer[7] & 0x01;
+			button[1] = (buffer[7] & 0x02)>>1;						
+			
+			if(__atomic_load_n(&common.debug,__ATOMIC_RELAXED)==1)
+			{
+				for(int n=0;n<(length-1);n++)
+					cout<<hex<<(int)buffer[n]<<",";
+				
+				cout<<hex<<(int)buffer[length-1]<<endl;
+				
+			}
 			
-			case LIBUSB_ERROR_TIMEOUT:
-				/*cout<<"[PrometheanDriver]: USB Timeout"<<endl;*/
+			driver_event event;
+			event.id=info->id;
+			event.address=info->address;
+			event.type=EVENT_POINTER;
+			event.pointer.pointer=0;
+			event.pointer.x=(float)mx/32767.0f;
+			event.pointer.y=(float)my/32767.0f;
+									
+			event.pointer.button=button[0] | (button[1]<<1);
+			push_event(&info->events,event);
 			
-			break;
 			
-			default:
-				cerr<<"[PrometheanDriver]: Unkown USB error"<<endl;
-				driver_event event;
-				event.id=info->id;
-				event.address=info->address;
-				event.type=EVENT_STATUS;
-				event.status.id=STATUS_COMMERROR;
-				pointer_callback(event);
-		}
+		break;
+	}
+}
+
+/**
+* Recorded report, runs on the reactor thread
+*/
+void replay_report(void * data,unsigned char * buffer,int length,unsigned long long timestamp)
+{
+	driver_instance_info * info = (driver_instance_info *)data;
+	
+	parse_report(info,buffer,length);
+	stats_report(&info->stats,timestamp);
+}
+
+/**
+* Interrupt transfer callback, runs on the reactor thread
+*/
+void read_callback(libusb_transfer * transfer)
+{
+	driver_instance_info * info = (driver_instance_info *)transfer->user_data;
+	unsigned long long timestamp;
+	
+	switch(transfer->status)
+	{
+	
+		case LIBUSB_TRANSFER_COMPLETED:
+			timestamp=monotonic_ns();
+			if(info->record!=NULL)
+				record_write(info->record,transfer->buffer,transfer->actual_length,timestamp);
+			
+			parse_report(info,transfer->buffer,transfer->actual_length);
+			stats_report(&info->stats,timestamp);
+		break;
 		
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			/*cout<<"[PrometheanDriver]: USB Timeout"<<endl;*/
 		
+		break;
+		
+		case LIBUSB_TRANSFER_CANCELLED:
+			info->reading=false;
+			return;
 		
+		default:
+			cerr<<"[PrometheanDriver]: Unkown USB error"<<endl;
+			stats_count(&info->stats.usb_errors);
+			driver_event event;
+			event.id=info->id;
+			event.address=info->address;
+			event.type=EVENT_STATUS;
+			event.status.id=STATUS_COMMERROR;
+			push_event(&info->events,event);
 	}
-	if(common.debug)
-		cout<<"thread_core::exit"<<endl;
-	close_driver(info);
 	
-	return NULL;	
+	//keep one transfer always pending
+	if(libusb_submit_transfer(transfer)!=0)
+	{
+		cerr<<"[PrometheanDriver]: Failed to submit transfer"<<endl;
+		info->reading=false;
+	}
 }
 
 
@@ -353,7 +558,7 @@ void init_driver(driver_instance_info * info)
 	event.address=info->address;
 	event.type=EVENT_STATUS;
 	event.status.id=STATUS_READY;
-	pointer_callback(event);
+	push_event(&info->events,event);
 	
 }
 
@@ -386,7 +591,7 @@ void close_driver(driver_instance_info * info)
 	event.address=info->address;
 	event.type=EVENT_STATUS;
 	event.status.id=STATUS_SHUTDOWN;
-	pointer_callback(event);
+	push_event(&info->events,event);
 }
 
 
@@ -397,7 +602,16 @@ void set_parameter(const char * key,unsigned int value)
 {
 	if(common.debug)
 		cout<<"[PrometheanDriver::set_parameter]:"<<value<<endl;
-	*(parameter_map[key])=value;
+	
+	//per device screen mapping, see calibration.h
+	if(device_set_calibration<driver_instance_info>(&driver_instances,key,value)==0)
+		return;
+	
+	if(params_set(&parameters,key,value)!=0)
+		cerr<<"[PrometheanDriver] unknown parameter:"<<key<<endl;
+	
+	//scheduling options go to the reactor thread right away
+	device_set_sched(key,common);
 }
 
 /**
@@ -405,13 +619,11 @@ void set_parameter(const char * key,unsigned int value)
 */
 int get_parameter(const char * key,unsigned int * value)
 {
-	map<string,unsigned int *>::iterator it;
-	
-	it=parameter_map.find(key);
-	
-	if(it==parameter_map.end())return -1;
-	
-	*value=*parameter_map[key];
+	if(device_get_sched(key,value)!=0 &&
+		device_get_stats<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		device_get_calibration<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		params_get(&parameters,key,value)!=0)
+		return -1;
 	
 	if(common.debug)
 		cout<<"[PrometheanDriver::get_parameter]:"<<*value<<endl;
@@ -423,18 +635,11 @@ int get_parameter(const char * key,unsigned int * value)
  */ 
 unsigned int get_status(unsigned int address)
 {
-	unsigned int ret = DEV_STATUS_STOP;
-	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-		if(driver_instances[n]->address==address)
-		{
-			ret=DEV_STATUS_RUNNING;
-			break;
-		}
-	}
+	//lock free, the host may poll it while devices start or stop
+	if(registry_has_address(&driver_instances,address))
+		return DEV_STATUS_RUNNING;
 	
-	return ret;
+	return DEV_STATUS_STOP;
 }
 
 
@@ -1,12 +1,16 @@
 
 
 #include <mrpdi/BaseDriver.h>
+#include "reactor.h"
+#include "events.h"
+#include "registry.h"
+#include "params.h"
+#include "device.h"
 #include <pthread.h>
 #include <cstring>
 #include <iostream>
 #include <sstream>
 #include <vector>
-#include <map>
 #include <cmath>
 #include <stdint.h>
 #include "libcam.h"
@@ -17,8 +21,10 @@ struct driver_instance_info
 {
 	unsigned int id;
 	unsigned int address;
-	pthread_t thread;
-	bool quit_request;
+	bool started;
+	
+	//held while it starts, see device_start()
+	pthread_mutex_t start_lock;
 	Camera * video0;
 	Camera * video1;
 	uint8_t * buffer0;
@@ -26,11 +32,27 @@ struct driver_instance_info
 	int click;
 	float px;
 	float py;
+	
+	//frames dequeued since the last processing
+	bool grabbed0;
+	bool grabbed1;
+	
+	//parameters as seen by this device, read by the reactor thread
+	param_snapshot params;
+	
+	//counters, see stats.h
+	device_stats stats;
+	
+	//events waiting for the host
+	event_queue events;
 };
 
 void (*pointer_callback) (driver_event);
-void * thread_core(void*);
-void * thread_aux(void*);
+void open_device(void * param);
+void start_device(void * param);
+void stop_device(void * param);
+void read_frame(int fd,unsigned int events,void * param);
+void process_frames(driver_instance_info * info);
 void init_driver(driver_instance_info * info);
 void close_driver(driver_instance_info * info);
 
@@ -63,16 +85,21 @@ driver_device_info supported_devices [] =
 driver_parameter_info supported_parameters [] = 
 {
 {0x00000000,"common.debug"},
+{0x00000000,"common.rt_policy"},
+{0x00000000,"common.rt_priority"},
+{0x00000000,"common.cpu_affinity"},
+{0x00000000,"common.mlock"},
+{0x00000000,"common.rt_status"},
 {0x0b8c000e,"dvit.calibrate"},
 {0x0b8c000e,"dvit.pointers"},
 {0xffffffff,"EOL"}
 };
 
 
-vector<driver_instance_info *> driver_instances;
+device_registry driver_instances;
 
 
-map<string,unsigned int *> parameter_map;
+param_store parameters;
 
 /**
  * Parameters
@@ -82,9 +109,16 @@ struct t_common
 {
 	unsigned int debug;
 	
+	//reactor thread scheduling, see reactor_set_sched()
+	unsigned int rt_policy;
+	unsigned int rt_priority;
+	unsigned int cpu_affinity;
+	unsigned int mlock;
+	
 	//used for debugging, not mapped
 	unsigned int address;
 	unsigned int id;
+	event_queue * events;
 	
 } common ;
 
@@ -96,22 +130,37 @@ struct t_dvit
 }dvit;
 
 
+//index of each parameter in the table below
+enum
+{
+	PARAM_COMMON_DEBUG,
+	PARAM_DVIT_CALIBRATE,
+	PARAM_DVIT_POINTERS,
+	PARAM_DVIT_METHOD
+};
+
+//name, variable and default value of each parameter
+param_key parameter_table [] =
+{
+{"common.debug",&common.debug,1},
+{"dvit.calibrate",&dvit.calibrate,1},
+{"dvit.pointers",&dvit.pointers,1},
+{"dvit.method",&dvit.method,5},
+{"common.rt_policy",&common.rt_policy,0},
+{"common.rt_priority",&common.rt_priority,0},
+{"common.cpu_affinity",&common.cpu_affinity,0},
+{"common.mlock",&common.mlock,0},
+};
+
 /**
 * global driver initialization
 */
 void init()
 {
 	
-	parameter_map["common.debug"]=&common.debug;
-	parameter_map["dvit.calibrate"]=&dvit.calibrate;
-	parameter_map["dvit.pointers"]=&dvit.pointers;
-	parameter_map["dvit.method"]=&dvit.method;
+	params_init(&parameters,parameter_table,sizeof(parameter_table)/sizeof(param_key));
 	
-	//default values
-	common.debug=1;
-	dvit.calibrate=1;
-	dvit.pointers=1;
-	dvit.method=5;
+	registry_init(&driver_instances);
 }
 
 /**
@@ -128,44 +177,22 @@ void shutdown()
 */
 void start(unsigned int id,unsigned int address)
 {
-	bool found=false;
 	driver_instance_info * info;
-	char path[16];
 	
+	info = new driver_instance_info;
+	info->id=id;
+	info->address=address;
+	stats_init(&info->stats);
 	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
-		{
-			found=true;
-			break;
-		}
-	}
+	if(common.debug)
+		cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
 	
-	if(!found)
-	{
-		if(common.debug)
-			cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
-						
-		info = new driver_instance_info;
-		info->id=id;
-		info->address=address;
-		info->quit_request=false;
-		driver_instances.push_back(info);
-		
-		if(pthread_create(&info->thread, NULL,  thread_core, info)!=0)
-		{
-			cerr<<"Failed to spawn thread"<<endl;
-		}
-
-		
-	}
-	else
+	//refused when the device is already running
+	if(device_start(&driver_instances,info,open_device,start_device)!=0)
 	{
 		cerr<<"driver already loaded!"<<endl;
+		delete info;
 	}
-	
-
 }
 
 /**
@@ -173,38 +200,17 @@ void start(unsigned int id,unsigned int address)
 */
 void stop(unsigned int id,unsigned int address)
 {
-	bool found=false;
-	vector<driver_instance_info *> tmp;
 	driver_instance_info * info;
 	
+	info = (driver_instance_info *)registry_remove(&driver_instances,id,address);
 	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
-		{
-			found=true;
-			info=driver_instances[n];
-		}
-		else
-		{
-			tmp.push_back(driver_instances[n]);
-		}
-	}
-	
-	if(found)
+	if(info!=NULL)
 	{
 		
-		driver_instances=tmp;
-		
 		if(common.debug)
 			cout<<"stop:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
-		info->quit_request=true;
 		
-		if(common.debug)
-			cout<<"joining to:"<<info->address<<endl;
-		pthread_join(info->thread,NULL);
-		//once thread is already dead we don't need its instance reference anymore
+		device_stop(info,stop_device);
 		delete info;
 	}
 	else
@@ -218,175 +224,214 @@ void stop(unsigned int id,unsigned int address)
 
 
 /**
-* Thread callback function
+* Opens the cameras, on the thread starting the device as that blocks
 */
-void * thread_core(void* param)
+void open_device(void * param)
 {
 	driver_instance_info * info = (driver_instance_info *)param;
-	int res;
-	int errors=0;
-	unsigned char buffer[65];
+	
+	params_snapshot(&parameters,info->address,&info->params);
 	init_driver(info);
-	int mx,my;
+}
+
+/**
+* Watches the opened cameras, runs on the reactor thread
+*/
+void start_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
 	
-			
-	if(common.debug)
-		cout<<"thread_core::enter"<<endl;
+	info->grabbed0=false;
+	info->grabbed1=false;
 	
-	cout<<"info:"<<(int)info->quit_request<<endl;
-		
-	while(!info->quit_request)
+	if(reactor_add_fd(info->video0->fd,EPOLLIN,read_frame,info)!=0 ||
+		reactor_add_fd(info->video1->fd,EPOLLIN,read_frame,info)!=0)
+		cerr<<"Failed to watch cameras"<<endl;
+}
+
+/**
+* Closes the cameras, runs on the reactor thread
+*/
+void stop_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	reactor_remove_fd(info->video0->fd);
+	reactor_remove_fd(info->video1->fd);
+	
+	close_driver(info);
+}
+
+/**
+* Camera callback, a frame is ready to be dequeued
+*/
+void read_frame(int fd,unsigned int events,void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	unsigned long long timestamp = monotonic_ns();
+	
+	if(fd==info->video0->fd && info->video0->Get()!=0)
+		info->grabbed0=true;
+	
+	if(fd==info->video1->fd && info->video1->Get()!=0)
+		info->grabbed1=true;
+	
+	//positions need a frame from each camera
+	if(info->grabbed0 && info->grabbed1)
 	{
+		info->grabbed0=false;
+		info->grabbed1=false;
+		params_refresh(&parameters,info->address,&info->params);
+		process_frames(info);
+		stats_report(&info->stats,timestamp);
+	}
+}
+
+/**
+* Computes the pointer position from the last pair of frames
+*/
+void process_frames(driver_instance_info * info)
+{
+	switch(info->id)
+	{
+		case 0x0b8c000e:
+			//IplImage * img0;
+			//IplImage * img1;
+			int c1,c2,cy,area0,area1;
+			double timestamp0,timestamp1;
+			float px,py;
+			
+			//cout<<"p1"<<endl;
+			
+			//step 1: video aquisition
+			/*
+			img0=cvQueryFrame(info->video0);
+			img1=cvQueryFrame(info->video1);
+			*/
+			//cvGrabFrame(info->video0);
+			//cvGrabFrame(info->video1);
+			//img0=cvRetrieveFrame(info->video0);
+			//img1=cvRetrieveFrame(info->video1); 
+			/*
+			timestamp0=cvGetCaptureProperty(info->video0,CV_CAP_PROP_POS_FRAMES);
+			timestamp1=cvGetCaptureProperty(info->video1,CV_CAP_PROP_POS_FRAMES);
+			*/ 
+			//cout<<"Fetched frames:"<<timestamp0<<","<<timestamp1<<endl;
+			
+			//step 2: video post-processing
+			//cvThreshold(img0,img0,200,255,CV_THRESH_BINARY);
+			//cvThreshold(img1,img1,200,255,CV_THRESH_BINARY);
+			
+			//step 3: video analysis & computation
+			//get_center(img0,&c1,&cy,&area0);
+			
+			//get_center(img1,&c2,&cy,&area1);
 		
-		switch(info->id)
-		{
-			case 0x0b8c000e:
-				//IplImage * img0;
-				//IplImage * img1;
-				int c1,c2,cy,area0,area1;
-				double timestamp0,timestamp1;
-				float px,py;
-				
-				//cout<<"p1"<<endl;
-				
-				//step 1: video aquisition
-				/*
-				img0=cvQueryFrame(info->video0);
-				img1=cvQueryFrame(info->video1);
-				*/
-				//cvGrabFrame(info->video0);
-				//cvGrabFrame(info->video1);
-				//img0=cvRetrieveFrame(info->video0);
-				//img1=cvRetrieveFrame(info->video1); 
-				/*
-				timestamp0=cvGetCaptureProperty(info->video0,CV_CAP_PROP_POS_FRAMES);
-				timestamp1=cvGetCaptureProperty(info->video1,CV_CAP_PROP_POS_FRAMES);
-				*/ 
-				//cout<<"Fetched frames:"<<timestamp0<<","<<timestamp1<<endl;
-				
-				//step 2: video post-processing
-				//cvThreshold(img0,img0,200,255,CV_THRESH_BINARY);
-				//cvThreshold(img1,img1,200,255,CV_THRESH_BINARY);
-				
-				//step 3: video analysis & computation
-				//get_center(img0,&c1,&cy,&area0);
-				
-				//get_center(img1,&c2,&cy,&area1);
 			
+			//both frames were dequeued by read_frame()
+			binarize(info->video0->data,info->buffer0);
+			binarize(info->video1->data,info->buffer1);
+			
+			get_center(info->buffer0,&c1,&cy,&area0);
+			get_center(info->buffer1,&c2,&cy,&area1);
+			
+			
+			if(c1>0 && c2>0)
+			{
+				info->click=1;
+				info->px=px;
+				info->py=py;
+								
+				common.id=info->id;
+				common.address=info->address;
+				common.events=&info->events;
 				
-				//info->video0->Update(100,24);
-				//info->video1->Update(100,24);
-				info->video0->Update(info->video1,100,24);			
-				
-				binarize(info->video0->data,info->buffer0);
-				binarize(info->video1->data,info->buffer1);
+				switch(info->params.values[PARAM_DVIT_METHOD])
+				{
+					case 5:
+						method5(c1,c2,&px,&py);	
+					break;
+					
+					case 6:
+						method6(c1,c2,&px,&py);
+					break;
+				}
 				
-				get_center(info->buffer0,&c1,&cy,&area0);
-				get_center(info->buffer1,&c2,&cy,&area1);
 				
 				
-				if(c1>0 && c2>0)
+				if(info->params.values[PARAM_COMMON_DEBUG])
 				{
-					info->click=1;
-					info->px=px;
-					info->py=py;
-									
-					common.id=info->id;
-					common.address=info->address;
-					
-					switch(dvit.method)
-					{
-						case 5:
-							method5(c1,c2,&px,&py);	
-						break;
-						
-						case 6:
-							method6(c1,c2,&px,&py);
-						break;
-					}
-					
+					//cout<<"dvit:"<<dec<<c1<<","<<c2<<endl;
+					cout<<"pos:"<<px<<","<<py<<endl;
+					cout<<"timestamp 0:"<<dec<<info->video0->timestamp.tv_sec<<"."<<(info->video0->timestamp.tv_usec/1000)<<endl;
+					cout<<"timestamp 1:"<<info->video1->timestamp.tv_sec<<"."<<(info->video1->timestamp.tv_usec/1000)<<endl;
+					//cout<<"width:"<<area0<<","<<area1<<endl;
+					//float io_time = (info->video0->p2.tv_sec + (1.0f/info->video0->p2.tv_usec)) - (info->video0->p1.tv_sec + (1.0f/info->video0->p1.tv_usec));
+				
 					
+					cout<<"p1 "<<info->video0->p1.tv_sec<<":"<<info->video0->p1.tv_usec/1000<<endl;
+					cout<<"p2 "<<info->video0->p2.tv_sec<<":"<<info->video0->p2.tv_usec/1000<<endl;
+					cout<<"p3 "<<info->video0->p3.tv_sec<<":"<<info->video0->p3.tv_usec/1000<<endl;
+					cout<<"p4 "<<info->video0->p4.tv_sec<<":"<<info->video0->p4.tv_usec/1000<<endl;
 					
-					if(common.debug)
-					{
-						//cout<<"dvit:"<<dec<<c1<<","<<c2<<endl;
-						cout<<"pos:"<<px<<","<<py<<endl;
-						cout<<"timestamp 0:"<<dec<<info->video0->timestamp.tv_sec<<"."<<(info->video0->timestamp.tv_usec/1000)<<endl;
-						cout<<"timestamp 1:"<<info->video1->timestamp.tv_sec<<"."<<(info->video1->timestamp.tv_usec/1000)<<endl;
-						//cout<<"width:"<<area0<<","<<area1<<endl;
-						//float io_time = (info->video0->p2.tv_sec + (1.0f/info->video0->p2.tv_usec)) - (info->video0->p1.tv_sec + (1.0f/info->video0->p1.tv_usec));
+					cout<<"p1 "<<info->video1->p1.tv_sec<<":"<<info->video1->p1.tv_usec/1000<<endl;
+					cout<<"p2 "<<info->video1->p2.tv_sec<<":"<<info->video1->p2.tv_usec/1000<<endl;
+					cout<<"p3 "<<info->video1->p3.tv_sec<<":"<<info->video1->p3.tv_usec/1000<<endl;
+					cout<<"p4 "<<info->video1->p4.tv_sec<<":"<<info->video1->p4.tv_usec/1000<<endl;
 					
-						
-						cout<<"p1 "<<info->video0->p1.tv_sec<<":"<<info->video0->p1.tv_usec/1000<<endl;
-						cout<<"p2 "<<info->video0->p2.tv_sec<<":"<<info->video0->p2.tv_usec/1000<<endl;
-						cout<<"p3 "<<info->video0->p3.tv_sec<<":"<<info->video0->p3.tv_usec/1000<<endl;
-						cout<<"p4 "<<info->video0->p4.tv_sec<<":"<<info->video0->p4.tv_usec/1000<<endl;
-						
-						cout<<"p1 "<<info->video1->p1.tv_sec<<":"<<info->video1->p1.tv_usec/1000<<endl;
-						cout<<"p2 "<<info->video1->p2.tv_sec<<":"<<info->video1->p2.tv_usec/1000<<endl;
-						cout<<"p3 "<<info->video1->p3.tv_sec<<":"<<info->video1->p3.tv_usec/1000<<endl;
-						cout<<"p4 "<<info->video1->p4.tv_sec<<":"<<info->video1->p4.tv_usec/1000<<endl;
-						
-						driver_event event;
-						event.id=info->id;
-						event.address=info->address;
-						event.type=EVENT_DATA;
-						event.data.type=1;//c1 and c2 positions
-						*((unsigned int *)(event.data.buffer))=(unsigned int) c1;
-						*((unsigned int *)(event.data.buffer)+1) =(unsigned int) c2;
-						pointer_callback(event);
-						
-						event.data.type=3;//c1 and c2 areas
-						*((unsigned int *)(event.data.buffer))=(unsigned int) area0;
-						*((unsigned int *)(event.data.buffer)+1) =(unsigned int) area1;
-						pointer_callback(event);
-					}
+					driver_event event;
+					event.id=info->id;
+					event.address=info->address;
+					event.type=EVENT_DATA;
+					event.data.type=1;//c1 and c2 positions
+					*((unsigned int *)(event.data.buffer))=(unsigned int) c1;
+					*((unsigned int *)(event.data.buffer)+1) =(unsigned int) c2;
+					push_event(&info->events,event);
 					
+					event.data.type=3;//c1 and c2 areas
+					*((unsigned int *)(event.data.buffer))=(unsigned int) area0;
+					*((unsigned int *)(event.data.buffer)+1) =(unsigned int) area1;
+					push_event(&info->events,event);
+				}
+				
+				driver_event event;
+				event.id=info->id;
+				event.address=info->address;
+				event.type=EVENT_POINTER;
+				event.pointer.pointer=0;
+				event.pointer.x=px;
+				event.pointer.y=py;
+				event.pointer.button=1;//hack					
+				
+				push_event(&info->events,event);
+			}
+			else
+			{
+				if(info->click==1)
+				{
 					driver_event event;
 					event.id=info->id;
 					event.address=info->address;
 					event.type=EVENT_POINTER;
 					event.pointer.pointer=0;
-					event.pointer.x=px;
-					event.pointer.y=py;
-					event.pointer.button=1;//hack					
+					event.pointer.x=info->px;
+					event.pointer.y=info->py;
+					event.pointer.button=0;					
 					
-					pointer_callback(event);
-				}
-				else
-				{
-					if(info->click==1)
-					{
-						driver_event event;
-						event.id=info->id;
-						event.address=info->address;
-						event.type=EVENT_POINTER;
-						event.pointer.pointer=0;
-						event.pointer.x=info->px;
-						event.pointer.y=info->py;
-						event.pointer.button=0;					
-						
-						pointer_callback(event);
-						
-						info->click=0;
-					}
+					push_event(&info->events,event);
+					
+					info->click=0;
 				}
-											
-				
-				
-				
-				
-				
-			break;
-		}
-		
-		//sleep(0.0015);
-		//sleep(0.01);
+			}
+										
+			
+			
+			
+			
+			
+		break;
 	}
 	
-	close_driver(info);
-	
-	return NULL;	
 }
 
 
@@ -445,7 +490,7 @@ void init_driver(driver_instance_info * info)
 	event.address=info->address;
 	event.type=EVENT_STATUS;
 	event.status.id=STATUS_READY;
-	pointer_callback(event);
+	push_event(&info->events,event);
 }
 
 /**
@@ -480,7 +525,7 @@ void close_driver(driver_instance_info * info)
 	event.address=info->address;
 	event.type=EVENT_STATUS;
 	event.status.id=STATUS_SHUTDOWN;
-	pointer_callback(event);
+	push_event(&info->events,event);
 
 }
 
@@ -493,7 +538,16 @@ void set_parameter(const char * key,unsigned int value)
 {
 	if(common.debug)
 		cout<<"[SmartDViTDriver::set_parameter]:"<<value<<endl;
-	*(parameter_map[key])=value;
+	
+	//per device screen mapping, see calibration.h
+	if(device_set_calibration<driver_instance_info>(&driver_instances,key,value)==0)
+		return;
+	
+	if(params_set(&parameters,key,value)!=0)
+		cerr<<"[SmartDViTDriver] unknown parameter:"<<key<<endl;
+	
+	//scheduling options go to the reactor thread right away
+	device_set_sched(key,common);
 }
 
 /**
@@ -501,13 +555,11 @@ void set_parameter(const char * key,unsigned int value)
 */
 int get_parameter(const char * key,unsigned int * value)
 {
-	map<string,unsigned int *>::iterator it;
-	
-	it=parameter_map.find(key);
-	
-	if(it==parameter_map.end())return -1;
-	
-	*value=*parameter_map[key];
+	if(device_get_sched(key,value)!=0 &&
+		device_get_stats<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		device_get_calibration<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		params_get(&parameters,key,value)!=0)
+		return -1;
 	
 	if(common.debug)
 		cout<<"[SmartDViTDriver::get_parameter]:"<<*value<<endl;
@@ -519,18 +571,11 @@ int get_parameter(const char * key,unsigned int * value)
  */ 
 unsigned int get_status(unsigned int address)
 {
-	unsigned int ret = DEV_STATUS_STOP;
-	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-		if(driver_instances[n]->address==address)
-		{
-			ret=DEV_STATUS_RUNNING;
-			break;
-		}
-	}
+	//lock free, the host may poll it while devices start or stop
+	if(registry_has_address(&driver_instances,address))
+		return DEV_STATUS_RUNNING;
 	
-	return ret;
+	return DEV_STATUS_STOP;
 }
 
 
@@ -881,7 +926,7 @@ void method5(int c1,int c2,float * ox,float *oy)
 	cout<<"ox:"<<*ox<<endl;
 	cout<<"radius:"<<radius<<endl;
 	*/
-	if(common.debug)
+	if(__atomic_load_n(&common.debug,__ATOMIC_RELAXED))
 	{
 		driver_event event;
 		event.id=common.id;
@@ -890,7 +935,7 @@ void method5(int c1,int c2,float * ox,float *oy)
 		event.data.type=2;//angle1 and angle2 positions
 		*((float *)(event.data.buffer))=(float) (alpha*180.0/M_PI);
 		*((float *)(event.data.buffer)+1) =(float) (beta*180.0/M_PI);
-		pointer_callback(event);
+		push_event(common.events,event);
 	}					
 }
 
@@ -914,7 +959,7 @@ void method6(int c1,int c2,float * ox,float *oy)
 	*ox=radius * cos(alpha);
 	*oy=radius * sin(alpha);	
 	
-	if(common.debug)
+	if(__atomic_load_n(&common.debug,__ATOMIC_RELAXED))
 	{
 		driver_event event;
 		event.id=common.id;
@@ -923,7 +968,7 @@ void method6(int c1,int c2,float * ox,float *oy)
 		event.data.type=2;//angle1 and angle2 positions
 		*((float *)(event.data.buffer))=(float) (alpha*180.0/M_PI);
 		*((float *)(event.data.buffer)+1) =(float) (beta*180.0/M_PI);
-		pointer_callback(event);
+		push_event(common.events,event);
 	}
 	
 }
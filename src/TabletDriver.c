@@ -2,33 +2,140 @@
 #include <mrpdi/BaseDriver.h>
 #include "utils.h"
 #include "hidapi.h"
+#include "reactor.h"
+#include "events.h"
+#include "registry.h"
+#include "params.h"
+#include "device.h"
+#include "record.h"
 #include <pthread.h>
 #include <cstring>
 #include <iostream>
 #include <sstream>
 #include <vector>
-#include <map>
 
 using namespace std;
 
+//maximum number of input reports parsed per read
+#define REPORT_BATCH 16
+
+
+//report fields used by the generic decoder, NULL when missing
+struct pen_fields
+{
+	const hid_field * x;
+	const hid_field * y;
+	const hid_field * pressure;
+	const hid_field * in_range;
+	const hid_field * button[3];
+};
 
 struct driver_instance_info
 {
 	unsigned int id;
 	unsigned int address;
-	pthread_t thread;
-	bool quit_request;
 	hid_device * handle;
-	unsigned int params[32];
+	
+	//device unplugged, and being opened again by reopen_device(), both
+	//protected by instances_mutex
+	bool lost;
+	bool reopening;
+	bool started;
+	
+	//held while it starts, see device_start()
+	pthread_mutex_t start_lock;
+	
+	//model of the device, bound at start()
+	const device_ops<driver_instance_info> * device;
+	
+	//counters, see stats.h
+	device_stats stats;
+	
+	//raw stream capture or replay, see record.h. NULL when not in use
+	record_file * record;
+	replay_file * replay;
+	
+	//events waiting for the host
+	event_queue events;
+};
+
 
+/**
+ * Supported tablets, see device.h
+ */
+struct slate_tablet : public device_model
+{
+	static const unsigned int id=0x0b8c0083;
+	typedef device_instance<driver_instance_info,slate_tablet> instance;
+	
+	static void init(instance * info);
+	static void decode(instance * info,unsigned char * buffer,int length);
+};
+
+struct flex_tablet : public device_model
+{
+	static const unsigned int id=0x172f0037;
+	typedef device_instance<driver_instance_info,flex_tablet> instance;
+	
+	static void init(instance * info);
+	static void decode(instance * info,unsigned char * buffer,int length);
 };
 
+struct silvercrest_tablet : public device_model
+{
+	static const unsigned int id=0x172f0501;
+	typedef device_instance<driver_instance_info,silvercrest_tablet> instance;
+	
+	static void decode(instance * info,unsigned char * buffer,int length);
+};
+
+struct mousepen_tablet : public device_model
+{
+	static const unsigned int id=0x55430004;
+	typedef device_instance<driver_instance_info,mousepen_tablet> instance;
+	
+	static void decode(instance * info,unsigned char * buffer,int length);
+};
+
+struct mobi_tablet : public device_model
+{
+	static const unsigned int id=0x078c1005;
+	typedef device_instance<driver_instance_info,mobi_tablet> instance;
+	
+	static void decode(instance * info,unsigned char * buffer,int length);
+};
+
+//anything else, decoded from its report descriptor
+struct generic_tablet : public device_model
+{
+	static const unsigned int id=0xffffffff;
+	typedef device_instance<driver_instance_info,generic_tablet> instance;
+	
+	struct state
+	{
+		hid_report_layout layout;
+		pen_fields pen;
+	};
+	
+	static void init(instance * info);
+	static void decode(instance * info,unsigned char * buffer,int length);
+};
+
+
 void (*pointer_callback) (driver_event);
 
-void * thread_core(void*);
+void open_device(void * param);
+void start_device(void * param);
+void stop_device(void * param);
+void * reopen_device(void * param);
+void read_failed(driver_instance_info * info,int fd);
+void read_input_stats(driver_instance_info * info);
+void replay_report(void * data,unsigned char * buffer,int length,unsigned long long timestamp);
+void hotplug_callback(int event,const char * path,unsigned short vendor_id,unsigned short product_id,void * user_data);
 void init_driver(driver_instance_info * info);
 void close_driver(driver_instance_info * info);
 
+extern device_ops<driver_instance_info> device_table [];
 
 const char * name="Tablet Driver";
 const char * version="2.0-alpha1";
@@ -47,6 +154,12 @@ driver_device_info supported_devices [] =
 driver_parameter_info supported_parameters [] = 
 {
 {0x00000000,"common.debug"},
+{0x00000000,"common.rt_policy"},
+{0x00000000,"common.rt_priority"},
+{0x00000000,"common.cpu_affinity"},
+{0x00000000,"common.mlock"},
+{0x00000000,"common.rt_status"},
+{0x00000000,"common.record"},
 {0x0b8c0083,"slate.pointers"},
 {0x0b8c0083,"slate.pressure"},
 {0x0b8c0083,"slate.mapping.key1"},
@@ -61,10 +174,14 @@ driver_parameter_info supported_parameters [] =
 };
 
 
-vector<driver_instance_info *> driver_instances;
+device_registry driver_instances;
+pthread_mutex_t instances_mutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t instances_cond=PTHREAD_COND_INITIALIZER;
+
+int hotplug_handle=-1;
 
 
-map<string,unsigned int *> parameter_map;
+param_store parameters;
 
 /**
  * Parameters
@@ -73,6 +190,16 @@ map<string,unsigned int *> parameter_map;
 struct t_common
 {
 	unsigned int debug;
+	
+	//reactor and HID threads scheduling, see reactor_set_sched() and
+	//hid_set_thread_sched()
+	unsigned int rt_policy;
+	unsigned int rt_priority;
+	unsigned int cpu_affinity;
+	unsigned int mlock;
+	
+	//raw stream capture, see record.h
+	unsigned int record;
 } common ;
 
 struct t_slate
@@ -105,35 +232,36 @@ struct t_mobi
 	unsigned int pointers;
 } mobi ;	
 	
+//name, variable and default value of each parameter
+param_key parameter_table [] =
+{
+{"common.debug",&common.debug,0},
+{"slate.pointers",&slate.pointers,2},
+{"slate.pressure",&slate.pressure,1},
+{"slate.key1",&slate.key1,0},
+{"slate.key2",&slate.key2,0},
+{"slate.key3",&slate.key3,0},
+{"flex.pointers",&flex.pointers,1},
+{"flex.pressure",&flex.pressure,1},
+{"silvercrest.pointers",&silvercrest.pointers,1},
+{"mousepen.pointers",&mousepen.pointers,1},
+{"mobi.pointers",&mobi.pointers,1},
+{"common.rt_policy",&common.rt_policy,0},
+{"common.rt_priority",&common.rt_priority,0},
+{"common.cpu_affinity",&common.cpu_affinity,0},
+{"common.mlock",&common.mlock,0},
+{"common.record",&common.record,0},
+};
+
 /**
 * global driver initialization
 */
 void init()
 {
 	
-	parameter_map["common.debug"]=&common.debug;
-	parameter_map["slate.pointers"]=&slate.pointers;
-	parameter_map["slate.pressure"]=&slate.pressure;
-	parameter_map["slate.key1"]=&slate.key1;
-	parameter_map["slate.key2"]=&slate.key2;
-	parameter_map["slate.key3"]=&slate.key3;
-	
-	parameter_map["flex.pointers"]=&flex.pointers;
-	parameter_map["flex.pressure"]=&flex.pressure;
-	parameter_map["silvercrest.pointers"]=&silvercrest.pointers;
-	parameter_map["mousepen.pointers"]=&mousepen.pointers;
-	parameter_map["mobi.pointers"]=&mobi.pointers;
-	
-	//default values
-	common.debug=0;
-	
-	slate.pointers=2;
-	slate.pressure=1;
-	flex.pointers=1;
-	flex.pressure=1;
-	silvercrest.pointers=1;
-	mousepen.pointers=1;
-	mobi.pointers=1;
+	params_init(&parameters,parameter_table,sizeof(parameter_table)/sizeof(param_key));
+	
+	registry_init(&driver_instances);
 }
 
 /**
@@ -144,6 +272,11 @@ void shutdown()
 	if(common.debug)
 		cout<<"Shutdown:"<<name<<endl;
 	
+	if(hotplug_handle>=0)
+	{
+		hid_hotplug_deregister(hotplug_handle);
+		hotplug_handle=-1;
+	}
 }
 
 /**
@@ -151,349 +284,661 @@ void shutdown()
 */
 void start(unsigned int id,unsigned int address)
 {
-	bool found=false;
 	driver_instance_info * info;
-	char path[16];
-
-	for(int n=0;n<driver_instances.size();n++)
+	const device_ops<driver_instance_info> * device;
+	
+	//watch for unplugged devices coming back
+	pthread_mutex_lock(&instances_mutex);
+	if(hotplug_handle<0)
+		hotplug_handle=hid_hotplug_register(hotplug_callback,NULL);
+	pthread_mutex_unlock(&instances_mutex);
+	
+	//unknown tablets get the generic model
+	device=find_device(device_table,id);
+	
+	info = device->create();
+	info->id=id;
+	info->address=address;
+	info->handle=NULL;
+	info->lost=false;
+	info->reopening=false;
+	info->started=false;
+	info->device=device;
+	info->record=NULL;
+	info->replay=NULL;
+	stats_init(&info->stats);
+	
+	if(common.debug)
+		cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
+	
+	//refused when the device is already running
+	if(device_start(&driver_instances,info,open_device,start_device)!=0)
 	{
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
-		{
-			found=true;
-			break;
-		}
+		cerr<<"driver already loaded!"<<endl;
+		device->destroy(info);
 	}
+}
+
+/**
+* device shut down
+*/
+void stop(unsigned int id,unsigned int address)
+{
+	driver_instance_info * info;
+	
+	//hotplug_callback() looks at the instances with this lock held
+	pthread_mutex_lock(&instances_mutex);
+	info = (driver_instance_info *)registry_remove(&driver_instances,id,address);
 	
-	if(!found)
+	//a device being opened again is left alone until that is done
+	while(info!=NULL && info->reopening)
+		pthread_cond_wait(&instances_cond,&instances_mutex);
+	pthread_mutex_unlock(&instances_mutex);
+	
+	if(info!=NULL)
 	{
+		
 		if(common.debug)
-			cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
+			cout<<"stop:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
 		
-			
-		info = new driver_instance_info;
-		info->id=id;
-		info->address=address;
-		info->quit_request=false;
-		driver_instances.push_back(info);
+		device_stop(info,stop_device);
+		info->device->destroy(info);
+	}
+	else
+	{
+		cerr<<"driver already unloaded!"<<endl;
+	}
+	
+
+}
+
+/**
+* HID hotplug events, called from the HID event thread
+*/
+void hotplug_callback(int event,const char * path,unsigned short vendor_id,unsigned short product_id,void * user_data)
+{
+	unsigned int id = (vendor_id<<16) | product_id;
+	unsigned int address;
+	unsigned char iface;
+	void * list[REGISTRY_SIZE];
+	int count;
+	
+	if(event!=HID_HOTPLUG_ARRIVED || parse_path(path,&address,&iface)!=0)
+		return;
+	
+	pthread_mutex_lock(&instances_mutex);
+	
+	count=registry_list(&driver_instances,list,REGISTRY_SIZE);
+	for(int n=0;n<count;n++)
+	{
+		driver_instance_info * info = (driver_instance_info *)list[n];
+		
+		if(info->id!=id || get_iface(id,supported_devices)!=iface)
+			continue;
 		
-		if(pthread_create(&info->thread, NULL,  thread_core, info)!=0)
+		if(info->lost)
 		{
-			cerr<<"Failed to spawn thread"<<endl;
+			if(common.debug)
+				cout<<"device back:"<<hex<<id<<":"<<address<<endl;
+			
+			//the device gets a new address once plugged again, take it right
+			//now so the host can't start it twice. When the host got there
+			//first it stays lost, its key must keep matching its address
+			//for stop() to find it
+			if(registry_move(&driver_instances,id,info->address,address)!=0)
+			{
+				cerr<<"Error: "<<hex<<id<<":"<<address<<" already running"<<endl;
+				break;
+			}
+			info->address=address;
+			
+			//opening blocks, so it is done on a thread of its own, stop()
+			//waits for it
+			info->lost=false;
+			info->reopening=true;
+			
+			pthread_t thread;
+			if(pthread_create(&thread,NULL,reopen_device,info)==0)
+			{
+				pthread_detach(thread);
+			}
+			else
+			{
+				cerr<<"Error: Failed to reopen device"<<endl;
+				info->lost=true;
+				info->reopening=false;
+			}
+			break;
 		}
+	}
+	
+	pthread_mutex_unlock(&instances_mutex);
+}
 
-		
-		
+/**
+* Opens a device, on the thread starting it as opening blocks
+*/
+void open_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	//fed from a recording instead, when there is one of this model
+	info->replay=replay_open(info->id,replay_report,info);
+	if(info->replay==NULL)
+		init_driver(info);
+}
+
+/**
+* Watches the reports of an opened device, runs on the reactor thread
+*/
+void start_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	if(info->replay!=NULL)
+	{
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_READY;
+		push_event(&info->events,event);
+		replay_start(info->replay);
+		return;
 	}
-	else
+	
+	if(info->handle!=NULL && reactor_add_fd(hid_get_poll_fd(info->handle),EPOLLIN,info->device->read,info)!=0)
+		cerr<<"Error: Failed to watch USB device"<<endl;
+	
+	//a device plugged again keeps its recording going
+	if(info->handle!=NULL && info->record==NULL)
+		info->record=record_open(common.record!=0,"tablet",info->id,info->address);
+}
+
+/**
+* Closes a device, runs on the reactor thread
+*/
+void stop_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	if(info->replay!=NULL)
 	{
-		cerr<<"driver already loaded!"<<endl;
+		replay_close(info->replay);
+		info->replay=NULL;
+		
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_SHUTDOWN;
+		push_event(&info->events,event);
+		return;
 	}
 	
+	if(info->handle!=NULL)
+		reactor_remove_fd(hid_get_poll_fd(info->handle));
+	
+	close_driver(info);
+	
+	record_close(info->record);
+	info->record=NULL;
+}
 
+/**
+* Reopens a device plugged again, on a thread of its own
+*/
+void * reopen_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	open_device(info);
+	reactor_call(start_device,info);
+	
+	pthread_mutex_lock(&instances_mutex);
+	info->lost=(info->handle==NULL);
+	info->reopening=false;
+	pthread_cond_broadcast(&instances_cond);
+	pthread_mutex_unlock(&instances_mutex);
+	
+	return NULL;
 }
 
+
 /**
-* device shut down
+* Smart Slate WS200 reports
 */
-void stop(unsigned int id,unsigned int address)
+void slate_tablet::decode(instance * info,unsigned char * buffer,int length)
 {
-	bool found=false;
-	vector<driver_instance_info *> tmp;
-	driver_instance_info * info;
+	int mx,my,mz;
+	int button[3];
+	int stylus;
+	int key;
 	
+	if(buffer[0]==2)
+	{
+		key = buffer[7];
+		//there is room for improvement here!
+		/*
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_KEY;
+		event.key.keycode=key;
+		event.key.mod=0;
+		push_event(&info->events,event);
+		*/
+		if ( (key & 0x08) ==0x08)
+			cout<<"Key One"<<endl;
+			
+		if ( (key & 0x10) ==0x10)
+			cout<<"Key Middle"<<endl;
+			
+		if ( (key & 0x20) ==0x20)
+			cout<<"Key Two"<<endl;
+		 
+		
+	}
 	
-	for(int n=0;n<driver_instances.size();n++)
+	if(buffer[0]==2 && (buffer[1] & 0x90)==0x90)//in range test
 	{
-
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
+		
+		mx = (int)(buffer[2]+(buffer[3]<<8));
+		my = (int)(buffer[4]+(buffer[5]<<8));
+		mz = (int)(buffer[6]+(buffer[7]<<8));
+		
+		button[0] = buffer[1] & 0x01;
+		button[1] = (buffer[1] & 0x02)>>1;
+		button[2] = (buffer[1] & 0x04)>>2;
+		stylus = (buffer[1] & 0x20)>>5;
+		
+		//limits
+		//17319,10819
+		
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_POINTER;
+		event.pointer.pointer=0;
+		event.pointer.x=(float)mx/17319.0f;
+		event.pointer.y=(float)my/10819.0f;
+		event.pointer.z=(float)mz/512.0f;
+		
+		
+		if(stylus==0)
 		{
-			found=true;
-			info=driver_instances[n];
+			event.pointer.button=button[0] | (button[1]<<1) | (button[2]<<2);
 		}
 		else
 		{
-			tmp.push_back(driver_instances[n]);
-		}
+			event.pointer.button=0;
+		}					
+		
+		push_event(&info->events,event);
 	}
+}
+
+/**
+* Trust Flex Design reports
+*/
+void flex_tablet::decode(instance * info,unsigned char * buffer,int length)
+{
+	int mx,my,mz;
+	int button[3];
 	
-	if(found)
+	if(buffer[0]==16)//report ID 16
 	{
+		mx = (int)(buffer[2]+(buffer[3]<<8));
+		my = (int)(buffer[4]+(buffer[5]<<8));
+		mz = (int)(buffer[6]+(buffer[7]<<8));
 		
-		driver_instances=tmp;
-		if(common.debug)
-			cout<<"stop:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
+		button[0] = buffer[1] & 0x01;//tip
+		button[1] = (buffer[1] & 0x02)>>1;//barrel
+		button[2] = (buffer[1] & 0x04)>>2;//invert
+		//todo
 		
+		//12288,0,9216,0,1023
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_POINTER;
+		event.pointer.pointer=0;
+		event.pointer.x=(float)mx/12288.0f;
+		event.pointer.y=(float)my/9216.0f;
+		event.pointer.z=(float)mz/1024.0f;
 		
-		info->quit_request=true;
+		event.pointer.button=button[0] | (button[1]<<1) | (button[2]<<2);
 		
-		if(common.debug)
-			cout<<"joining to:"<<info->address<<endl;
+		push_event(&info->events,event);
+	}
+}
+
+/**
+* Silvercrest reports
+*/
+void silvercrest_tablet::decode(instance * info,unsigned char * buffer,int length)
+{
+	int mx,my,mz;
+	
+	if(buffer[0]==16)
+	{
+		mx = (int)(buffer[2]+(buffer[3]<<8));
+		my = (int)(buffer[4]+(buffer[5]<<8));
+		mz = (int) ( buffer[6] + (buffer[7]<<8));
+					
+		//18000,0,11000,0,1023
 		
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_POINTER;
+		event.pointer.pointer=0;
+		event.pointer.x=(float)mx/18000.0f;
+		event.pointer.y=(float)my/11000.0f;
+		event.pointer.z=(float)mz/1024.0f;
+		
+		event.pointer.button=0; //ToDo
 		
-		pthread_join(info->thread,NULL);
-		//once thread is already dead we don't need its instance reference anymore
-		delete info;
+		push_event(&info->events,event);
 	}
-	else
+}
+
+/**
+* Genius Mousepen reports
+*/
+void mousepen_tablet::decode(instance * info,unsigned char * buffer,int length)
+{
+	int mx,my,mz;
+	int button[2];
+	
+	if(buffer[0]==9)
 	{
-		cerr<<"driver already unloaded!"<<endl;
+		button[0] = buffer[1] & 0x01;//tip
+		button[1] = (buffer[1] & 0x02)>>1;//barrel
+		mx = (int)(buffer[2]+(buffer[3]<<8));
+		my = (int)(buffer[4]+(buffer[5]<<8));
+		mz = (int)(buffer[6]+(buffer[7]<<8));
+		
+		//pressure filter
+		button[0]=(mz<23) ? 0 : button[0];
+		
+		
+		//32767,0,32767,0,1023
+		
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_POINTER;
+		event.pointer.pointer=0;
+		event.pointer.x=(float)mx/32767.0f;
+		event.pointer.y=(float)my/32767.0f;
+		event.pointer.z=(float)mz/1024.0f;
+		
+		event.pointer.button=button[0] | (button[1]<<1);
+		push_event(&info->events,event);
+		
+		if(__atomic_load_n(&common.debug,__ATOMIC_RELAXED)==1)
+		{
+			cout<<dec<<"mx:"<<mx<<endl;
+			cout<<dec<<"my:"<<my<<endl;
+			cout<<dec<<"mz:"<<mz<<endl;
+		}
 	}
-	
+}
 
+/**
+* Interwrite Mobi reports
+*/
+void mobi_tablet::decode(instance * info,unsigned char * buffer,int length)
+{
+	int mx,my;
+	int button[3];
+	
+	//pointing messages comes from report ID 5
+	if(buffer[0]==5)
+	{
+		mx = (int)(buffer[1]+(buffer[2]<<8));
+		my = (int)(buffer[3]+(buffer[4]<<8));
+		
+		button[0] = buffer[5] & 0x01;
+		button[1] = (buffer[5] & 0x02)>>1;
+		button[2] = (buffer[5] & 0x04)>>2;
+	
+		
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_POINTER;
+		event.pointer.pointer=0;
+		event.pointer.x=(float)mx/8000.0f;
+		event.pointer.y=(float)my/6000.0f;
+								
+		event.pointer.button=button[0] | (button[1]<<1) | (button[2]<<2);
+		
+		push_event(&info->events,event);
+	}
 }
 
+/**
+* Looks for the digitizer fields in the report descriptor
+*/
+void generic_tablet::init(instance * info)
+{
+	pen_fields * pen = &info->state.pen;
+	hid_report_layout * layout = &info->state.layout;
+	int id;
+	
+	memset(pen,0,sizeof(pen_fields));
+	
+	if(hid_get_report_layout(info->handle,layout)!=0)
+		return;
+	
+	//generic desktop X, Y
+	pen->x = hid_layout_find(layout,-1,0x01,0x30);
+	if(pen->x==NULL)
+		return;
+	
+	//everything else must come in the same report
+	id = pen->x->report_id;
+	pen->y = hid_layout_find(layout,id,0x01,0x31);
+	
+	//digitizer tip pressure, in range, tip, barrel and eraser
+	pen->pressure = hid_layout_find(layout,id,0x0d,0x30);
+	pen->in_range = hid_layout_find(layout,id,0x0d,0x32);
+	pen->button[0] = hid_layout_find(layout,id,0x0d,0x42);
+	pen->button[1] = hid_layout_find(layout,id,0x0d,0x44);
+	pen->button[2] = hid_layout_find(layout,id,0x0d,0x45);
+	
+	//mouse like tablets report plain buttons
+	for(int n=0;n<3;n++)
+	{
+		if(pen->button[n]==NULL)
+			pen->button[n] = hid_layout_find(layout,id,0x09,n+1);
+	}
+	
+	if(pen->y==NULL)
+		pen->x=NULL;
+	
+	if(common.debug)
+		cout<<"generic decoder:"<<((pen->x!=NULL) ? "yes" : "no")<<endl;
+}
 
 /**
-* Thread callback function
+* Scales a field value to 0..1 using its logical range
 */
-void * thread_core(void* param)
+static float normalize(const hid_field * field,int value)
 {
-	driver_instance_info * info = (driver_instance_info *)param;
-	int res;
-	int errors=0;
-	unsigned char buffer[65];
-	init_driver(info);
+	if(field->logical_max<=field->logical_min)
+		return 0.0f;
 	
+	return (float)(value-field->logical_min)/(float)(field->logical_max-field->logical_min);
+}
+
+/**
+* Decodes a report using the fields of the report descriptor
+*/
+void generic_tablet::decode(instance * info,unsigned char * buffer,int length)
+{
+	pen_fields * pen = &info->state.pen;
 	int mx,my,mz;
-	int button[6];
-	int stylus;
-	int key;
+	int value;
+	
+	if(pen->x==NULL)
+		return;
+	
+	if(hid_field_value(pen->x,buffer,length,&mx)!=0 || hid_field_value(pen->y,buffer,length,&my)!=0)
+		return;
+	
+	if(pen->in_range!=NULL && hid_field_value(pen->in_range,buffer,length,&value)==0 && value==0)
+		return;
+	
+	driver_event event;
+	event.id=info->id;
+	event.address=info->address;
+	event.type=EVENT_POINTER;
+	event.pointer.pointer=0;
+	event.pointer.x=normalize(pen->x,mx);
+	event.pointer.y=normalize(pen->y,my);
+	event.pointer.z=0.0f;
+	event.pointer.button=0;
 	
-	while(!info->quit_request)
+	if(pen->pressure!=NULL && hid_field_value(pen->pressure,buffer,length,&mz)==0)
+		event.pointer.z=normalize(pen->pressure,mz);
+	
+	for(int n=0;n<3;n++)
 	{
-		//read 64 bytes with a 1000ms timeout
-		res = hid_read_timeout(info->handle,buffer,64,1000);
-		if(res>0)
-		{
-			if(common.debug==1)
-			{		
-				cout<<"*** DATA:"<<hex<<info->id<<":"<<info->address<<" ***"<<endl;
-				for(int n=0;n<res;n++)
-				{
-					cout<<dec<<(unsigned int)buffer[n]<<endl;
-				}
-				cout<<"***********"<<endl;
-			}
-			
-			
-			
-			switch(info->id)
-			{
-				//smart slate ws200
-				case 0x0b8c0083:
-				
-					if(buffer[0]==2)
-					{
-						key = buffer[7];
-						//there is room for improvement here!
-						/*
-						driver_event event;
-						event.id=info->id;
-						event.address=info->address;
-						event.type=EVENT_KEY;
-						event.key.keycode=key;
-						event.key.mod=0;
-						pointer_callback(event);
-						*/
-						if ( (key & 0x08) ==0x08)
-							cout<<"Key One"<<endl;
-							
-						if ( (key & 0x10) ==0x10)
-							cout<<"Key Middle"<<endl;
-							
-						if ( (key & 0x20) ==0x20)
-							cout<<"Key Two"<<endl;
-						 
-						
-					}
-					
-					if(buffer[0]==2 && (buffer[1] & 0x90)==0x90)//in range test
-					{
-						
-						mx = (int)(buffer[2]+(buffer[3]<<8));
-						my = (int)(buffer[4]+(buffer[5]<<8));
-						mz = (int)(buffer[6]+(buffer[7]<<8));
-						
-						button[0] = buffer[1] & 0x01;
-						button[1] = (buffer[1] & 0x02)>>1;
-						button[2] = (buffer[1] & 0x04)>>2;
-						stylus = (buffer[1] & 0x20)>>5;
-						
-						//limits
-						//17319,10819
-						
-						driver_event event;
-						event.id=info->id;
-						event.address=info->address;
-						event.type=EVENT_POINTER;
-						event.pointer.pointer=0;
-						event.pointer.x=(float)mx/17319.0f;
-						event.pointer.y=(float)my/10819.0f;
-						event.pointer.z=(float)mz/512.0f;
-						
-						
-						if(stylus==0)
-						{
-							event.pointer.button=button[0] | (button[1]<<1) | (button[2]<<2);
-						}
-						else
-						{
-							event.pointer.button=0;
-						}					
-						
-						pointer_callback(event);
-					}
-				break;
-				
-				//trust flex design
-				case 0x172f0037:
-					
-					if(buffer[0]==16)//report ID 16
-					{
-						mx = (int)(buffer[2]+(buffer[3]<<8));
-						my = (int)(buffer[4]+(buffer[5]<<8));
-						mz = (int)(buffer[6]+(buffer[7]<<8));
-						
-						button[0] = buffer[1] & 0x01;//tip
-						button[1] = (buffer[1] & 0x02)>>1;//barrel
-						button[2] = (buffer[1] & 0x04)>>2;//invert
-						//todo
-						
-						//12288,0,9216,0,1023
-						driver_event event;
-						event.id=info->id;
-						event.address=info->address;
-						event.type=EVENT_POINTER;
-						event.pointer.pointer=0;
-						event.pointer.x=(float)mx/12288.0f;
-						event.pointer.y=(float)my/9216.0f;
-						event.pointer.z=(float)mz/1024.0f;
-						
-						event.pointer.button=button[0] | (button[1]<<1) | (button[2]<<2);
-						
-						pointer_callback(event);
-						
-						
-					}
-				break;
-				
-				//silvercrest
-				case 0x172f0501:
-					if(buffer[0]==16)
-					{
-						mx = (int)(buffer[2]+(buffer[3]<<8));
-						my = (int)(buffer[4]+(buffer[5]<<8));
-						mz = (int) ( buffer[6] + (buffer[7]<<8));
-									
-						//18000,0,11000,0,1023
-						
-						driver_event event;
-						event.id=info->id;
-						event.address=info->address;
-						event.type=EVENT_POINTER;
-						event.pointer.pointer=0;
-						event.pointer.x=(float)mx/18000.0f;
-						event.pointer.y=(float)my/11000.0f;
-						event.pointer.z=(float)mz/1024.0f;
-						
-						event.pointer.button=0; //ToDo
-						
-						pointer_callback(event);
-					}
-				break;
-				
-				//Genius mousepen
-				case 0x55430004:
-					if(buffer[0]==9)
-					{
-						button[0] = buffer[1] & 0x01;//tip
-						button[1] = (buffer[1] & 0x02)>>1;//barrel
-						mx = (int)(buffer[2]+(buffer[3]<<8));
-						my = (int)(buffer[4]+(buffer[5]<<8));
-						mz = (int)(buffer[6]+(buffer[7]<<8));
-						
-						//pressure filter
-						button[0]=(mz<23) ? 0 : button[0];
-						
-						
-						//32767,0,32767,0,1023
-						
-						driver_event event;
-						event.id=info->id;
-						event.address=info->address;
-						event.type=EVENT_POINTER;
-						event.pointer.pointer=0;
-						event.pointer.x=(float)mx/32767.0f;
-						event.pointer.y=(float)my/32767.0f;
-						event.pointer.z=(float)mz/1024.0f;
-						
-						event.pointer.button=button[0] | (button[1]<<1);
-						pointer_callback(event);
-						
-						if(common.debug==1)
-						{
-							cout<<dec<<"mx:"<<mx<<endl;
-							cout<<dec<<"my:"<<my<<endl;
-							cout<<dec<<"mz:"<<mz<<endl;
-						}
-					}
-				break;
-				
-				
-				//Interwrite Mobi
-				case 0x078c1005:
-					//pointing messages comes from report ID 5
-					if(buffer[0]==5)
-					{
-						mx = (int)(buffer[1]+(buffer[2]<<8));
-						my = (int)(buffer[3]+(buffer[4]<<8));
-						
-						button[0] = buffer[5] & 0x01;
-						button[1] = (buffer[5] & 0x02)>>1;
-						button[2] = (buffer[5] & 0x04)>>2;
-					
-						
-						driver_event event;
-						event.id=info->id;
-						event.address=info->address;
-						event.type=EVENT_POINTER;
-						event.pointer.pointer=0;
-						event.pointer.x=(float)mx/8000.0f;
-						event.pointer.y=(float)my/6000.0f;
-												
-						event.pointer.button=button[0] | (button[1]<<1) | (button[2]<<2);
-						
-						pointer_callback(event);
-						
-					}
-				break;
-			
-			}
-			
-		}
-		if(res<0)
-		{
-			if(errors==0)
+		if(pen->button[n]!=NULL && hid_field_value(pen->button[n],buffer,length,&value)==0 && value!=0)
+			event.pointer.button|=(1<<n);
+	}
+	
+	push_event(&info->events,event);
+}
+
+
+/**
+* Device poll fd callback of a model, runs on the reactor thread
+*/
+template <class Device>
+void read_reports(int fd,unsigned int events,void * param)
+{
+	typename Device::instance * info = (typename Device::instance *)param;
+	int res;
+	hid_report_buf reports[REPORT_BATCH];
+	
+	//take the queued reports without waiting, parsed in place. The fd stays
+	//readable while some are left
+	res = hid_read_zc(info->handle,reports,REPORT_BATCH,0);
+	for(int n=0;n<res;n++)
+	{
+		if(__atomic_load_n(&common.debug,__ATOMIC_RELAXED)==1)
+		{		
+			cout<<"*** DATA:"<<hex<<info->id<<":"<<info->address<<" ***"<<endl;
+			for(int i=0;i<reports[n].len;i++)
 			{
-				cerr<<"Error: Failed to read from USB"<<endl;
-				driver_event event;
-				event.id=info->id;
-				event.address=info->address;
-				event.type=EVENT_STATUS;
-				event.status.id=STATUS_COMMERROR;
-				pointer_callback(event);
+				cout<<dec<<(unsigned int)reports[n].data[i]<<endl;
 			}
-			
-			errors=1;
-			
+			cout<<"***********"<<endl;
 		}
+		
+		if(info->record!=NULL)
+			record_write(info->record,reports[n].data,reports[n].len,reports[n].timestamp);
+		
+		Device::decode(info,reports[n].data,reports[n].len);
+		stats_report(&info->stats,reports[n].timestamp);
+	}
+	if(res>0)
+	{
+		hid_release_reports(info->handle,reports,res);
+		read_input_stats(info);
 	}
 	
-	close_driver(info);
+	if(res<0)
+		read_failed(info,fd);
+}
+
+/**
+* Recorded report, runs on the reactor thread
+*/
+void replay_report(void * data,unsigned char * buffer,int length,unsigned long long timestamp)
+{
+	driver_instance_info * info = (driver_instance_info *)data;
 	
-	return NULL;	
+	info->device->decode(info,buffer,length);
+	stats_report(&info->stats,timestamp);
 }
 
+/**
+* Takes the HID input queue counters, where reports are lost or merged
+* when reading falls behind
+*/
+void read_input_stats(driver_instance_info * info)
+{
+	hid_device_stats hid_stats;
+	
+	if(hid_get_stats(info->handle,&hid_stats)==0)
+		stats_input(&info->stats,hid_stats.dropped,hid_stats.coalesced);
+}
+
+/**
+* Reading a device failed, most likely unplugged
+*/
+void read_failed(driver_instance_info * info,int fd)
+{
+	cerr<<"Error: Failed to read from USB"<<endl;
+	stats_count(&info->stats.usb_errors);
+	driver_event event;
+	event.id=info->id;
+	event.address=info->address;
+	event.type=EVENT_STATUS;
+	event.status.id=STATUS_COMMERROR;
+	push_event(&info->events,event);
+	
+	//hotplug will tell when it is back
+	reactor_remove_fd(fd);
+	read_input_stats(info);
+	stats_input_closed(&info->stats);
+	hid_close(info->handle);
+	info->handle=NULL;
+	pthread_mutex_lock(&instances_mutex);
+	info->lost=true;
+	pthread_mutex_unlock(&instances_mutex);
+}
+
+//models and their readers, the last one takes any other tablet
+device_ops<driver_instance_info> device_table [] =
+{
+bind_device<driver_instance_info,slate_tablet>(read_reports<slate_tablet>),
+bind_device<driver_instance_info,flex_tablet>(read_reports<flex_tablet>),
+bind_device<driver_instance_info,silvercrest_tablet>(read_reports<silvercrest_tablet>),
+bind_device<driver_instance_info,mousepen_tablet>(read_reports<mousepen_tablet>),
+bind_device<driver_instance_info,mobi_tablet>(read_reports<mobi_tablet>),
+bind_device<driver_instance_info,generic_tablet>(read_reports<generic_tablet>)
+};
+
+
+/**
+* Smart Slate WS200 set up
+*/
+void slate_tablet::init(instance * info)
+{
+	unsigned char buffer[2];
+	
+	buffer[0]=2;
+	buffer[1]=2;
+	hid_send_feature_report(info->handle,buffer,2);
+}
+
+/**
+* Trust Flex Design set up
+*/
+void flex_tablet::init(instance * info)
+{
+	unsigned char buffer[2];
+	
+	buffer[0]=2;//report ID=2
+	buffer[1]=1;//value 1?
+	hid_send_feature_report(info->handle,buffer,2);
+}
 
 /**
 * Init specific devices
@@ -502,90 +947,62 @@ void init_driver(driver_instance_info * info)
 {
 	char path[16];
 	unsigned char iface;
+	hid_open_options options;
 	
 	if(common.debug)
 		cout<<"*** init_driver ***"<<endl;
 	
+	//reports are parsed straight from the transfer buffers
+	hid_init_open_options(&options);
+	options.zero_copy=1;
+	
+	//tablets report absolute positions: when reading falls behind only the
+	//latest move is kept, but every button change is delivered. That only
+	//holds for models whose whole button state is in one byte
+	switch(info->id)
+	{
+		//button state is on byte 1
+		case flex_tablet::id:
+		case silvercrest_tablet::id:
+			options.queue_policy=HID_QUEUE_MERGE_MOVES;
+			options.merge_prefix=1;
+			options.button_offset=1;
+			options.button_mask=0xff;
+		break;
+		
+		//button state is on byte 5
+		case mobi_tablet::id:
+			options.queue_policy=HID_QUEUE_MERGE_MOVES;
+			options.merge_prefix=1;
+			options.button_offset=5;
+			options.button_mask=0xff;
+		break;
+		
+		//the slate keys are on byte 7 and the mousepen tip comes from the
+		//pressure, unknown tablets may have them anywhere: keep them all
+	}
+	
 	iface = get_iface(info->id,supported_devices);
 	build_path(info->address,iface,path);
-	info->handle = hid_open_path(path);
+	info->handle = hid_open_path_ex(path,&options);
 	if(common.debug)
 		cout<<"usb path:"<<path<<endl;
 	
 	if(info->handle==NULL)
 	{
 		cerr<<"Error: Failed to open USB device"<<endl;
-		info->quit_request=true;
 	}
 	else
 	{
+		info->device->init(info);
 		
-		unsigned char buffer[2];
-		
-		switch(info->id)
-		{
-			//smart slate ws200
-			case 0x0b8c0083:
-				
-				buffer[0]=2;
-				buffer[1]=2;
-				hid_send_feature_report(info->handle,buffer,2);
-				/*
-				info->pointer = new Stylus("smart slate",info->id,0,17319,0,10819,0,511);
-				info->pointer->start();
-				
-				info->pointer2 = new Stylus("smart slate tool",info->id,0,17319,0,10819,0,511);
-				info->pointer2->start();
-				* */
-								
-			break;
-			
-			//trust flex design
-			case 0x172f0037:
-				buffer[0]=2;//report ID=2
-				buffer[1]=1;//value 1?
-				hid_send_feature_report(info->handle,buffer,2);
-			/*
-				info->pointer = new Stylus("trust flex",info->id,0,12288,0,9216,0,1023);
-				info->pointer->start();
-				* */
-			break;
-			
-			//silvercrest
-			case 0x172f0501:
-			/*
-				info->pointer = new Stylus("silvercrest",info->id,0,18000,0,11000,0,1023);
-				info->pointer->start();
-				* */
-			break;
-			
-			//Genius Mousepen
-			case 0x55430004:
-			/*
-				info->pointer = new Stylus("genius mousepen",info->id,0,32767,0,32767,0,1023);
-				info->pointer->start();
-				* */
-			break;
-			
-			//Interwrite Mobi
-			case 0x078c1005:
-			/*
-				info->pointer = new Stylus("interwrite mobi",info->id,0,8000,0,6000,0,1);
-				info->pointer->start();
-				* */
-			break;
-		
-		}
-		
-		
-			//Sending ready signal
-			driver_event event;
-			event.id=info->id;
-			event.address=info->address;
-			event.type=EVENT_STATUS;
-			event.status.id=STATUS_READY;
-			pointer_callback(event);
-						
+		//Sending ready signal
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_READY;
+		push_event(&info->events,event);
 	}
 }
 
@@ -600,67 +1017,24 @@ void close_driver(driver_instance_info * info)
 	
 	if(info->handle!=NULL)
 	{
+		info->device->close(info);
+		read_input_stats(info);
+		stats_input_closed(&info->stats);
 		hid_close(info->handle);
 		
-		switch(info->id)
-		{
-			//smart slate ws200
-			case 0x0b8c0083:
-			/*
-				info->pointer->stop();
-				delete info->pointer;
-				
-				info->pointer2->stop();
-				delete info->pointer2;
-				* */
-			break;
-			
-			//trust flex design
-			case 0x172f0037:
-			/*
-				info->pointer->stop();
-				delete info->pointer;
-				* */
-			break;
-			
-			//silvercrest
-			case 0x172f0501:
-			/*
-				info->pointer->stop();
-				delete info->pointer;
-				* */
-			break;
-			
-			//genius mousepen
-			case 0x55430004:
-			/*
-				info->pointer->stop();
-				delete info->pointer;
-				* */
-			break;
-			
-			//interwrite mobi
-			case 0x078c1005:
-			/*
-				info->pointer->stop();
-				delete info->pointer;
-				* */
-			break;
-			
-		}
-		
 		//sending shutdown event
 		driver_event event;
 		event.id=info->id;
 		event.address=info->address;
 		event.type=EVENT_STATUS;
 		event.status.id=STATUS_SHUTDOWN;
-		pointer_callback(event);
+		push_event(&info->events,event);
 			
 	}
 }
 
 
+
 /**
 * Sets device parameter value
 */
@@ -669,7 +1043,17 @@ void set_parameter(const char * key,unsigned int value)
 	if(common.debug)
 		cout<<"[TabletDriver::set_parameter]:"<<value<<endl;
 	
-	*(parameter_map[key])=value;
+	//per device screen mapping, see calibration.h
+	if(device_set_calibration<driver_instance_info>(&driver_instances,key,value)==0)
+		return;
+	
+	if(params_set(&parameters,key,value)!=0)
+		cerr<<"[TabletDriver] unknown parameter:"<<key<<endl;
+	
+	//scheduling options go to the reactor thread right away, and to the
+	//HID threads that complete the transfers and queue the reports
+	if(device_set_sched(key,common))
+		hid_set_thread_sched(reactor_sched_policy(common.rt_policy),common.rt_priority,common.cpu_affinity);
 }
 
 /**
@@ -677,13 +1061,14 @@ void set_parameter(const char * key,unsigned int value)
 */
 int get_parameter(const char * key,unsigned int * value)
 {
-	map<string,unsigned int *>::iterator it;
-	
-	it=parameter_map.find(key);
-	
-	if(it==parameter_map.end())return -1;
-	
-	*value=*parameter_map[key];
+	//real time and affinity are only in effect when the HID threads have
+	//them too, HID_SCHED_ flags use the same bits
+	if(device_get_sched(key,value)==0)
+		*value&=hid_get_thread_sched() | REACTOR_STATUS_MLOCK;
+	else if(device_get_stats<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		device_get_calibration<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		params_get(&parameters,key,value)!=0)
+		return -1;
 	if(common.debug)
 		cout<<"[TabletDriver::get_parameter]:"<<*value<<endl;
 	
@@ -695,18 +1080,11 @@ int get_parameter(const char * key,unsigned int * value)
  */ 
 unsigned int get_status(unsigned int address)
 {
-	unsigned int ret = DEV_STATUS_STOP;
-	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-		if(driver_instances[n]->address==address)
-		{
-			ret=DEV_STATUS_RUNNING;
-			break;
-		}
-	}
+	//lock free, the host may poll it while devices start or stop
+	if(registry_has_address(&driver_instances,address))
+		return DEV_STATUS_RUNNING;
 	
-	return ret;
+	return DEV_STATUS_STOP;
 }
 
 void set_callback( void(*callback)(driver_event) )
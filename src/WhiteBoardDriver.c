@@ -2,49 +2,125 @@
 #include <mrpdi/BaseDriver.h>
 #include "utils.h"
 #include "hidapi.h"
+#include "reactor.h"
+#include "events.h"
+#include "registry.h"
+#include "params.h"
+#include "device.h"
+#include "record.h"
 #include <pthread.h>
 #include <cstring>
 #include <iostream>
 #include <sstream>
 #include <vector>
-#include <map>
 #include <cmath>
 
 using namespace std;
 
+//maximum number of input reports parsed per read
+#define REPORT_BATCH 16
+
 
 struct driver_instance_info
 {
 	unsigned int id;
 	unsigned int address;
-	pthread_t thread;
-	bool quit_request;
 	hid_device * handle;
 	
-	union
+	//device unplugged, and being opened again by reopen_device(), both
+	//protected by instances_mutex
+	bool lost;
+	bool reopening;
+	bool started;
+	
+	//held while it starts, see device_start()
+	pthread_mutex_t start_lock;
+	
+	//model of the device, bound at start()
+	const device_ops<driver_instance_info> * device;
+	
+	//counters, see stats.h
+	device_stats stats;
+	
+	//parameters as seen by this device, read by the reactor thread
+	param_snapshot params;
+	
+	//raw stream capture or replay, see record.h. NULL when not in use
+	record_file * record;
+	replay_file * replay;
+	
+	//events waiting for the host
+	event_queue events;
+};
+
+
+/**
+ * Supported boards, see device.h
+ */
+struct ebeam_board : public device_model
+{
+	static const unsigned int id=0x26501311;
+	typedef device_instance<driver_instance_info,ebeam_board> instance;
+	
+	struct state
 	{
-		struct
-		{
-			int right_click;
-			int pen_status;
-			int pen_selected;
-		}smart;
-		
-		struct
-		{
-			unsigned int mx;
-			unsigned int my;
-			unsigned int button;
-		}ebeam;
+		unsigned int mx;
+		unsigned int my;
+		unsigned int button;
+	};
+	
+	static void init(instance * info);
+	static void decode(instance * info,unsigned char * buffer,int length);
+};
+
+struct smart_board : public device_model
+{
+	static const unsigned int id=0x0b8c0001;
+	typedef device_instance<driver_instance_info,smart_board> instance;
+	
+	struct state
+	{
+		int right_click;
+		int pen_status;
+		int pen_selected;
 	};
+	
+	static void init(instance * info);
+	static void decode(instance * info,unsigned char * buffer,int length);
+};
+
+struct team_board : public device_model
+{
+	static const unsigned int id=0x07dd0001;
+	typedef device_instance<driver_instance_info,team_board> instance;
+	
+	static void decode(instance * info,unsigned char * buffer,int length);
+};
+
+//panaboard ub-t880, only set up so far
+struct panaboard_board : public device_model
+{
+	static const unsigned int id=0x04da104d;
+	typedef device_instance<driver_instance_info,panaboard_board> instance;
+	
+	static void init(instance * info);
+	static void decode(instance * info,unsigned char * buffer,int length);
 };
 
 
 void (*pointer_callback) (driver_event);
-void * thread_core(void*);
+void open_device(void * param);
+void start_device(void * param);
+void stop_device(void * param);
+void * reopen_device(void * param);
+void read_failed(driver_instance_info * info,int fd);
+void read_input_stats(driver_instance_info * info);
+void replay_report(void * data,unsigned char * buffer,int length,unsigned long long timestamp);
+void hotplug_callback(int event,const char * path,unsigned short vendor_id,unsigned short product_id,void * user_data);
 void init_driver(driver_instance_info * info);
 void close_driver(driver_instance_info * info);
 
+extern device_ops<driver_instance_info> device_table [];
 
 const char * name="WhiteBoard Driver";
 const char * version="2.1";
@@ -61,6 +137,12 @@ driver_device_info supported_devices [] =
 driver_parameter_info supported_parameters [] = 
 {
 {0x00000000,"common.debug"},
+{0x00000000,"common.rt_policy"},
+{0x00000000,"common.rt_priority"},
+{0x00000000,"common.cpu_affinity"},
+{0x00000000,"common.mlock"},
+{0x00000000,"common.rt_status"},
+{0x00000000,"common.record"},
 {0x07dd0001,"teamboard.calibrate"},
 {0x07dd0001,"teamboard.pointers"},
 {0x26500000,"ebeam.filter"},
@@ -75,9 +157,13 @@ driver_parameter_info supported_parameters [] =
 };
 
 
-vector<driver_instance_info *> driver_instances;
+device_registry driver_instances;
+pthread_mutex_t instances_mutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t instances_cond=PTHREAD_COND_INITIALIZER;
 
-map<string,unsigned int *> parameter_map;
+int hotplug_handle=-1;
+
+param_store parameters;
 
 /**
  * Parameters
@@ -86,6 +172,16 @@ map<string,unsigned int *> parameter_map;
 struct t_common
 {
 	unsigned int debug;
+	
+	//reactor and HID threads scheduling, see reactor_set_sched() and
+	//hid_set_thread_sched()
+	unsigned int rt_policy;
+	unsigned int rt_priority;
+	unsigned int cpu_affinity;
+	unsigned int mlock;
+	
+	//raw stream capture, see record.h
+	unsigned int record;
 } common;
 
 struct t_ebeam
@@ -148,53 +244,55 @@ void smart_set_lights(driver_instance_info * info,unsigned char status,unsigned
 	buffer_out[15]=0x00;
 	buffer_out[16]=0x00;
 	
-	hid_write(info->handle,buffer_out,17);
+	//sent by the event thread, a slow ack must not stall the pen input.
+	//Nothing to light up when replaying
+	if(info->handle!=NULL)
+		hid_write_async(info->handle,buffer_out,17,NULL,NULL);
 
 }
 
+//index of each parameter in the table below
+enum
+{
+	PARAM_COMMON_DEBUG,
+	PARAM_EBEAM_FILTER,
+	PARAM_EBEAM_FIABILITY,
+	PARAM_EBEAM_MIN_DIST,
+	PARAM_EBEAM_MAX_DIST
+};
+
+//name, variable and default value of each parameter
+param_key parameter_table [] =
+{
+{"common.debug",&common.debug,0},
+{"ebeam.filter",&ebeam.filter,1},
+{"ebeam.fiability",&ebeam.fiability,100},
+{"ebeam.min_dist",&ebeam.min_dist,8},
+{"ebeam.max_dist",&ebeam.max_dist,40},
+{"ebeam.pointers",&ebeam.pointers,1},
+{"ebeam.calibrate",&ebeam.calibrate,1},
+{"smart.calibrate",&smart.calibrate,1},
+{"smart.pointers",&smart.pointers,6},
+{"teamboard.calibrate",&teamboard.calibrate,1},
+{"teamboard.pointers",&teamboard.pointers,1},
+{"panaboard.pointers",&panaboard.pointers,1},
+{"panaboard.calibrate",&panaboard.calibrate,0},
+{"common.rt_policy",&common.rt_policy,0},
+{"common.rt_priority",&common.rt_priority,0},
+{"common.cpu_affinity",&common.cpu_affinity,0},
+{"common.mlock",&common.mlock,0},
+{"common.record",&common.record,0},
+};
+
 /**
 * global driver initialization
 */
 void init()
 {
 	
-	parameter_map["common.debug"]=&common.debug;
-	parameter_map["ebeam.filter"]=&ebeam.filter;
-	parameter_map["ebeam.fiability"]=&ebeam.fiability;
-	parameter_map["ebeam.min_dist"]=&ebeam.min_dist;
-	parameter_map["ebeam.max_dist"]=&ebeam.max_dist;
-	parameter_map["ebeam.pointers"]=&ebeam.pointers;
-	parameter_map["ebeam.calibrate"]=&ebeam.calibrate;
+	params_init(&parameters,parameter_table,sizeof(parameter_table)/sizeof(param_key));
 	
-	
-	parameter_map["smart.calibrate"]=&smart.calibrate;
-	parameter_map["smart.pointers"]=&smart.pointers;
-	
-	
-	parameter_map["teamboard.calibrate"]=&teamboard.calibrate;
-	parameter_map["teamboard.pointers"]=&teamboard.pointers;
-	
-	parameter_map["panaboard.pointers"]=&panaboard.pointers;
-	parameter_map["panaboard.calibrate"]=&panaboard.calibrate;
-	
-	//default values
-	common.debug=0;
-	
-	ebeam.pointers=1;
-	ebeam.calibrate=1;
-	ebeam.filter=1;
-	ebeam.fiability=100;
-	ebeam.min_dist=8;
-	ebeam.max_dist=40;
-	
-	smart.pointers=6;
-	smart.calibrate=1;
-	
-	teamboard.pointers=1;
-	teamboard.calibrate=1;
-	
-	panaboard.pointers=1;
-	panaboard.calibrate=0;
+	registry_init(&driver_instances);
 }
 
 
@@ -206,6 +304,11 @@ void shutdown()
 	if(common.debug)
 		cout<<"Shutdown:"<<name<<endl;
 	
+	if(hotplug_handle>=0)
+	{
+		hid_hotplug_deregister(hotplug_handle);
+		hotplug_handle=-1;
+	}
 }
 
 /**
@@ -213,435 +316,690 @@ void shutdown()
 */
 void start(unsigned int id,unsigned int address)
 {
-	bool found=false;
 	driver_instance_info * info;
-	char path[16];
-	
+	const device_ops<driver_instance_info> * device;
 	
-	for(int n=0;n<driver_instances.size();n++)
+	device=find_device(device_table,id);
+	if(device==NULL)
 	{
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
-		{
-			found=true;
-			break;
-		}
+		cerr<<"unsupported device:"<<hex<<id<<endl;
+		return;
 	}
 	
-	if(!found)
+	//watch for unplugged devices coming back
+	pthread_mutex_lock(&instances_mutex);
+	if(hotplug_handle<0)
+		hotplug_handle=hid_hotplug_register(hotplug_callback,NULL);
+	pthread_mutex_unlock(&instances_mutex);
+	
+	info = device->create();
+	info->id=id;
+	info->address=address;
+	info->handle=NULL;
+	info->lost=false;
+	info->reopening=false;
+	info->started=false;
+	info->record=NULL;
+	info->replay=NULL;
+	info->device=device;
+	stats_init(&info->stats);
+	
+	if(common.debug)
+		cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
+	
+	//refused when the device is already running
+	if(device_start(&driver_instances,info,open_device,start_device)!=0)
 	{
-		if(common.debug)
-			cout<<"start:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
-		
-		
-		info = new driver_instance_info;
-		info->id=id;
-		info->address=address;
-		info->quit_request=false;
-		driver_instances.push_back(info);
-		
-		if(pthread_create(&info->thread, NULL,  thread_core, info)!=0)
-		{
-			cerr<<"Failed to spawn thread"<<endl;
-		}
+		cerr<<"driver already loaded!"<<endl;
+		device->destroy(info);
+	}
+}
 
+/**
+* device shut down
+*/
+void stop(unsigned int id,unsigned int address)
+{
+	driver_instance_info * info;
+	
+	//hotplug_callback() looks at the instances with this lock held
+	pthread_mutex_lock(&instances_mutex);
+	info = (driver_instance_info *)registry_remove(&driver_instances,id,address);
+	
+	//a device being opened again is left alone until that is done
+	while(info!=NULL && info->reopening)
+		pthread_cond_wait(&instances_cond,&instances_mutex);
+	pthread_mutex_unlock(&instances_mutex);
+	
+	if(info!=NULL)
+	{
 		
+		if(common.debug)
+			cout<<"stop:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
 		
+		device_stop(info,stop_device);
+		info->device->destroy(info);
 	}
 	else
 	{
-		cerr<<"driver already loaded!"<<endl;
+		cerr<<"driver already unloaded!"<<endl;
 	}
 	
 
 }
 
 /**
-* device shut down
+* HID hotplug events, called from the HID event thread
 */
-void stop(unsigned int id,unsigned int address)
+void hotplug_callback(int event,const char * path,unsigned short vendor_id,unsigned short product_id,void * user_data)
 {
-	bool found=false;
-	vector<driver_instance_info *> tmp;
-	driver_instance_info * info;
+	unsigned int id = (vendor_id<<16) | product_id;
+	unsigned int address;
+	unsigned char iface;
+	void * list[REGISTRY_SIZE];
+	int count;
+	
+	if(event!=HID_HOTPLUG_ARRIVED || parse_path(path,&address,&iface)!=0)
+		return;
 	
+	pthread_mutex_lock(&instances_mutex);
 	
-	for(int n=0;n<driver_instances.size();n++)
+	count=registry_list(&driver_instances,list,REGISTRY_SIZE);
+	for(int n=0;n<count;n++)
 	{
-
-		if(driver_instances[n]->id==id && driver_instances[n]->address==address)
-		{
-			found=true;
-			info=driver_instances[n];
-		}
-		else
+		driver_instance_info * info = (driver_instance_info *)list[n];
+		
+		if(info->id!=id || get_iface(id,supported_devices)!=iface)
+			continue;
+		
+		if(info->lost)
 		{
-			tmp.push_back(driver_instances[n]);
+			if(common.debug)
+				cout<<"device back:"<<hex<<id<<":"<<address<<endl;
+			
+			//the device gets a new address once plugged again, take it right
+			//now so the host can't start it twice. When the host got there
+			//first it stays lost, its key must keep matching its address
+			//for stop() to find it
+			if(registry_move(&driver_instances,id,info->address,address)!=0)
+			{
+				cerr<<"Error: "<<hex<<id<<":"<<address<<" already running"<<endl;
+				break;
+			}
+			info->address=address;
+			
+			//opening blocks, so it is done on a thread of its own, stop()
+			//waits for it
+			info->lost=false;
+			info->reopening=true;
+			
+			pthread_t thread;
+			if(pthread_create(&thread,NULL,reopen_device,info)==0)
+			{
+				pthread_detach(thread);
+			}
+			else
+			{
+				cerr<<"Error: Failed to reopen device"<<endl;
+				info->lost=true;
+				info->reopening=false;
+			}
+			break;
 		}
 	}
 	
-	if(found)
+	pthread_mutex_unlock(&instances_mutex);
+}
+
+/**
+* Opens a device, on the thread starting it as opening blocks
+*/
+void open_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	params_snapshot(&parameters,info->address,&info->params);
+	
+	//fed from a recording instead, when there is one of this model
+	info->replay=replay_open(info->id,replay_report,info);
+	if(info->replay==NULL)
+		init_driver(info);
+}
+
+/**
+* Watches the reports of an opened device, runs on the reactor thread
+*/
+void start_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	if(info->replay!=NULL)
+	{
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_READY;
+		push_event(&info->events,event);
+		replay_start(info->replay);
+		return;
+	}
+	
+	if(info->handle!=NULL && reactor_add_fd(hid_get_poll_fd(info->handle),EPOLLIN,info->device->read,info)!=0)
+		cerr<<"Error: Failed to watch USB device"<<endl;
+	
+	//a board plugged again keeps its recording going
+	if(info->handle!=NULL && info->record==NULL)
+		info->record=record_open(common.record!=0,"whiteboard",info->id,info->address);
+}
+
+/**
+* Closes a device, runs on the reactor thread
+*/
+void stop_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	if(info->replay!=NULL)
 	{
+		replay_close(info->replay);
+		info->replay=NULL;
 		
-		driver_instances=tmp;
+		driver_event event;
+		event.id=info->id;
+		event.address=info->address;
+		event.type=EVENT_STATUS;
+		event.status.id=STATUS_SHUTDOWN;
+		push_event(&info->events,event);
+		return;
+	}
+	
+	if(info->handle!=NULL)
+		reactor_remove_fd(hid_get_poll_fd(info->handle));
+	
+	close_driver(info);
+	
+	record_close(info->record);
+	info->record=NULL;
+}
+
+/**
+* Reopens a device plugged again, on a thread of its own
+*/
+void * reopen_device(void * param)
+{
+	driver_instance_info * info = (driver_instance_info *)param;
+	
+	open_device(info);
+	reactor_call(start_device,info);
+	
+	pthread_mutex_lock(&instances_mutex);
+	info->lost=(info->handle==NULL);
+	info->reopening=false;
+	pthread_cond_broadcast(&instances_cond);
+	pthread_mutex_unlock(&instances_mutex);
+	
+	return NULL;
+}
+
+
+/**
+* eBeam Classic reports
+*/
+void ebeam_board::decode(instance * info,unsigned char * buffer,int length)
+{
+	int mx,my;
+	int button[3];
+	
+	if(buffer[0]==0x03 && buffer[5]>info->params.values[PARAM_EBEAM_FIABILITY])
+	{
+		mx = (int)(buffer[1]+(buffer[2]<<8));
+		my = (int)(buffer[3]+(buffer[4]<<8));
+								
 		
-		if(common.debug)
-			cout<<"stop:"<<name<<" device:"<<hex<<id<<":"<<address<<endl;
+		button[0] = ((~buffer[6]) & 0x01);
+		button[1] = (buffer[6] & 0x08)>>3;
+		button[2] = (buffer[6] & 0x04)>>2;
 		
-		info->quit_request=true;
+		bool init_press = (button[0]==1 && info->state.button==0) ? true : false;
 		
-		if(common.debug)
-			cout<<"joining to:"<<info->address<<endl;
+		if(init_press)
+		{
+			info->state.mx=mx;
+			info->state.my=my;
+		}
+		
+		int vx = info->state.mx - mx;
+		int vy = info->state.my - my;
+		
+		float dist = sqrtf( (vx*vx) + (vy*vy) );
+								
+		
+		
+		info->state.button = button[0];
+		
+		
+		
+		if(dist<info->params.values[PARAM_EBEAM_MAX_DIST])
+		{
+			
+				if(info->params.values[PARAM_EBEAM_FILTER]==1)
+				{
+					mx = (info->state.mx + mx)*0.5f;
+					my = (info->state.my + my)*0.5f;
+				}
+				
+				driver_event event;
+				event.id=info->id;
+				event.address=info->address;
+				event.type=EVENT_POINTER;
+				event.pointer.pointer=0;
+				event.pointer.x=(float)mx/16384.0f;
+				event.pointer.y=(float)my/16384.0f;
+										
+				event.pointer.button=button[0] | (button[1]<<1) | (button[2]<<2);
+				
+				push_event(&info->events,event);
 			
-		pthread_join(info->thread,NULL);
-		//once thread is already dead we don't need its instance reference anymore
-		delete info;
+		}
+		else
+		{
+			if(info->params.values[PARAM_COMMON_DEBUG])
+				cout<<"Distance too long, aborting movement. Check battery."<<endl;
+		}
+		
+		info->state.mx=mx;
+		info->state.my=my;
+		
+		if(info->params.values[PARAM_COMMON_DEBUG])
+		{
+			cout<<dec<<"fiability: "<<(int)buffer[5]<<endl;
+			cout<<dec<<"pointer id: "<<(int)( (buffer[6] & 0xf0)>>4 )<<endl;
+			cout<<dec<<"buffer 7: "<<(int)buffer[7]<<endl;
+		}
 	}
 	else
 	{
-		cerr<<"driver already unloaded!"<<endl;
-	}
-	
-
+		if(info->params.values[PARAM_COMMON_DEBUG])
+			cout<<dec<<"fiability: "<<(int)buffer[5]<<endl;
+		
+	}						
 }
 
-
 /**
-* Thread callback function
+* Smart Board reports
 */
-void * thread_core(void* param)
+void smart_board::decode(instance * info,unsigned char * buffer,int length)
 {
-	driver_instance_info * info = (driver_instance_info *)param;
-	int res;
-	int errors=0;
-	unsigned char buffer[65];
 	unsigned char buffer_out[32];
 	int mx,my;
-	int button[6];
-	
-	init_driver(info);
-	
+	int button[1];
 	
-	while(!info->quit_request)
+	//seems that smart uses report id 02
+	if(buffer[0]==0x02)
 	{
-		//read 64 bytes with a 1000ms timeout
-		res = hid_read_timeout(info->handle,buffer,64,1000);
-		if(res>0)
+		//command
+		switch(buffer[1])
 		{
-			if(common.debug==2)
-			{		
-				cout<<"*** DATA:"<<hex<<info->id<<":"<<info->address<<" ***"<<endl;
-				for(int n=0;n<res;n++)
+			//watch dog and status
+			case 0xd2:
+				if(info->params.values[PARAM_COMMON_DEBUG])
+					cout<<"-> cmd: 0xd2:"<<hex<<(int)buffer[2]<<endl;
+				
+				if(buffer[2]==0)
 				{
-					cout<<dec<<(unsigned int)buffer[n]<<endl;
+					//We don't fully understand this command
+					//so we answer in a very hacked way
+					buffer_out[0]=0x02;
+					
+					buffer_out[1]=0xe1;
+					buffer_out[2]=0x00;
+					buffer_out[3]=0x01;
+					buffer_out[4]=0xe0;
+					
+					if(info->handle!=NULL)
+						hid_write_async(info->handle,buffer_out,17,NULL,NULL);
+					
+				}else 
+				{
+					if(info->params.values[PARAM_COMMON_DEBUG])
+					{
+						cout<<"Unknown D2 param:"<<hex<<(int)buffer[2]<<endl;
+						for(int n=0;n<length;n++)
+							cout<<hex<<(int)buffer[n]<<" ";
+						cout<<endl;
+					}
 				}
-				cout<<"***********"<<endl;
-			}
+			break;
 			
-			switch(info->id)
-			{
+			//input coords
+			case 0xb4:
+				if(info->params.values[PARAM_COMMON_DEBUG])
+					cout<<"-> cmd: 0xb4:"<<hex<<(int)buffer[2]<<endl;
 				
-				
-				
-				//eBeam Classic
-				case 0x26501311:
-					if(buffer[0]==0x03 && buffer[5]>ebeam.fiability)
+				if(buffer[2]==1)
+				{
+					if(info->params.values[PARAM_COMMON_DEBUG])
 					{
-						mx = (int)(buffer[1]+(buffer[2]<<8));
-						my = (int)(buffer[3]+(buffer[4]<<8));
-												
-						
-						button[0] = ((~buffer[6]) & 0x01);
-						button[1] = (buffer[6] & 0x08)>>3;
-						button[2] = (buffer[6] & 0x04)>>2;
-						
-						bool init_press = (button[0]==1 && info->ebeam.button==0) ? true : false;
-						
-						if(init_press)
-						{
-							info->ebeam.mx=mx;
-							info->ebeam.my=my;
-						}
-						
-						int vx = info->ebeam.mx - mx;
-						int vy = info->ebeam.my - my;
-						
-						float dist = sqrtf( (vx*vx) + (vy*vy) );
-												
-						
-						
-						info->ebeam.button = button[0];
-						
-						
-						
-						if(dist<ebeam.max_dist)
-						{
-							
-								if(ebeam.filter==1)
-								{
-									mx = (info->ebeam.mx + mx)*0.5f;
-									my = (info->ebeam.my + my)*0.5f;
-								}
-								
-								driver_event event;
-								event.id=info->id;
-								event.address=info->address;
-								event.type=EVENT_POINTER;
-								event.pointer.pointer=0;
-								event.pointer.x=(float)mx/16384.0f;
-								event.pointer.y=(float)my/16384.0f;
-														
-								event.pointer.button=button[0] | (button[1]<<1) | (button[2]<<2);
-								
-								pointer_callback(event);
-							
-						}
-						else
-						{
-							if(common.debug)
-								cout<<"Distance too long, aborting movement. Check battery."<<endl;
-						}
-						
-						info->ebeam.mx=mx;
-						info->ebeam.my=my;
-						
-						if(common.debug)
-						{
-							cout<<dec<<"fiability: "<<(int)buffer[5]<<endl;
-							cout<<dec<<"pointer id: "<<(int)( (buffer[6] & 0xf0)>>4 )<<endl;
-							cout<<dec<<"buffer 7: "<<(int)buffer[7]<<endl;
-						}
+						cout<<"Unknown b4 param:"<<hex<<(int)buffer[2]<<endl;
+						for(int n=0;n<length;n++)
+							cout<<hex<<(int)buffer[n]<<" ";
+						cout<<endl;
 					}
-					else
-					{
-						if(common.debug)
-							cout<<dec<<"fiability: "<<(int)buffer[5]<<endl;
+				}
+				
+				//XY datagram
+				if(buffer[2]==4)
+				{
+					button[0]=(buffer[3] & 0x80)>>7;
+					
+					//cout<<"input:";
+					//cout<<hex<<(int)buffer[4]<<","<<(int)buffer[5]<<","<<(int)buffer[6]<<","<<(int)buffer[7]<<endl;
+					//cout<<"Click:"<<button[0]<<endl;
+					mx = (int)(buffer[4]+( (buffer[5] & 0xF0 )<<4));
+					my = (int)(buffer[6]+( (buffer[5] & 0x0F )<<8));
 						
-					}						
+									
+					driver_event event;
+					event.id=info->id;
+					event.address=info->address;
+					event.type=EVENT_POINTER;
+					event.pointer.pointer=info->state.pen_selected;
+					event.pointer.x=(float)mx/4096.0f;
+					event.pointer.y=(float)my/4096.0f;
 					
+					if(info->state.right_click==1 && button[0]==1)
+						event.pointer.button=0x02; 
+					else 
+						event.pointer.button=button[0]; 
 					
-				break;
+					push_event(&info->events,event);																				
+					
+						
+				}
 				
 				
-				//Smart Board
-				case 0x0b8c0001:
-					
-					//seems that smart uses report id 02
-					if(buffer[0]==0x02)
+			break;
+			
+			//pen board status
+			case 0xe1:
+				if(info->params.values[PARAM_COMMON_DEBUG])
+					cout<<"-> cmd: 0xe1:"<<hex<<(int)buffer[2]<<endl;
+				
+				//unknown datagram
+				if(buffer[2]==0x14)
+				{
+					if(info->params.values[PARAM_COMMON_DEBUG])
 					{
-						//command
-						switch(buffer[1])
-						{
-							//watch dog and status
-							case 0xd2:
-								if(common.debug)
-									cout<<"-> cmd: 0xd2:"<<hex<<(int)buffer[2]<<endl;
-								
-								if(buffer[2]==0)
-								{
-									//We don't fully understand this command
-									//so we answer in a very hacked way
-									buffer_out[0]=0x02;
-									
-									buffer_out[1]=0xe1;
-									buffer_out[2]=0x00;
-									buffer_out[3]=0x01;
-									buffer_out[4]=0xe0;
-									
-									hid_write(info->handle,buffer_out,17);
-									
-								}else 
-								{
-									if(common.debug)
-									{
-										cout<<"Unknown D2 param:"<<hex<<(int)buffer[2]<<endl;
-										for(int n=0;n<res;n++)
-											cout<<hex<<(int)buffer[n]<<" ";
-										cout<<endl;
-									}
-								}
-							break;
-							
-							//input coords
-							case 0xb4:
-								if(common.debug)
-									cout<<"-> cmd: 0xb4:"<<hex<<(int)buffer[2]<<endl;
-								
-								if(buffer[2]==1)
-								{
-									if(common.debug)
-									{
-										cout<<"Unknown b4 param:"<<hex<<(int)buffer[2]<<endl;
-										for(int n=0;n<res;n++)
-											cout<<hex<<(int)buffer[n]<<" ";
-										cout<<endl;
-									}
-								}
-								
-								//XY datagram
-								if(buffer[2]==4)
-								{
-									button[0]=(buffer[3] & 0x80)>>7;
-									
-									//cout<<"input:";
-									//cout<<hex<<(int)buffer[4]<<","<<(int)buffer[5]<<","<<(int)buffer[6]<<","<<(int)buffer[7]<<endl;
-									//cout<<"Click:"<<button[0]<<endl;
-									mx = (int)(buffer[4]+( (buffer[5] & 0xF0 )<<4));
-									my = (int)(buffer[6]+( (buffer[5] & 0x0F )<<8));
-										
-													
-									driver_event event;
-									event.id=info->id;
-									event.address=info->address;
-									event.type=EVENT_POINTER;
-									event.pointer.pointer=info->smart.pen_selected;
-									event.pointer.x=(float)mx/4096.0f;
-									event.pointer.y=(float)my/4096.0f;
-									
-									if(info->smart.right_click==1 && button[0]==1)
-										event.pointer.button=0x02; 
-									else 
-										event.pointer.button=button[0]; 
-									
-									pointer_callback(event);																				
-									
-										
-								}
-								
-								
-							break;
-							
-							//pen board status
-							case 0xe1:
-								if(common.debug)
-									cout<<"-> cmd: 0xe1:"<<hex<<(int)buffer[2]<<endl;
-								
-								//unknown datagram
-								if(buffer[2]==0x14)
-								{
-									if(common.debug)
-									{
-										cout<<"Unknown b4 param:"<<hex<<(int)buffer[2]<<endl;
-										for(int n=0;n<res;n++)
-											cout<<hex<<(int)buffer[n]<<" ";
-										cout<<endl;
-									}
-								}
-								
-								
-								//pen status datagram
-								if(buffer[2]==5)
-								{
-									info->smart.pen_status=buffer[3];
-									
-									if(common.debug)
-										cout<<"status:"<<hex<<(int)buffer[3]<<endl;
-																		
-									for(int n=0;n<6;n++)
-									{
-											if(smart_pen_lights[n][0]==buffer[3])
-											{
-												info->smart.pen_selected=n;
-												//buffer_out[5]=smart_pen_lights[n][1];
-											}
-									}
-									
-									if(common.debug)
-										cout<<"lighting:"<<hex<<(int)smart_pen_lights[info->smart.pen_selected][1]<<endl;
-									
-									smart_set_lights(info,buffer[3],smart_pen_lights[info->smart.pen_selected][1]);
-									
-									driver_event event;
-									event.id=info->id;
-									event.address=info->address;
-									event.type=EVENT_DATA;
-									event.data.type=1;//pen selected
-									*((unsigned int *)event.data.buffer)=(unsigned int)info->smart.pen_selected;
-									pointer_callback(event);
-									
-								}
-								
-								//key datagram
-								if(buffer[2]==6)
-								{
-									/*
-									cout<<"button click"<<endl;
-									for(int n=0;n<res;n++)
-										cout<<hex<<(int)buffer[n]<<" ";
-									cout<<endl;
-									*/
-									cout<<"* key press: "<<hex<<(int)buffer[3]<<endl;
-									
-									//right click
-									info->smart.right_click=((buffer[3] & 0x02)>>1);
-								}
-							
-							break;
-							
-							default:
-								if(common.debug)
-									cout<<"Unknown command:"<<hex<<(int)buffer[1]<<endl;
-								
-							break;
-						}
-						
+						cout<<"Unknown b4 param:"<<hex<<(int)buffer[2]<<endl;
+						for(int n=0;n<length;n++)
+							cout<<hex<<(int)buffer[n]<<" ";
+						cout<<endl;
 					}
+				}
+				
+				
+				//pen status datagram
+				if(buffer[2]==5)
+				{
+					info->state.pen_status=buffer[3];
 					
-					if(buffer[0]!=2)
+					if(info->params.values[PARAM_COMMON_DEBUG])
+						cout<<"status:"<<hex<<(int)buffer[3]<<endl;
+														
+					for(int n=0;n<6;n++)
 					{
-						if(common.debug)
-							cout<<"Unknown report!:"<<dec<<(int)buffer[0]<<endl;
-						
+							if(smart_pen_lights[n][0]==buffer[3])
+							{
+								info->state.pen_selected=n;
+								//buffer_out[5]=smart_pen_lights[n][1];
+							}
 					}
+					
+					if(info->params.values[PARAM_COMMON_DEBUG])
+						cout<<"lighting:"<<hex<<(int)smart_pen_lights[info->state.pen_selected][1]<<endl;
+					
+					smart_set_lights(info,buffer[3],smart_pen_lights[info->state.pen_selected][1]);
+					
+					driver_event event;
+					event.id=info->id;
+					event.address=info->address;
+					event.type=EVENT_DATA;
+					event.data.type=1;//pen selected
+					*((unsigned int *)event.data.buffer)=(unsigned int)info->state.pen_selected;
+					push_event(&info->events,event);
+					
+				}
 				
-				break;
-				
-				//Team board
-				case 0x07dd0001:
-						mx = (int)(buffer[1]+(buffer[2]<<8));
-						my = (int)(buffer[3]+(buffer[4]<<8));
-						button[0] = buffer[0];
-						
-						driver_event event;
-						event.id=info->id;
-						event.address=info->address;
-						event.type=EVENT_POINTER;
-						event.pointer.pointer=0;
-						event.pointer.x=(float)mx/4096.0f;
-						event.pointer.y=(float)my/4096.0f;
-												
-						event.pointer.button=button[0];
-						
-						pointer_callback(event);
-						
-						if(common.debug)
-							cout<<dec<<"pos: "<<mx<<","<<my<<endl;
-				break;
-				
-			}
+				//key datagram
+				if(buffer[2]==6)
+				{
+					/*
+					cout<<"button click"<<endl;
+					for(int n=0;n<length;n++)
+						cout<<hex<<(int)buffer[n]<<" ";
+					cout<<endl;
+					*/
+					cout<<"* key press: "<<hex<<(int)buffer[3]<<endl;
+					
+					//right click
+					info->state.right_click=((buffer[3] & 0x02)>>1);
+				}
 			
+			break;
+			
+			default:
+				if(info->params.values[PARAM_COMMON_DEBUG])
+					cout<<"Unknown command:"<<hex<<(int)buffer[1]<<endl;
+				
+			break;
 		}
-		if(res<0)
-		{
-			if(errors==0)
+		
+	}
+	
+	if(buffer[0]!=2)
+	{
+		if(info->params.values[PARAM_COMMON_DEBUG])
+			cout<<"Unknown report!:"<<dec<<(int)buffer[0]<<endl;
+		
+	}
+}
+
+/**
+* Team Board reports
+*/
+void team_board::decode(instance * info,unsigned char * buffer,int length)
+{
+	int mx,my;
+	int button[1];
+	
+	mx = (int)(buffer[1]+(buffer[2]<<8));
+	my = (int)(buffer[3]+(buffer[4]<<8));
+	button[0] = buffer[0];
+	
+	driver_event event;
+	event.id=info->id;
+	event.address=info->address;
+	event.type=EVENT_POINTER;
+	event.pointer.pointer=0;
+	event.pointer.x=(float)mx/4096.0f;
+	event.pointer.y=(float)my/4096.0f;
+							
+	event.pointer.button=button[0];
+	
+	push_event(&info->events,event);
+	
+	if(info->params.values[PARAM_COMMON_DEBUG])
+		cout<<dec<<"pos: "<<mx<<","<<my<<endl;
+}
+
+/**
+* Panaboard reports, not handled yet
+*/
+void panaboard_board::decode(instance * info,unsigned char * buffer,int length)
+{
+}
+
+
+/**
+* Device poll fd callback of a model, runs on the reactor thread
+*/
+template <class Device>
+void read_reports(int fd,unsigned int events,void * param)
+{
+	typename Device::instance * info = (typename Device::instance *)param;
+	int res;
+	hid_report_buf reports[REPORT_BATCH];
+	
+	//pick up parameter changes, this device ones included
+	params_refresh(&parameters,info->address,&info->params);
+	
+	//take the queued reports without waiting, parsed in place. The fd stays
+	//readable while some are left
+	res = hid_read_zc(info->handle,reports,REPORT_BATCH,0);
+	for(int n=0;n<res;n++)
+	{
+		if(info->params.values[PARAM_COMMON_DEBUG]==2)
+		{		
+			cout<<"*** DATA:"<<hex<<info->id<<":"<<info->address<<" ***"<<endl;
+			for(int i=0;i<reports[n].len;i++)
 			{
-				cerr<<"Error: Failed to read from USB"<<endl;
-				driver_event event;
-				event.id=info->id;
-				event.address=info->address;
-				event.type=EVENT_STATUS;
-				event.status.id=STATUS_COMMERROR;
-				pointer_callback(event);
+				cout<<dec<<(unsigned int)reports[n].data[i]<<endl;
 			}
-			
-			errors=1;
+			cout<<"***********"<<endl;
 		}
+		
+		if(info->record!=NULL)
+			record_write(info->record,reports[n].data,reports[n].len,reports[n].timestamp);
+		
+		Device::decode(info,reports[n].data,reports[n].len);
+		stats_report(&info->stats,reports[n].timestamp);
+	}
+	if(res>0)
+	{
+		hid_release_reports(info->handle,reports,res);
+		read_input_stats(info);
 	}
 	
-	close_driver(info);
+	if(res<0)
+		read_failed(info,fd);
+}
+
+/**
+* Recorded report, runs on the reactor thread
+*/
+void replay_report(void * data,unsigned char * buffer,int length,unsigned long long timestamp)
+{
+	driver_instance_info * info = (driver_instance_info *)data;
+	
+	params_refresh(&parameters,info->address,&info->params);
+	info->device->decode(info,buffer,length);
+	stats_report(&info->stats,timestamp);
+}
+
+/**
+* Takes the HID input queue counters, where reports are lost or merged
+* when reading falls behind
+*/
+void read_input_stats(driver_instance_info * info)
+{
+	hid_device_stats hid_stats;
+	
+	if(hid_get_stats(info->handle,&hid_stats)==0)
+		stats_input(&info->stats,hid_stats.dropped,hid_stats.coalesced);
+}
+
+/**
+* Reading a device failed, most likely unplugged
+*/
+void read_failed(driver_instance_info * info,int fd)
+{
+	cerr<<"Error: Failed to read from USB"<<endl;
+	stats_count(&info->stats.usb_errors);
+	driver_event event;
+	event.id=info->id;
+	event.address=info->address;
+	event.type=EVENT_STATUS;
+	event.status.id=STATUS_COMMERROR;
+	push_event(&info->events,event);
 	
-	return NULL;	
+	//hotplug will tell when it is back
+	reactor_remove_fd(fd);
+	read_input_stats(info);
+	stats_input_closed(&info->stats);
+	hid_close(info->handle);
+	info->handle=NULL;
+	pthread_mutex_lock(&instances_mutex);
+	info->lost=true;
+	pthread_mutex_unlock(&instances_mutex);
+}
+
+//models and their readers
+device_ops<driver_instance_info> device_table [] =
+{
+bind_device<driver_instance_info,ebeam_board>(read_reports<ebeam_board>),
+bind_device<driver_instance_info,smart_board>(read_reports<smart_board>),
+bind_device<driver_instance_info,team_board>(read_reports<team_board>),
+bind_device<driver_instance_info,panaboard_board>(read_reports<panaboard_board>),
+{0xffffffff,NULL,NULL,NULL,NULL,NULL,NULL}
+};
+
+
+/**
+* eBeam set up
+*/
+void ebeam_board::init(instance * info)
+{
+	info->state.mx=0;
+	info->state.my=0;
+	info->state.button=0;
 }
 
+/**
+* Smart Board set up
+*/
+void smart_board::init(instance * info)
+{
+	info->state.right_click=0;
+	info->state.pen_selected=0;
+	info->state.pen_status=0;
+}
+
+/**
+* Panaboard set up
+*/
+void panaboard_board::init(instance * info)
+{
+	unsigned char buffer[64];
+	
+	/*
+	 * report id:2
+	 * 	input/output 8 bytes
+	 * 
+	 * report id:4 
+	 * 	feature 8 bytes
+	 * 
+	 * report id:8
+	 * 	feature 8 bytes
+	 */
+	cout<<"init: panaboard ub-t880"<<endl;
+	buffer[0]=8;
+	hid_get_feature_report(info->handle,buffer,8);
+	cout<<"Max Contact Number:"<<(int)buffer[1]<<endl;
+	
+	buffer[0]=4;
+	hid_get_feature_report(info->handle,buffer,8);
+	cout<<"Report ID 4"<<endl;
+	for(int n=0;n<9;n++)
+	{
+		cout<<hex<<(int)buffer[n]<<" ";
+	}
+	cout<<endl;
+	
+	buffer[0]=4;
+	buffer[1]=1;
+	hid_send_feature_report(info->handle,buffer,8);
+}
 
 /**
 * Init specific devices
@@ -650,14 +1008,33 @@ void init_driver(driver_instance_info * info)
 {
 	char path[16];
 	unsigned char iface;
-	unsigned char buffer[64];
+	hid_open_options options;
 	
 	if(common.debug)
 		cout<<"*** init_driver ***"<<endl;
 	
+	//reports are parsed straight from the transfer buffers
+	hid_init_open_options(&options);
+	options.zero_copy=1;
+	
+	switch(info->id)
+	{
+		//team board: button state is on the first byte
+		case team_board::id:
+			options.queue_policy=HID_QUEUE_MERGE_MOVES;
+			options.merge_prefix=1;
+			options.button_offset=0;
+			options.button_mask=0xff;
+		break;
+		
+		//smart board commands must be answered one by one, and an ebeam
+		//sample replacing a queued one may be dropped as unreliable by
+		//decode() for its byte 5: keep them all
+	}
+	
 	iface = get_iface(info->id,supported_devices);
 	build_path(info->address,iface,path);
-	info->handle = hid_open_path(path);
+	info->handle = hid_open_path_ex(path,&options);
 	
 	if(common.debug)
 		cout<<"usb path:"<<path<<endl;
@@ -665,86 +1042,10 @@ void init_driver(driver_instance_info * info)
 	if(info->handle==NULL)
 	{
 		cerr<<"Error: Failed to open USB device"<<endl;
-		info->quit_request=true;
 	}
 	else
 	{
-		//common default params setting
-		
-		/* uinput init goes here*/
-		switch(info->id)
-		{
-			case 0x04da104d:
-				/*
-				 * report id:2
-				 * 	input/output 8 bytes
-				 * 
-				 * report id:4 
-				 * 	feature 8 bytes
-				 * 
-				 * report id:8
-				 * 	feature 8 bytes
-				 */
-				cout<<"init: panaboard ub-t880"<<endl;
-				buffer[0]=8;
-				hid_get_feature_report(info->handle,buffer,8);
-				cout<<"Max Contact Number:"<<(int)buffer[1]<<endl;
-				
-				buffer[0]=4;
-				hid_get_feature_report(info->handle,buffer,8);
-				cout<<"Report ID 4"<<endl;
-				for(int n=0;n<9;n++)
-				{
-					cout<<hex<<(int)buffer[n]<<" ";
-				}
-				cout<<endl;
-				
-				buffer[0]=4;
-				buffer[1]=1;
-				hid_send_feature_report(info->handle,buffer,8);
-			break;
-			
-			//ebeam 3
-			case 0x26501311:
-				/*
-				info->pointer = new AbsolutePointer("ebeam 3",info->id,0,32767,0,32767);
-				info->pointer->start();
-				*/
-			
-				info->ebeam.mx=0;
-				info->ebeam.my=0;
-				info->ebeam.button=0;
-			break;
-			
-			//smart board
-			case 0x0b8c0001:
-				info->smart.right_click=0;
-				info->smart.pen_selected=0;
-				info->smart.pen_status=0;
-					
-				/*
-				info->aux_pointer[0] = new AbsolutePointer("smart Blue",info->id,0,32767,0,32767);
-				info->aux_pointer[0]->start();
-				info->aux_pointer[1] = new AbsolutePointer("smart Green",info->id,0,32767,0,32767);
-				info->aux_pointer[1]->start();
-				info->aux_pointer[2] = new AbsolutePointer("smart Eraser",info->id,0,32767,0,32767);
-				info->aux_pointer[2]->start();
-				info->aux_pointer[3] = new AbsolutePointer("smart Red",info->id,0,32767,0,32767);
-				info->aux_pointer[3]->start();
-				info->aux_pointer[4] = new AbsolutePointer("smart Black",info->id,0,32767,0,32767);
-				info->aux_pointer[4]->start();
-				*/
-	
-			break;
-			
-			//TeamBoard
-			case 0x07dd0001:
-				/*
-				info->pointer = new AbsolutePointer("TeamBoard",info->id,0,32767,0,32767);
-				info->pointer->start();
-				*/ 
-			break;
-		}
+		info->device->init(info);
 		
 		//Sending ready signal
 		driver_event event;
@@ -752,7 +1053,7 @@ void init_driver(driver_instance_info * info)
 		event.address=info->address;
 		event.type=EVENT_STATUS;
 		event.status.id=STATUS_READY;
-		pointer_callback(event);
+		push_event(&info->events,event);
 	}
 }
 
@@ -766,52 +1067,50 @@ void close_driver(driver_instance_info * info)
 	
 	if(info->handle!=NULL)
 	{
+		info->device->close(info);
+		read_input_stats(info);
+		stats_input_closed(&info->stats);
 		hid_close(info->handle);
 		
-		switch(info->id)
-		{
-			//ebeam 3
-			case 0x26501311:
-		
-			break;
-			
-			
-			//smart board
-			case 0x0b8c0001:
-		
-			break;
-			
-			//Team board
-			case 0x07dd0001:
-			
-			break;
-
-		}
-		
 		//Sending shutdown signal
 		driver_event event;
 		event.id=info->id;
 		event.address=info->address;
 		event.type=EVENT_STATUS;
 		event.status.id=STATUS_SHUTDOWN;
-		pointer_callback(event);
+		push_event(&info->events,event);
 	}
 }
 
 
 
 
+
 /**
 * Sets device parameter value
 */
 void set_parameter(const char * key,unsigned int value)
 {
-	*(parameter_map[key])=value;
+	void * list[REGISTRY_SIZE];
+	int count;
+	
+	//per device screen mapping, see calibration.h
+	if(device_set_calibration<driver_instance_info>(&driver_instances,key,value)==0)
+		return;
+	
+	if(params_set(&parameters,key,value)!=0)
+		cerr<<"[WhiteBoardDriver] unknown parameter:"<<key<<endl;
+	
+	//scheduling options go to the reactor thread right away, and to the
+	//HID threads that complete the transfers and queue the reports
+	if(device_set_sched(key,common))
+		hid_set_thread_sched(reactor_sched_policy(common.rt_policy),common.rt_priority,common.cpu_affinity);
 	
 	//catching new states
-	for(int n=0;n<driver_instances.size();n++)
+	count=registry_list(&driver_instances,list,REGISTRY_SIZE);
+	for(int n=0;n<count;n++)
 	{
-		switch(driver_instances[n]->id)
+		switch(((driver_instance_info *)list[n])->id)
 		{
 			//team board
 			case 0x07dd0001:
@@ -826,13 +1125,14 @@ void set_parameter(const char * key,unsigned int value)
 */
 int get_parameter(const char * key,unsigned int * value)
 {
-	map<string,unsigned int *>::iterator it;
-	
-	it=parameter_map.find(key);
-	
-	if(it==parameter_map.end())return -1;
-	
-	*value=*parameter_map[key];
+	//real time and affinity are only in effect when the HID threads have
+	//them too, HID_SCHED_ flags use the same bits
+	if(device_get_sched(key,value)==0)
+		*value&=hid_get_thread_sched() | REACTOR_STATUS_MLOCK;
+	else if(device_get_stats<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		device_get_calibration<driver_instance_info>(&driver_instances,key,value)!=0 &&
+		params_get(&parameters,key,value)!=0)
+		return -1;
 	
 	return 0;
 }
@@ -843,18 +1143,11 @@ int get_parameter(const char * key,unsigned int * value)
  */ 
 unsigned int get_status(unsigned int address)
 {
-	unsigned int ret = DEV_STATUS_STOP;
-	
-	for(int n=0;n<driver_instances.size();n++)
-	{
-		if(driver_instances[n]->address==address)
-		{
-			ret=DEV_STATUS_RUNNING;
-			break;
-		}
-	}
+	//lock free, the host may poll it while devices start or stop
+	if(registry_has_address(&driver_instances,address))
+		return DEV_STATUS_RUNNING;
 	
-	return ret;
+	return DEV_STATUS_STOP;
 }
 
 void set_callback( void(*callback)(driver_event) )
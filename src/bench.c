@@ -0,0 +1,584 @@
+
+
+#include <mrpdi/BaseDriver.h>
+#include "utils.h"
+#include "record.h"
+#include <dlfcn.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//reports of each synthetic stream, -n changes it
+#define BENCH_REPORTS 200000
+
+//a stream not consumed by then is reported as failed
+#define BENCH_TIMEOUT_MS 60000
+
+//address of the replayed devices, no real one is opened
+#define BENCH_ADDRESS 0x00fe0100
+
+
+/**
+ * Parser throughput of the drivers. Each stream, synthetic or recorded, is
+ * replayed at full speed through the decoder of its device (see record.h),
+ * timing until the driver counted every report. Results go to stdout as
+ * JSON, one stream per line:
+ *
+ *	bench [-d drivers dir] [-n reports] [recording.rec ...]
+ *
+ * Synthetic streams draw a pen going round a circle, pressing it most of
+ * the time
+ */
+
+/**
+ * Writes report n of a pen at x,y (0..1) into buffer, returns its length
+ */
+typedef int (*bench_encoder)(unsigned char * buffer,float x,float y,int button,int n);
+
+struct bench_case
+{
+	const char * name;
+	const char * driver;
+	unsigned int id;
+
+	//file name prefix of the recordings of the driver
+	const char * tag;
+
+	//serial boards count packets of this size, 0 when each record is a report
+	int packet;
+
+	bench_encoder encode;
+};
+
+struct bench_driver
+{
+	string name;
+	void * handle;
+
+	void (*init)();
+	void (*shutdown)();
+	void (*start)(unsigned int id,unsigned int address);
+	void (*stop)(unsigned int id,unsigned int address);
+	int (*get_parameter)(const char * key,unsigned int * value);
+	void (*set_callback)(void (*callback)(driver_event));
+};
+
+struct bench_result
+{
+	unsigned long reports;
+	unsigned long events;
+	unsigned long long elapsed;
+	unsigned int latency_p99;
+	const char * error;
+};
+
+
+static void put16(unsigned char * buffer,unsigned int value)
+{
+	buffer[0]=value & 0xff;
+	buffer[1]=(value>>8) & 0xff;
+}
+
+static int encode_ebeam(unsigned char * buffer,float x,float y,int button,int n)
+{
+	buffer[0]=0x03;
+	put16(buffer+1,x*16384.0f);
+	put16(buffer+3,y*16384.0f);
+	buffer[5]=200;//fiability
+	buffer[6]=button ? 0x00 : 0x01;
+	buffer[7]=0;
+
+	return 8;
+}
+
+static int encode_smart(unsigned char * buffer,float x,float y,int button,int n)
+{
+	unsigned int mx=x*4095.0f;
+	unsigned int my=y*4095.0f;
+
+	memset(buffer,0,17);
+	buffer[0]=0x02;
+
+	//now and then the pen status, 0xe1, the rest are 0xb4 coords
+	if(n%64==0)
+	{
+		buffer[1]=0xe1;
+		buffer[2]=5;
+		buffer[3]=1<<((n/64)%5);
+	}
+	else
+	{
+		buffer[1]=0xb4;
+		buffer[2]=4;
+		buffer[3]=button<<7;
+		buffer[4]=mx & 0xff;
+		buffer[5]=((mx>>4) & 0xf0) | ((my>>8) & 0x0f);
+		buffer[6]=my & 0xff;
+	}
+
+	return 17;
+}
+
+static int encode_team(unsigned char * buffer,float x,float y,int button,int n)
+{
+	buffer[0]=button;
+	put16(buffer+1,x*4095.0f);
+	put16(buffer+3,y*4095.0f);
+
+	return 5;
+}
+
+static int encode_slate(unsigned char * buffer,float x,float y,int button,int n)
+{
+	buffer[0]=2;
+	buffer[1]=0x90 | button;
+	put16(buffer+2,x*17319.0f);
+	put16(buffer+4,y*10819.0f);
+	put16(buffer+6,button ? 300 : 0);
+
+	return 8;
+}
+
+static int encode_flex(unsigned char * buffer,float x,float y,int button,int n)
+{
+	buffer[0]=16;
+	buffer[1]=button;
+	put16(buffer+2,x*12288.0f);
+	put16(buffer+4,y*9216.0f);
+	put16(buffer+6,button ? 600 : 0);
+
+	return 8;
+}
+
+static int encode_silvercrest(unsigned char * buffer,float x,float y,int button,int n)
+{
+	buffer[0]=16;
+	buffer[1]=button;
+	put16(buffer+2,x*18000.0f);
+	put16(buffer+4,y*11000.0f);
+	put16(buffer+6,button ? 600 : 0);
+
+	return 8;
+}
+
+static int encode_mousepen(unsigned char * buffer,float x,float y,int button,int n)
+{
+	buffer[0]=9;
+	buffer[1]=button;
+	put16(buffer+2,x*32767.0f);
+	put16(buffer+4,y*32767.0f);
+	put16(buffer+6,button ? 600 : 0);
+
+	return 8;
+}
+
+static int encode_mobi(unsigned char * buffer,float x,float y,int button,int n)
+{
+	buffer[0]=5;
+	put16(buffer+1,x*8000.0f);
+	put16(buffer+3,y*6000.0f);
+	buffer[5]=button;
+
+	return 6;
+}
+
+static int encode_promethean(unsigned char * buffer,float x,float y,int button,int n)
+{
+	buffer[0]=0;
+	buffer[1]=0;
+	buffer[2]=0;
+	put16(buffer+3,x*32767.0f);
+	put16(buffer+5,y*32767.0f);
+	buffer[7]=0x04 | button;
+
+	return 8;
+}
+
+static int encode_iqboard(unsigned char * buffer,float x,float y,int button,int n)
+{
+	//same range as IQboardDriver.c
+	unsigned int mx=440+x*(3537-440);
+	unsigned int my=632+y*(3270-632);
+
+	buffer[0]=0xee;
+	buffer[1]=0xee;
+	buffer[2]=button ? 0x51 : 0x50;
+	buffer[3]=(my>>6) & 0x3f;
+	buffer[4]=my & 0x3f;
+	buffer[5]=(mx>>6) & 0x3f;
+	buffer[6]=mx & 0x3f;
+	buffer[7]=buffer[0] ^ buffer[1] ^ buffer[2] ^ buffer[3] ^ buffer[4] ^ buffer[5] ^ buffer[6];
+
+	return 8;
+}
+
+static int encode_multiclass(unsigned char * buffer,float x,float y,int button,int n)
+{
+	unsigned int mx=x*4095.0f;
+	unsigned int my=y*4095.0f;
+
+	buffer[0]=0xaa;
+	buffer[1]=0xaa;
+	buffer[2]=button ? 0x41 : 0x40;
+	buffer[3]=(my>>6) & 0x3f;
+	buffer[4]=my & 0x3f;
+	buffer[5]=(mx>>6) & 0x3f;
+	buffer[6]=mx & 0x3f;
+	buffer[7]=buffer[2] ^ buffer[3] ^ buffer[4] ^ buffer[5] ^ buffer[6];
+
+	return 8;
+}
+
+bench_case cases [] =
+{
+{"ebeam","WhiteBoardDriver.so",0x26501311,"whiteboard",0,encode_ebeam},
+{"smart","WhiteBoardDriver.so",0x0b8c0001,"whiteboard",0,encode_smart},
+{"teamboard","WhiteBoardDriver.so",0x07dd0001,"whiteboard",0,encode_team},
+{"slate","TabletDriver.so",0x0b8c0083,"tablet",0,encode_slate},
+{"flex","TabletDriver.so",0x172f0037,"tablet",0,encode_flex},
+{"silvercrest","TabletDriver.so",0x172f0501,"tablet",0,encode_silvercrest},
+{"mousepen","TabletDriver.so",0x55430004,"tablet",0,encode_mousepen},
+{"mobi","TabletDriver.so",0x078c1005,"tablet",0,encode_mobi},
+{"promethean","PrometheanDriver.so",0x0d480001,"promethean",0,encode_promethean},
+{"iqboard","IQboardDriver.so",0x10c4ea60,"iqboard",8,encode_iqboard},
+{"multiclass","MulticlassDriver.so",0x10c4ea60,"multiclass",8,encode_multiclass},
+{NULL,NULL,0,NULL,0,NULL}
+};
+
+
+static unsigned long events=0;
+
+static void count_event(driver_event event)
+{
+	//runs on the reactor thread of the driver
+	if(event.type!=EVENT_STATUS)
+		__atomic_add_fetch(&events,1,__ATOMIC_RELAXED);
+}
+
+/**
+ * Loads a driver once, NULL if it is not built
+ */
+static bench_driver * load_driver(vector<bench_driver *> & drivers,const string & dir,const char * name)
+{
+	bench_driver * driver;
+	string path;
+	void * handle;
+
+	for(size_t n=0;n<drivers.size();n++)
+	{
+		if(drivers[n]->name==name)
+			return drivers[n];
+	}
+
+	path=dir+"/"+name;
+	handle=dlopen(path.c_str(),RTLD_NOW | RTLD_LOCAL);
+	if(handle==NULL)
+	{
+		cerr<<"[bench] "<<dlerror()<<endl;
+		return NULL;
+	}
+
+	driver = new bench_driver;
+	driver->name=name;
+	driver->handle=handle;
+	driver->init=(void (*)())dlsym(handle,"init");
+	driver->shutdown=(void (*)())dlsym(handle,"shutdown");
+	driver->start=(void (*)(unsigned int,unsigned int))dlsym(handle,"start");
+	driver->stop=(void (*)(unsigned int,unsigned int))dlsym(handle,"stop");
+	driver->get_parameter=(int (*)(const char *,unsigned int *))dlsym(handle,"get_parameter");
+	driver->set_callback=(void (*)(void (*)(driver_event)))dlsym(handle,"set_callback");
+
+	if(driver->init==NULL || driver->shutdown==NULL || driver->start==NULL || driver->stop==NULL ||
+		driver->get_parameter==NULL || driver->set_callback==NULL)
+	{
+		cerr<<"[bench] "<<name<<" is not a driver"<<endl;
+		dlclose(handle);
+		delete driver;
+		return NULL;
+	}
+
+	driver->init();
+	driver->set_callback(count_event);
+	drivers.push_back(driver);
+
+	return driver;
+}
+
+/**
+ * Writes a synthetic stream of count reports, returns 0 on success
+ */
+static int write_stream(const bench_case * c,const char * path,unsigned long count)
+{
+	record_header header;
+	unsigned char buffer[RECORD_MAX_LENGTH];
+	unsigned long long timestamp;
+	unsigned short length;
+	float angle;
+	FILE * file;
+
+	file=fopen(path,"wb");
+	if(file==NULL)
+		return -1;
+
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,RECORD_MAGIC,8);
+	header.version=RECORD_VERSION;
+	header.id=c->id;
+	header.address=BENCH_ADDRESS;
+	fwrite(&header,sizeof(header),1,file);
+
+	for(unsigned long n=0;n<count;n++)
+	{
+		//small steps, eBeam drops jumps longer than ebeam.max_dist
+		angle=(n%1256)*0.005f;
+		length=c->encode(buffer,0.5f+0.3f*cosf(angle),0.5f+0.3f*sinf(angle),(n%256)<200,n);
+
+		//a report every ms, only the order matters at full speed
+		timestamp=n*1000000ULL;
+		fwrite(&timestamp,sizeof(timestamp),1,file);
+		fwrite(&length,sizeof(length),1,file);
+		fwrite(buffer,1,length,file);
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+/**
+ * Reports the driver will count for a recording, 0 if it is not one
+ */
+static unsigned long count_reports(const char * path,int packet,unsigned int * id)
+{
+	record_header header;
+	unsigned long long timestamp;
+	unsigned short length;
+	unsigned long records=0;
+	unsigned long bytes=0;
+	FILE * file;
+
+	file=fopen(path,"rb");
+	if(file==NULL)
+		return 0;
+
+	if(fread(&header,sizeof(header),1,file)!=1 || memcmp(header.magic,RECORD_MAGIC,8)!=0)
+	{
+		fclose(file);
+		return 0;
+	}
+
+	*id=header.id;
+	while(fread(&timestamp,sizeof(timestamp),1,file)==1 && fread(&length,sizeof(length),1,file)==1)
+	{
+		if(fseek(file,length,SEEK_CUR)!=0)
+			break;
+
+		records++;
+		bytes+=length;
+	}
+
+	fclose(file);
+
+	return (packet>0) ? bytes/packet : records;
+}
+
+/**
+ * Case of a recording: one with its id and whose tag starts the file name,
+ * otherwise the first one with its id
+ */
+static const bench_case * find_case(const char * path,unsigned int id)
+{
+	const bench_case * found=NULL;
+	const char * name;
+
+	name=strrchr(path,'/');
+	name=(name!=NULL) ? name+1 : path;
+
+	for(const bench_case * c=cases;c->name!=NULL;c++)
+	{
+		if(c->id!=id)
+			continue;
+
+		if(strncmp(name,c->tag,strlen(c->tag))==0)
+			return c;
+
+		if(found==NULL)
+			found=c;
+	}
+
+	return found;
+}
+
+/**
+ * Replays path through a driver until it counted expected reports
+ */
+static void run_stream(bench_driver * driver,unsigned int id,const char * path,unsigned long expected,bench_result * result)
+{
+	unsigned long long start,now;
+	unsigned int reports=0;
+	stringstream key;
+
+	key<<"stats.reports@"<<BENCH_ADDRESS;
+
+	setenv("MRPDI_REPLAY",path,1);
+	setenv("MRPDI_REPLAY_SPEED","0",1);
+	__atomic_store_n(&events,0,__ATOMIC_RELAXED);
+
+	result->error=NULL;
+	start=monotonic_ns();
+	driver->start(id,BENCH_ADDRESS);
+
+	do
+	{
+		usleep(100);
+		now=monotonic_ns();
+
+		if(driver->get_parameter(key.str().c_str(),&reports)!=0)
+		{
+			result->error="not started";
+			break;
+		}
+
+		if(now-start>BENCH_TIMEOUT_MS*1000000ULL)
+		{
+			result->error="timeout";
+			break;
+		}
+	}
+	while(reports<expected);
+
+	result->elapsed=now-start;
+	result->reports=reports;
+
+	key.str("");
+	key<<"stats.latency_p99_us@"<<BENCH_ADDRESS;
+	if(driver->get_parameter(key.str().c_str(),&result->latency_p99)!=0)
+		result->latency_p99=0;
+
+	//once stop() returns the driver is done with the stream
+	driver->stop(id,BENCH_ADDRESS);
+	result->events=__atomic_load_n(&events,__ATOMIC_RELAXED);
+
+	unsetenv("MRPDI_REPLAY");
+}
+
+static void print_result(FILE * out,bool & first,const char * name,const char * driver,const char * source,const bench_result & result)
+{
+	double seconds=result.elapsed/1e9;
+
+	fprintf(out,"%s{\"name\":\"%s\",\"driver\":\"%s\",\"source\":\"%s\"",(first ? "" : ",\n"),name,driver,source);
+	first=false;
+
+	if(result.error!=NULL)
+		fprintf(out,",\"error\":\"%s\"",result.error);
+
+	fprintf(out,",\"reports\":%lu,\"events\":%lu,\"seconds\":%.6f",result.reports,result.events,seconds);
+	fprintf(out,",\"ns_per_report\":%.1f",(result.reports>0) ? result.elapsed/(double)result.reports : 0.0);
+	fprintf(out,",\"events_per_s\":%.0f",(seconds>0.0) ? result.events/seconds : 0.0);
+	fprintf(out,",\"latency_p99_us\":%u}",result.latency_p99);
+}
+
+
+int main(int argc,char * argv[])
+{
+	vector<bench_driver *> drivers;
+	string dir="drivers";
+	unsigned long count=BENCH_REPORTS;
+	bench_driver * driver;
+	bench_result result;
+	const bench_case * c;
+	FILE * out;
+	bool first=true;
+	unsigned long expected;
+	unsigned int id;
+	char path[64];
+	int opt;
+
+	while((opt=getopt(argc,argv,"d:n:"))!=-1)
+	{
+		switch(opt)
+		{
+			case 'd':
+				dir=optarg;
+			break;
+
+			case 'n':
+				count=strtoul(optarg,NULL,0);
+			break;
+
+			default:
+				cerr<<"usage: "<<argv[0]<<" [-d drivers dir] [-n reports] [recording.rec ...]"<<endl;
+				return 1;
+		}
+	}
+
+	//drivers talk on stdout, keep it for the results alone
+	fflush(stdout);
+	out=fdopen(dup(1),"w");
+	dup2(2,1);
+
+	fprintf(out,"{\"reports\":%lu,\"benchmarks\":[\n",count);
+
+	for(c=cases;c->name!=NULL;c++)
+	{
+		driver=load_driver(drivers,dir,c->driver);
+		if(driver==NULL)
+			continue;
+
+		snprintf(path,sizeof(path),"/tmp/mrpdi-bench-%d-%s.rec",getpid(),c->name);
+		if(write_stream(c,path,count)!=0)
+		{
+			cerr<<"[bench] can't write "<<path<<endl;
+			continue;
+		}
+
+		cerr<<"[bench] "<<c->name<<endl;
+		run_stream(driver,c->id,path,count,&result);
+		print_result(out,first,c->name,c->driver,"synthetic",result);
+		unlink(path);
+	}
+
+	//recordings go to the driver of their id, IQBoard and Multiclass share
+	//one so the file name tells them apart
+	for(int n=optind;n<argc;n++)
+	{
+		if(count_reports(argv[n],0,&id)==0)
+		{
+			cerr<<"[bench] "<<argv[n]<<" is not a recording"<<endl;
+			continue;
+		}
+
+		c=find_case(argv[n],id);
+		if(c==NULL)
+		{
+			cerr<<"[bench] no driver for "<<argv[n]<<endl;
+			continue;
+		}
+
+		expected=count_reports(argv[n],c->packet,&id);
+
+		driver=load_driver(drivers,dir,c->driver);
+		if(driver==NULL)
+			continue;
+
+		cerr<<"[bench] "<<argv[n]<<endl;
+		run_stream(driver,c->id,argv[n],expected,&result);
+		print_result(out,first,argv[n],c->driver,"recorded",result);
+	}
+
+	fprintf(out,"\n]}\n");
+	fclose(out);
+
+	for(size_t n=0;n<drivers.size();n++)
+		drivers[n]->shutdown();
+
+	return 0;
+}
@@ -0,0 +1,330 @@
+
+
+#include "calibration.h"
+#include <cstring>
+#include <cmath>
+#include <iostream>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+//positions mapped at once
+#define CALIBRATION_BATCH 64
+
+static const float identity[9]={1.0f,0.0f,0.0f, 0.0f,1.0f,0.0f, 0.0f,0.0f,1.0f};
+
+
+/**
+ * No mapping and no pairs
+ */
+void calibration_init(calibration * cal)
+{
+	memset(cal,0,sizeof(calibration));
+	memcpy(cal->matrix,identity,sizeof(identity));
+}
+
+/**
+ * Solves a x = b for n unknowns by Gaussian elimination with partial
+ * pivoting, a is n x n row major. Returns -1 when singular
+ */
+static int solve_linear(double * a,double * b,double * x,int n)
+{
+	int pivot;
+	double f;
+
+	for(int c=0;c<n;c++)
+	{
+		pivot=c;
+		for(int r=c+1;r<n;r++)
+		{
+			if(fabs(a[r*n+c])>fabs(a[pivot*n+c]))
+				pivot=r;
+		}
+
+		if(fabs(a[pivot*n+c])<1e-12)
+			return -1;
+
+		if(pivot!=c)
+		{
+			for(int k=0;k<n;k++)
+				swap(a[c*n+k],a[pivot*n+k]);
+			swap(b[c],b[pivot]);
+		}
+
+		for(int r=c+1;r<n;r++)
+		{
+			f=a[r*n+c]/a[c*n+c];
+			for(int k=c;k<n;k++)
+				a[r*n+k]-=f*a[c*n+k];
+			b[r]-=f*b[c];
+		}
+	}
+
+	for(int r=n-1;r>=0;r--)
+	{
+		f=b[r];
+		for(int k=r+1;k<n;k++)
+			f-=a[r*n+k]*x[k];
+		x[r]=f/a[r*n+r];
+	}
+
+	return 0;
+}
+
+/**
+ * Least squares fit of the matrix mapping the touched positions to the
+ * screen ones, m8 fixed to 1 (direct linear transform). 3 pairs give an
+ * affine map, 4 or more a homography. Returns -1 when they don't tell
+ * one, like points in a line
+ */
+int calibration_solve(const calibration_point * points,int count,float * matrix)
+{
+	double ata[64];
+	double atb[8];
+	double h[8];
+	double row[8];
+	double rhs;
+	int n;
+
+	if(count<3)
+		return -1;
+
+	//the perspective terms need a fourth point
+	n=(count>=4) ? 8 : 6;
+
+	memset(ata,0,sizeof(ata));
+	memset(atb,0,sizeof(atb));
+
+	//two equations per pair, accumulated into the normal equations
+	for(int p=0;p<count;p++)
+	{
+		const calibration_point & pt = points[p];
+
+		for(int e=0;e<2;e++)
+		{
+			memset(row,0,sizeof(row));
+			rhs=(e==0) ? pt.screen_x : pt.screen_y;
+
+			row[e*3+0]=pt.x;
+			row[e*3+1]=pt.y;
+			row[e*3+2]=1.0;
+			if(n==8)
+			{
+				row[6]=-pt.x*rhs;
+				row[7]=-pt.y*rhs;
+			}
+
+			for(int i=0;i<n;i++)
+			{
+				for(int j=0;j<n;j++)
+					ata[i*n+j]+=row[i]*row[j];
+				atb[i]+=row[i]*rhs;
+			}
+		}
+	}
+
+	if(solve_linear(ata,atb,h,n)!=0)
+		return -1;
+
+	for(int i=0;i<n;i++)
+		matrix[i]=h[i];
+	if(n==6)
+	{
+		matrix[6]=0.0f;
+		matrix[7]=0.0f;
+	}
+	matrix[8]=1.0f;
+
+	return 0;
+}
+
+/**
+ * Replaces the matrix, NULL for no mapping. One writer at a time
+ */
+void calibration_publish(calibration * cal,const float * matrix)
+{
+	unsigned int sequence=cal->sequence;
+
+	__atomic_store_n(&cal->sequence,sequence+1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for(int n=0;n<9;n++)
+		__atomic_store(&cal->matrix[n],(matrix!=NULL) ? &matrix[n] : &identity[n],__ATOMIC_RELAXED);
+	__atomic_store_n(&cal->active,(matrix!=NULL) ? 1 : 0,__ATOMIC_RELAXED);
+
+	__atomic_store_n(&cal->sequence,sequence+2,__ATOMIC_RELEASE);
+}
+
+/**
+ * Copy of the current matrix, retried if it changed meanwhile.
+ * Returns false when there is no mapping
+ */
+static bool read_matrix(calibration * cal,float * matrix)
+{
+	unsigned int sequence;
+	int active;
+
+	do
+	{
+		sequence=__atomic_load_n(&cal->sequence,__ATOMIC_ACQUIRE);
+
+		for(int n=0;n<9;n++)
+			__atomic_load(&cal->matrix[n],&matrix[n],__ATOMIC_RELAXED);
+		active=__atomic_load_n(&cal->active,__ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	while((sequence & 1) || __atomic_load_n(&cal->sequence,__ATOMIC_RELAXED)!=sequence);
+
+	return active!=0;
+}
+
+static inline float clamp(float value)
+{
+	return (value<0.0f) ? 0.0f : ((value>1.0f) ? 1.0f : value);
+}
+
+/**
+ * Maps count positions in place, clamped to the screen
+ */
+void calibration_transform(const float * matrix,float * x,float * y,unsigned int count)
+{
+	unsigned int n=0;
+	float w;
+
+#ifdef __SSE__
+	//four positions at a time
+	__m128 m0=_mm_set1_ps(matrix[0]),m1=_mm_set1_ps(matrix[1]),m2=_mm_set1_ps(matrix[2]);
+	__m128 m3=_mm_set1_ps(matrix[3]),m4=_mm_set1_ps(matrix[4]),m5=_mm_set1_ps(matrix[5]);
+	__m128 m6=_mm_set1_ps(matrix[6]),m7=_mm_set1_ps(matrix[7]),m8=_mm_set1_ps(matrix[8]);
+	__m128 zero=_mm_setzero_ps();
+	__m128 one=_mm_set1_ps(1.0f);
+
+	for(;n+4<=count;n+=4)
+	{
+		__m128 vx=_mm_loadu_ps(x+n);
+		__m128 vy=_mm_loadu_ps(y+n);
+		__m128 vw=_mm_add_ps(_mm_add_ps(_mm_mul_ps(m6,vx),_mm_mul_ps(m7,vy)),m8);
+		__m128 tx=_mm_add_ps(_mm_add_ps(_mm_mul_ps(m0,vx),_mm_mul_ps(m1,vy)),m2);
+		__m128 ty=_mm_add_ps(_mm_add_ps(_mm_mul_ps(m3,vx),_mm_mul_ps(m4,vy)),m5);
+
+		tx=_mm_div_ps(tx,vw);
+		ty=_mm_div_ps(ty,vw);
+		_mm_storeu_ps(x+n,_mm_min_ps(_mm_max_ps(tx,zero),one));
+		_mm_storeu_ps(y+n,_mm_min_ps(_mm_max_ps(ty,zero),one));
+	}
+#endif
+
+	for(;n<count;n++)
+	{
+		w=matrix[6]*x[n]+matrix[7]*y[n]+matrix[8];
+		float tx=(matrix[0]*x[n]+matrix[1]*y[n]+matrix[2])/w;
+		float ty=(matrix[3]*x[n]+matrix[4]*y[n]+matrix[5])/w;
+		x[n]=clamp(tx);
+		y[n]=clamp(ty);
+	}
+}
+
+/**
+ * Maps the pointer events among events, from any thread. Positions are
+ * gathered so they are mapped as a batch
+ */
+void calibration_apply(calibration * cal,driver_event * events,unsigned int count)
+{
+	float matrix[9];
+	float x[CALIBRATION_BATCH];
+	float y[CALIBRATION_BATCH];
+	unsigned int index[CALIBRATION_BATCH];
+	unsigned int n,i,total;
+
+	if(__atomic_load_n(&cal->active,__ATOMIC_RELAXED)==0 || !read_matrix(cal,matrix))
+		return;
+
+	for(n=0;n<count;)
+	{
+		for(total=0;n<count && total<CALIBRATION_BATCH;n++)
+		{
+			if(events[n].type!=EVENT_POINTER)
+				continue;
+
+			index[total]=n;
+			x[total]=events[n].pointer.x;
+			y[total]=events[n].pointer.y;
+			total++;
+		}
+
+		calibration_transform(matrix,x,y,total);
+
+		for(i=0;i<total;i++)
+		{
+			events[index[i]].pointer.x=x[i];
+			events[index[i]].pointer.y=y[i];
+		}
+	}
+}
+
+static void unpack(unsigned int value,float * x,float * y)
+{
+	*x=(value>>16)/65535.0f;
+	*y=(value & 0xffff)/65535.0f;
+}
+
+/**
+ * calibration.<name> parameter of a device. Returns 0 if name is one
+ */
+int calibration_set(calibration * cal,const char * name,unsigned int value)
+{
+	float matrix[9];
+
+	if(strcmp(name,"raw")==0)
+	{
+		unpack(value,&cal->raw_x,&cal->raw_y);
+	}
+	else if(strcmp(name,"screen")==0)
+	{
+		if(cal->count==CALIBRATION_POINTS)
+		{
+			cerr<<"[calibration] too many points"<<endl;
+			return 0;
+		}
+
+		calibration_point & pt = cal->points[cal->count++];
+		pt.x=cal->raw_x;
+		pt.y=cal->raw_y;
+		unpack(value,&pt.screen_x,&pt.screen_y);
+	}
+	else if(strcmp(name,"solve")==0)
+	{
+		if(calibration_solve(cal->points,cal->count,matrix)!=0)
+			cerr<<"[calibration] can't solve with "<<cal->count<<" points"<<endl;
+		else
+			calibration_publish(cal,matrix);
+	}
+	else if(strcmp(name,"reset")==0)
+	{
+		cal->count=0;
+		calibration_publish(cal,NULL);
+	}
+	else
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Read only calibration.<name> parameter of a device
+ */
+int calibration_get(calibration * cal,const char * name,unsigned int * value)
+{
+	if(strcmp(name,"points")==0)
+		*value=cal->count;
+	else if(strcmp(name,"active")==0)
+		*value=__atomic_load_n(&cal->active,__ATOMIC_RELAXED);
+	else
+		return -1;
+
+	return 0;
+}
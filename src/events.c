@@ -0,0 +1,263 @@
+
+
+#include "events.h"
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+//set_callback() one, defined by each driver
+extern void (*pointer_callback) (driver_event);
+
+static batch_callback batch=NULL;
+static int event_fd=-1;
+
+//attached queues, the lock also makes dispatch_events() the only consumer
+static pthread_mutex_t queues_mutex=PTHREAD_MUTEX_INITIALIZER;
+static event_queue * queues=NULL;
+
+
+/**
+ * Hands the pending events of a queue to the host.
+ * Called with queues_mutex locked
+ */
+static int drain_queue(event_queue * queue)
+{
+	unsigned int head,tail,first,count;
+	int total=0;
+
+	tail=queue->tail;
+	head=__atomic_load_n(&queue->head,__ATOMIC_SEQ_CST);
+
+	while(head!=tail)
+	{
+		//take these away from push_event(), and let a fold in progress end
+		__atomic_store_n(&queue->claim,head,__ATOMIC_SEQ_CST);
+		while(__atomic_load_n(&queue->merging,__ATOMIC_SEQ_CST))
+			;
+
+		//contiguous run up to the end of the ring
+		first=tail%EVENT_QUEUE_SIZE;
+		count=head-tail;
+		if(first+count>EVENT_QUEUE_SIZE)
+			count=EVENT_QUEUE_SIZE-first;
+
+		//mapped as a batch, these slots are ours now
+		calibration_apply(&queue->mapping,&queue->events[first],count);
+		batch(&queue->events[first],count);
+
+		for(unsigned int n=0;n<count;n++)
+			update_latency(&queue->latency,queue->timestamps[first+n]);
+
+		tail+=count;
+		total+=count;
+
+		//push_event() checks for an empty queue after publishing, so one of
+		//both sides always sees the other
+		__atomic_store_n(&queue->tail,tail,__ATOMIC_SEQ_CST);
+		head=__atomic_load_n(&queue->head,__ATOMIC_SEQ_CST);
+	}
+
+	return total;
+}
+
+/**
+ * Starts delivering events of a device
+ */
+void event_queue_attach(event_queue * queue)
+{
+	queue->head=0;
+	queue->tail=0;
+	queue->claim=0;
+	queue->merging=0;
+	queue->mergeable=false;
+	queue->last.type=EVENT_STATUS;
+	queue->pushed=0;
+	queue->overflow=0;
+	queue->coalesced=0;
+	memset(&queue->latency,0,sizeof(report_latency));
+	calibration_init(&queue->mapping);
+
+	pthread_mutex_lock(&queues_mutex);
+	queue->next=queues;
+	queues=queue;
+	pthread_mutex_unlock(&queues_mutex);
+}
+
+/**
+ * Delivers what is left, shutdown included, and forgets the queue.
+ * The device must not push anymore
+ */
+void event_queue_detach(event_queue * queue)
+{
+	pthread_mutex_lock(&queues_mutex);
+
+	if(batch!=NULL)
+		drain_queue(queue);
+
+	for(event_queue ** q=&queues;*q!=NULL;q=&(*q)->next)
+	{
+		if(*q==queue)
+		{
+			*q=queue->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&queues_mutex);
+}
+
+/**
+ * Whether b only moves the pointer of a, no button or pointer change
+ */
+static bool same_pointer(const driver_event & a,const driver_event & b)
+{
+	return a.type==EVENT_POINTER && b.type==EVENT_POINTER &&
+		a.pointer.pointer==b.pointer.pointer && a.pointer.button==b.pointer.button;
+}
+
+/**
+ * Folds a pointer move into the newest queued event when the host hasn't
+ * started reading it yet. Returns true if it did
+ */
+static bool coalesce_event(event_queue * queue,driver_event & event,unsigned int head)
+{
+	unsigned int slot=(head-1)%EVENT_QUEUE_SIZE;
+	bool done=false;
+
+	if(!queue->mergeable || !same_pointer(queue->events[slot],event))
+		return false;
+
+	//claim is checked after raising merging, and drain_queue() waits for
+	//merging after moving claim, so the slot is never read half written
+	__atomic_store_n(&queue->merging,1,__ATOMIC_SEQ_CST);
+	if((int)(__atomic_load_n(&queue->claim,__ATOMIC_SEQ_CST)-(head-1))<=0)
+	{
+		queue->events[slot]=event;
+		queue->timestamps[slot]=monotonic_ns();
+		done=true;
+	}
+	__atomic_store_n(&queue->merging,0,__ATOMIC_SEQ_CST);
+
+	return done;
+}
+
+/**
+ * Sends an event to the host, only from the thread reading the device
+ */
+void push_event(event_queue * queue,driver_event & event)
+{
+	unsigned int head,tail;
+
+	//only this thread writes it, no need for a locked add
+	__atomic_store_n(&queue->pushed,queue->pushed+1,__ATOMIC_RELAXED);
+
+	if(__atomic_load_n(&batch,__ATOMIC_ACQUIRE)==NULL)
+	{
+		driver_event mapped=event;
+
+		calibration_apply(&queue->mapping,&mapped,1);
+		pointer_callback(mapped);
+		return;
+	}
+
+	head=queue->head;
+	tail=__atomic_load_n(&queue->tail,__ATOMIC_ACQUIRE);
+
+	//the host is behind, only the latest position of a move matters
+	if(head!=tail && coalesce_event(queue,event,head))
+	{
+		__atomic_add_fetch(&queue->coalesced,1,__ATOMIC_RELAXED);
+		queue->last=event;
+		return;
+	}
+
+	//full, the newest event is the one lost
+	if(head-tail==EVENT_QUEUE_SIZE)
+	{
+		__atomic_add_fetch(&queue->overflow,1,__ATOMIC_RELAXED);
+		return;
+	}
+
+	queue->events[head%EVENT_QUEUE_SIZE]=event;
+	queue->timestamps[head%EVENT_QUEUE_SIZE]=monotonic_ns();
+
+	//a press, release or status must stay as it is
+	queue->mergeable=same_pointer(queue->last,event);
+	queue->last=event;
+	__atomic_store_n(&queue->head,head+1,__ATOMIC_SEQ_CST);
+
+	//the host took everything before this one, wake it up
+	if(__atomic_load_n(&queue->tail,__ATOMIC_SEQ_CST)==head && event_fd>=0)
+	{
+		uint64_t one=1;
+
+		if(write(event_fd,&one,sizeof(one))<0)
+			cerr<<"[events] wake up lost"<<endl;
+	}
+}
+
+/**
+ * Switches event delivery to batches, or back to set_callback() with NULL.
+ * Meant to be called before starting any device
+ */
+void set_batch_callback(batch_callback callback)
+{
+	pthread_mutex_lock(&queues_mutex);
+
+	if(callback!=NULL && event_fd<0)
+	{
+		event_fd=eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+		if(event_fd<0)
+			cerr<<"[events] Failed to create event fd"<<endl;
+	}
+
+	//don't strand anything queued so far
+	if(callback==NULL && batch!=NULL)
+	{
+		for(event_queue * q=queues;q!=NULL;q=q->next)
+			drain_queue(q);
+	}
+
+	__atomic_store_n(&batch,callback,__ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&queues_mutex);
+}
+
+/**
+ * Calls the batch callback with the pending events of every device.
+ * Returns the number of events delivered
+ */
+int dispatch_events()
+{
+	int total=0;
+	uint64_t value;
+
+	pthread_mutex_lock(&queues_mutex);
+
+	if(batch!=NULL)
+	{
+		//cleared before draining, so a push racing with us raises it again
+		if(event_fd>=0 && read(event_fd,&value,sizeof(value))<0)
+			value=0;
+
+		for(event_queue * q=queues;q!=NULL;q=q->next)
+			total+=drain_queue(q);
+	}
+
+	pthread_mutex_unlock(&queues_mutex);
+
+	return total;
+}
+
+/**
+ * Fd readable while events are pending, -1 without a batch callback
+ */
+int get_event_fd()
+{
+	return (batch!=NULL) ? event_fd : -1;
+}
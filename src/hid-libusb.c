@@ -39,7 +39,16 @@
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#ifdef HID_HIDRAW_BACKEND
+#include <sys/epoll.h>
+#include <linux/hidraw.h>
+#include <dirent.h>
+#include <limits.h>
+#endif
 #include <pthread.h>
+#include <sched.h>
 #include <wchar.h>
 
 /* GNU / LibUSB */
@@ -66,17 +75,83 @@ Linux/libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
+/* Default number of input reports queued per device. When the queue is
+   full the oldest report is dropped, so we don't grow forever if the
+   user never reads anything from the device. */
+#define INPUT_QUEUE_DEFAULT_CAP 32
+
+/* Largest report descriptor read */
+#define HID_MAX_DESCRIPTOR_SIZE 4096
+
+/* Largest report read from a hidraw node */
+#define HID_HIDRAW_READ_SIZE 4096
+
+/* Report payloads are kept in cache line sized strides so that the event
+   thread writing a slot and a reader copying out its neighbour don't
+   share lines. */
+#define CACHE_LINE_SIZE 64
+
+/* Input report received from the device. data points into the slab of
+   the ring that owns the slot. */
 struct input_report {
 	uint8_t *data;
 	size_t len;
-	struct input_report *next;
+	uint64_t timestamp; /* CLOCK_MONOTONIC ns at completion */
+};
+
+/* Fixed-capacity ring of input reports. All the storage is allocated when
+   the device is opened, so queueing and dequeueing a report is O(1) and
+   never touches the allocator. head and tail are free-running counters;
+   tail - head is the number of queued reports. */
+struct input_ring {
+	struct input_report *slots;
+	uint8_t *slab;
+	size_t slot_size;
+	unsigned int cap;  /* reports kept before dropping the oldest */
+	unsigned int mask; /* slot count (a power of two) minus one */
+	unsigned int head; /* next report to read */
+	unsigned int tail; /* next slot to fill */
+
+	/* Zero-copy mode: payload buffers of the slab not owned by a slot,
+	   for the transfers and to replace the ones handed to the user */
+	uint8_t **spare;
+	unsigned int num_spare;
+	unsigned int max_spare; /* size of the pool */
+};
+
+
+/* Interrupt IN transfer owned by a device. Transfers are submitted round
+   robin, so the one carrying sequence number seq is always
+   transfers[seq % num_transfers]. */
+struct input_transfer {
+	struct libusb_transfer *transfer;
+	hid_device *dev;
+	int submitted; /* boolean */
+	int completed; /* boolean, waiting for its turn to be delivered */
+	uint64_t timestamp; /* completion time, see monotonic_ns() */
 };
 
+/* Output report queued by hid_write_async(). buffer starts with room for
+   a control setup packet. */
+struct output_report {
+	unsigned char *buffer;
+	size_t length; /* without the setup packet and skipped report ID */
+	int report_number;
+	int skipped_report_id; /* boolean */
+	hid_write_callback callback;
+	void *user_data;
+};
 
 struct hid_device_ {
 	/* Handle to the actual device. */
 	libusb_device_handle *device_handle;
+
+	/* hidraw node, or -1 when the libusb backend is used */
+	int hidraw_fd;
+
+	/* Path key (see path_key()) and link in the list of open devices */
+	uint32_t key;
+	struct hid_device_ *next_open;
 	
 	/* Endpoint information */
 	int input_endpoint;
@@ -94,27 +169,95 @@ struct hid_device_ {
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 	
-	/* Read thread objects */
-	pthread_t thread;
+	/* Read objects. The transfers are handled by the shared event
+	   thread. */
 	pthread_mutex_t mutex; /* Protects input_reports */
 	pthread_cond_t condition;
-	pthread_barrier_t barrier; /* Ensures correct startup sequence */
-	int shutdown_thread;
-	struct libusb_transfer *transfer;
-
-	/* List of received input reports. */
-	struct input_report *input_reports;
+	int shutdown_thread; /* boolean, no more transfers are resubmitted */
+
+	/* Readable while reports are queued or reading has stopped, for
+	   hosts polling many devices from one loop. */
+	int poll_fd;
+	int poll_fd_set; /* boolean, an event is pending on poll_fd */
+
+	/* Interrupt IN transfers kept in flight */
+	struct input_transfer transfers[HID_MAX_TRANSFERS];
+	int num_transfers;
+	int in_flight;
+	unsigned int next_deliver; /* sequence number of the next transfer to deliver */
+
+	/* Input counters, protected by mutex */
+	struct hid_device_stats stats;
+
+	/* What to do with a report while older ones are still queued */
+	int queue_policy;
+	int merge_prefix;
+	int button_offset;
+	unsigned char button_mask;
+
+	/* Ring of received input reports. */
+	struct input_ring input_reports;
+	int zero_copy; /* boolean, transfer buffers are swapped into the ring */
+
+	/* Output reports queued by hid_write_async(), submitted one at a
+	   time on the event thread. Protected by mutex. */
+	struct output_report writes[HID_MAX_WRITES];
+	unsigned int write_head;
+	unsigned int write_tail;
+	struct libusb_transfer *write_transfer;
+	int write_in_flight; /* boolean */
+
+	/* Input fields, compiled from the report descriptor at open */
+	struct hid_report_layout layout;
 };
 
 static int initialized = 0;
 
+/* Each driver links its own copy of this file. A private context keeps
+   their event threads from polling and handling the same events. */
+static libusb_context *usb_context = NULL;
+
+/* A single thread handles the libusb events of every open device of
+   this copy. It is started by the first hid_open_path() and stopped by
+   the last hid_close(). */
+static pthread_mutex_t event_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t event_thread;
+static int event_thread_refs = 0;
+static int event_thread_quit = 0; /* atomic */
+
+/* Wakes the event thread up from poll(), so it notices a quit request
+   right away whatever the libusb version. */
+static int event_thread_wake_fd = -1;
+
+/* Most libusb fds the event thread polls */
+#define EVENT_THREAD_MAX_FDS 64
+
+/* Set by the libusb pollfd notifiers, the event thread takes the fd list
+   again only then. */
+static int event_thread_fds_changed = 0; /* atomic */
+
+/* Scheduling of the event and hidraw threads, see hid_set_thread_sched().
+   Taken after event_thread_mutex or hidraw_mutex. */
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int sched_policy = SCHED_OTHER;
+static int sched_priority = 0;
+static unsigned int sched_cpus = 0;
+static int event_thread_sched = HID_SCHED_REALTIME | HID_SCHED_AFFINITY;
+
 uint16_t get_usb_code_for_current_locale(void);
-static int return_data(hid_device *dev, unsigned char *data, size_t length);
+static int return_data(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp);
+static void write_callback(struct libusb_transfer *transfer);
+static void finish_writes(hid_device *dev, struct output_report *done, int num_done, int result);
+
+/* Report timestamps, in nanoseconds of CLOCK_MONOTONIC. Shared with the
+   drivers, see utils.c */
+unsigned long long monotonic_ns(void);
 
 static hid_device *new_hid_device(void)
 {
 	hid_device *dev = calloc(1, sizeof(hid_device));
 	dev->device_handle = NULL;
+	dev->hidraw_fd = -1;
 	dev->input_endpoint = 0;
 	dev->output_endpoint = 0;
 	dev->input_ep_max_packet_size = 0;
@@ -124,20 +267,156 @@ static hid_device *new_hid_device(void)
 	dev->serial_index = 0;
 	dev->blocking = 1;
 	dev->shutdown_thread = 0;
-	dev->transfer = NULL;
-	dev->input_reports = NULL;
+	dev->poll_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	dev->poll_fd_set = 0;
+	memset(dev->transfers, 0, sizeof(dev->transfers));
+	dev->num_transfers = HID_DEFAULT_TRANSFERS;
+	dev->in_flight = 0;
+	dev->next_deliver = 0;
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	dev->queue_policy = HID_QUEUE_FIFO;
+	dev->merge_prefix = 1;
+	dev->button_offset = -1;
+	dev->button_mask = 0;
+	memset(&dev->input_reports, 0, sizeof(dev->input_reports));
 	
 	pthread_mutex_init(&dev->mutex, NULL);
 	pthread_cond_init(&dev->condition, NULL);
-	pthread_barrier_init(&dev->barrier, NULL, 2);
 	
 	return dev;
 }
 
+static int input_ring_init(struct input_ring *ring, size_t report_size, unsigned int cap, unsigned int spares)
+{
+	unsigned int i;
+	unsigned int slots = 1;
+	void *slab = NULL;
+
+	while (slots < cap)
+		slots <<= 1;
+
+	/* Round the payload stride up to a whole number of cache lines. */
+	if (report_size == 0)
+		report_size = 1;
+	ring->slot_size = (report_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+
+	if (posix_memalign(&slab, CACHE_LINE_SIZE, ring->slot_size * (slots + spares)) != 0)
+		return -1;
+	ring->slots = calloc(slots, sizeof(struct input_report));
+	ring->spare = calloc(spares + 1, sizeof(uint8_t *));
+	if (!ring->slots || !ring->spare) {
+		free(ring->slots);
+		free(ring->spare);
+		free(slab);
+		return -1;
+	}
+
+	ring->slab = slab;
+	for (i = 0; i < slots; i++)
+		ring->slots[i].data = ring->slab + i * ring->slot_size;
+	for (i = 0; i < spares; i++)
+		ring->spare[i] = ring->slab + (slots + i) * ring->slot_size;
+	ring->num_spare = spares;
+	ring->max_spare = spares;
+	ring->cap = cap;
+	ring->mask = slots - 1;
+	ring->head = 0;
+	ring->tail = 0;
+
+	return 0;
+}
+
+static void input_ring_free(struct input_ring *ring)
+{
+	free(ring->slots);
+	free(ring->spare);
+	free(ring->slab);
+	memset(ring, 0, sizeof(*ring));
+}
+
+static unsigned int input_ring_count(const struct input_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+static int input_ring_full(const struct input_ring *ring)
+{
+	return input_ring_count(ring) >= ring->cap;
+}
+
+/* Oldest queued report. Only valid when the ring is not empty. */
+static struct input_report *input_ring_front(struct input_ring *ring)
+{
+	return &ring->slots[ring->head & ring->mask];
+}
+
+/* Most recently queued report. Only valid when the ring is not empty. */
+static struct input_report *input_ring_back(struct input_ring *ring)
+{
+	return &ring->slots[(ring->tail - 1) & ring->mask];
+}
+
+static void input_ring_pop(struct input_ring *ring)
+{
+	ring->head++;
+}
+
+/* Stores a payload in a slot. With swap, the buffer holding the payload
+   is exchanged with the one of the slot instead of being copied. */
+static void input_report_set(struct input_ring *ring, struct input_report *rpt, const uint8_t *data, size_t len, uint64_t timestamp, uint8_t **swap)
+{
+	if (len > ring->slot_size)
+		len = ring->slot_size;
+	if (swap) {
+		uint8_t *tmp = rpt->data;
+		rpt->data = *swap;
+		*swap = tmp;
+	}
+	else
+		memcpy(rpt->data, data, len);
+	rpt->len = len;
+	rpt->timestamp = timestamp;
+}
+
+/* Copies a report into the next free slot. The caller makes room first. */
+static void input_ring_push(struct input_ring *ring, const uint8_t *data, size_t len, uint64_t timestamp, uint8_t **swap)
+{
+	input_report_set(ring, &ring->slots[ring->tail & ring->mask], data, len, timestamp, swap);
+	ring->tail++;
+}
+
+/* Makes the poll fd readable.
+   This should be called with dev->mutex locked. */
+static void poll_fd_raise(hid_device *dev)
+{
+	uint64_t one = 1;
+	if (dev->poll_fd >= 0 && !dev->poll_fd_set) {
+		if (write(dev->poll_fd, &one, sizeof(one)) == sizeof(one))
+			dev->poll_fd_set = 1;
+	}
+}
+
+/* Clears the poll fd once there is nothing left to read.
+   This should be called with dev->mutex locked. */
+static void poll_fd_lower(hid_device *dev)
+{
+	uint64_t value;
+	if (dev->poll_fd_set && !dev->shutdown_thread &&
+	    input_ring_count(&dev->input_reports) == 0) {
+		if (read(dev->poll_fd, &value, sizeof(value)) == sizeof(value))
+			dev->poll_fd_set = 0;
+	}
+}
+
 static void free_hid_device(hid_device *dev)
 {
+	/* Release the input report storage */
+	input_ring_free(&dev->input_reports);
+
+	if (dev->poll_fd >= 0)
+		close(dev->poll_fd);
+
 	/* Clean up the thread objects */
-	pthread_barrier_destroy(&dev->barrier);
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
@@ -153,7 +432,6 @@ static void register_error(hid_device *device, const char *op)
 }
 #endif
 
-#ifdef INVASIVE_GET_USAGE
 /* Get bytes from a HID Report Descriptor.
    Only call with a num_bytes of 0, 1, 2, or 4. */
 static uint32_t get_bytes(uint8_t *rpt, size_t len, size_t num_bytes, size_t cur)
@@ -180,6 +458,7 @@ static uint32_t get_bytes(uint8_t *rpt, size_t len, size_t num_bytes, size_t cur
 		return 0;
 }
 
+#ifdef INVASIVE_GET_USAGE
 /* Retrieves the device's Usage Page and Usage from the report
    descriptor. The algorithm is simple, as it just returns the first
    Usage and Usage Page that it finds in the descriptor.
@@ -255,6 +534,209 @@ static int get_usage(uint8_t *report_descriptor, size_t size,
 }
 #endif // INVASIVE_GET_USAGE
 
+/* Report descriptor compiler. The variable input items of a descriptor
+   are turned into a table of fields, with the shifts and masks needed to
+   extract them precomputed, so drivers can decode devices they have no
+   specific code for. Push/Pop and delimiters are not supported. */
+#define LAYOUT_MAX_USAGES 32
+
+static void layout_add_field(struct hid_report_layout *layout, int report_id,
+                             uint32_t usage, unsigned int bit_offset, unsigned int bit_size,
+                             int32_t logical_min, int32_t logical_max)
+{
+	struct hid_field *field;
+
+	if (layout->num_fields >= HID_MAX_FIELDS || bit_size < 1 || bit_size > 32)
+		return;
+
+	field = &layout->fields[layout->num_fields++];
+	field->report_id = report_id;
+	field->usage_page = usage >> 16;
+	field->usage = usage & 0xffff;
+	field->bit_offset = bit_offset;
+	field->bit_size = bit_size;
+	field->logical_min = logical_min;
+	field->logical_max = logical_max;
+
+	field->byte_offset = bit_offset / 8;
+	field->shift = bit_offset % 8;
+	field->byte_count = (field->shift + bit_size + 7) / 8;
+	field->is_signed = (logical_min < 0);
+	field->mask = (bit_size == 32)? 0xffffffff: ((1u << bit_size) - 1);
+}
+
+static int32_t sign_extend(uint32_t value, int num_bytes)
+{
+	if (num_bytes == 1)
+		return (int8_t)value;
+	if (num_bytes == 2)
+		return (int16_t)value;
+	return (int32_t)value;
+}
+
+static void compile_report_descriptor(uint8_t *desc, size_t size, struct hid_report_layout *layout)
+{
+	uint16_t bit_offsets[256]; /* next input bit, per report ID */
+	uint32_t usages[LAYOUT_MAX_USAGES];
+	int num_usages = 0;
+	uint32_t usage_min = 0, usage_max = 0;
+	int usage_range = 0;
+	uint32_t usage_page = 0;
+	int32_t logical_min = 0, logical_max = 0;
+	unsigned int report_size = 0, report_count = 0;
+	int report_id = 0;
+	size_t i = 0;
+
+	memset(bit_offsets, 0, sizeof(bit_offsets));
+	layout->num_fields = 0;
+
+	while (i < size) {
+		int key = desc[i];
+		int type = (key >> 2) & 0x3;
+		int tag = key >> 4;
+		int data_len = (key & 0x3) == 3 ? 4 : (key & 0x3);
+		uint32_t value;
+
+		if ((key & 0xf0) == 0xf0) {
+			/* Long Item, nothing we use */
+			i += 3 + ((i+1 < size)? desc[i+1]: 0);
+			continue;
+		}
+
+		value = get_bytes(desc, size, data_len, i);
+
+		if (type == 0) {
+			/* Main Item */
+			if (tag == 0x8) {
+				/* Input. Constant items are padding and array
+				   items carry usage indexes, only variable
+				   data ones become fields. */
+				unsigned int base = bit_offsets[report_id];
+				unsigned int n;
+
+				if (!(value & 0x01) && (value & 0x02)) {
+					for (n = 0; n < report_count; n++) {
+						uint32_t usage;
+						if (n < num_usages)
+							usage = usages[n];
+						else if (usage_range)
+							usage = (usage_min + n > usage_max)? usage_max: usage_min + n;
+						else if (num_usages > 0)
+							usage = usages[num_usages-1];
+						else
+							continue;
+						layout_add_field(layout, report_id, usage,
+						                 base + n * report_size, report_size,
+						                 logical_min, logical_max);
+					}
+				}
+				bit_offsets[report_id] = base + report_size * report_count;
+			}
+
+			/* Local items only apply to the next main item */
+			num_usages = 0;
+			usage_range = 0;
+		}
+		else if (type == 1) {
+			/* Global Item */
+			switch (tag) {
+			case 0x0:
+				usage_page = value;
+				break;
+			case 0x1:
+				logical_min = sign_extend(value, data_len);
+				break;
+			case 0x2:
+				/* Many devices forget the sign bit of a positive
+				   maximum, read it unsigned then. */
+				logical_max = sign_extend(value, data_len);
+				if (logical_max < logical_min)
+					logical_max = value;
+				break;
+			case 0x7:
+				report_size = value;
+				break;
+			case 0x8:
+				report_id = value & 0xff;
+				/* The report ID byte comes first */
+				if (bit_offsets[report_id] == 0)
+					bit_offsets[report_id] = 8;
+				break;
+			case 0x9:
+				report_count = value;
+				break;
+			}
+		}
+		else if (type == 2) {
+			/* Local Item. 4 byte usages carry their page. */
+			if (data_len < 4)
+				value |= usage_page << 16;
+			switch (tag) {
+			case 0x0:
+				if (num_usages < LAYOUT_MAX_USAGES)
+					usages[num_usages++] = value;
+				break;
+			case 0x1:
+				usage_min = value;
+				usage_range = 1;
+				break;
+			case 0x2:
+				usage_max = value;
+				usage_range = 1;
+				break;
+			}
+		}
+
+		i += 1 + data_len;
+	}
+}
+
+/* Reads the report descriptor of an opened device and compiles it into
+   dev->layout. */
+static void read_report_layout(hid_device *dev)
+{
+	uint8_t *desc;
+	int res = -1;
+
+	dev->layout.num_fields = 0;
+
+	desc = malloc(HID_MAX_DESCRIPTOR_SIZE);
+	if (!desc)
+		return;
+
+#ifdef HID_HIDRAW_BACKEND
+	if (dev->hidraw_fd >= 0) {
+		struct hidraw_report_descriptor rpt_desc;
+		int desc_size = 0;
+		if (ioctl(dev->hidraw_fd, HIDIOCGRDESCSIZE, &desc_size) == 0 &&
+		    desc_size > 0 && desc_size <= HID_MAX_DESCRIPTOR_SIZE &&
+		    desc_size <= (int)sizeof(rpt_desc.value)) {
+			rpt_desc.size = desc_size;
+			if (ioctl(dev->hidraw_fd, HIDIOCGRDESC, &rpt_desc) == 0) {
+				memcpy(desc, rpt_desc.value, desc_size);
+				res = desc_size;
+			}
+		}
+	}
+	else
+#endif
+	res = libusb_control_transfer(dev->device_handle,
+		LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE,
+		LIBUSB_REQUEST_GET_DESCRIPTOR,
+		LIBUSB_DT_REPORT << 8,
+		dev->interface,
+		desc, HID_MAX_DESCRIPTOR_SIZE,
+		1000/*timeout millis*/);
+
+	if (res > 0)
+		compile_report_descriptor(desc, res, &dev->layout);
+	else
+		LOG("can't read the report descriptor: %d\n", res);
+
+	free(desc);
+}
+
+
 
 /* Get the first language the device says it reports. This comes from
    USB string #0. */
@@ -382,98 +864,532 @@ static char *make_path(libusb_device *dev, int interface_number)
 }
 
 
-int HID_API_EXPORT hid_init(void)
+/* Index of the HID interfaces attached to the system, keyed by path, so
+   that hid_open_path() doesn't have to walk the descriptors of every USB
+   device. It is built on the first open and kept up to date by hotplug
+   events when libusb supports them. A miss or a stale entry triggers a
+   rebuild, which also covers events not handled yet. */
+#define PATH_INDEX_BUCKETS 64 /* power of two */
+
+struct path_entry {
+	uint32_t key; /* see path_key() */
+	libusb_device *device; /* referenced while indexed */
+
+	unsigned short vendor_id;
+	unsigned short product_id;
+
+	/* What hid_open_path() needs from the config descriptor */
+	int interface;
+	int input_endpoint;
+	int input_ep_max_packet_size;
+	int output_endpoint;
+
+	struct path_entry *next;
+};
+
+/* Interface arrival or removal seen by the index, reported to the hotplug
+   callbacks once the index is unlocked. */
+struct hotplug_note {
+	int event;
+	uint32_t key;
+	unsigned short vendor_id;
+	unsigned short product_id;
+};
+
+/* Upper bound of HID interfaces reported per USB device */
+#define MAX_HOTPLUG_NOTES 16
+
+static pthread_mutex_t path_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct path_entry *path_index[PATH_INDEX_BUCKETS];
+static int path_index_built = 0;
+
+/* Registered by hid_init() and deregistered by hid_exit(), never with
+   path_index_mutex held: libusb runs the callback with its own hotplug
+   lock held, and the callback takes path_index_mutex. */
+static int path_index_hotplug = 0;
+static libusb_hotplug_callback_handle path_index_hotplug_handle;
+
+static uint32_t make_key(uint8_t bus, uint8_t address, uint8_t interface_number)
 {
-	if (!initialized) {
-		if (libusb_init(NULL))
-			return -1;
-		initialized = 1;
-	}
+	return ((uint32_t)bus << 16) | ((uint32_t)address << 8) | interface_number;
+}
 
+/* Key of a "bbbb:dddd:ii" path, as built by make_path(). Returns -1 if
+   the path is malformed. */
+static int path_key(const char *path, uint32_t *key)
+{
+	unsigned int bus, address, interface_number;
+	if (sscanf(path, "%x:%x:%x", &bus, &address, &interface_number) != 3)
+		return -1;
+	if (bus > 0xff || address > 0xff || interface_number > 0xff)
+		return -1;
+	*key = make_key(bus, address, interface_number);
 	return 0;
 }
 
-int HID_API_EXPORT hid_exit(void)
+static unsigned int path_bucket(uint32_t key)
 {
-	if (initialized) {
-		libusb_exit(NULL);
-		initialized = 0;
+	/* Fibonacci hashing, the address byte varies the most. */
+	return (key * 2654435761u) >> 26 & (PATH_INDEX_BUCKETS - 1);
+}
+
+static struct path_entry *path_index_find(uint32_t key)
+{
+	struct path_entry *e = path_index[path_bucket(key)];
+	while (e && e->key != key)
+		e = e->next;
+	return e;
+}
+
+/* Indexes the HID interfaces of a device. The new interfaces are appended
+   to notes, if not NULL.
+   This should be called with path_index_mutex locked. */
+static void path_index_add_device(libusb_device *usb_dev, struct hotplug_note *notes, int *num_notes)
+{
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	int i, j, k;
+
+	if (libusb_get_device_descriptor(usb_dev, &desc) < 0)
+		return;
+	if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
+		return;
+	for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+		const struct libusb_interface *intf = &conf_desc->interface[j];
+		for (k = 0; k < intf->num_altsetting; k++) {
+			const struct libusb_interface_descriptor *intf_desc;
+			struct path_entry *e;
+			uint32_t key;
+			intf_desc = &intf->altsetting[k];
+			if (intf_desc->bInterfaceClass != LIBUSB_CLASS_HID)
+				continue;
+
+			key = make_key(libusb_get_bus_number(usb_dev),
+			               libusb_get_device_address(usb_dev),
+			               intf_desc->bInterfaceNumber);
+			if (path_index_find(key))
+				continue;
+
+			e = calloc(1, sizeof(struct path_entry));
+			e->key = key;
+			e->device = libusb_ref_device(usb_dev);
+			e->vendor_id = desc.idVendor;
+			e->product_id = desc.idProduct;
+			e->interface = intf_desc->bInterfaceNumber;
+
+			/* Find the INPUT and OUTPUT endpoints. An
+			   OUTPUT endpoint is not required. */
+			for (i = 0; i < intf_desc->bNumEndpoints; i++) {
+				const struct libusb_endpoint_descriptor *ep
+					= &intf_desc->endpoint[i];
+
+				/* Determine the type and direction of this
+				   endpoint. */
+				int is_interrupt =
+					(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+				      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
+				int is_output = 
+					(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+				      == LIBUSB_ENDPOINT_OUT;
+				int is_input = 
+					(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+				      == LIBUSB_ENDPOINT_IN;
+
+				/* Decide whether to use it for intput or output. */
+				if (e->input_endpoint == 0 &&
+				    is_interrupt && is_input) {
+					/* Use this endpoint for INPUT */
+					e->input_endpoint = ep->bEndpointAddress;
+					e->input_ep_max_packet_size = ep->wMaxPacketSize;
+				}
+				if (e->output_endpoint == 0 &&
+				    is_interrupt && is_output) {
+					/* Use this endpoint for OUTPUT */
+					e->output_endpoint = ep->bEndpointAddress;
+				}
+			}
+
+			e->next = path_index[path_bucket(key)];
+			path_index[path_bucket(key)] = e;
+
+			if (notes && *num_notes < MAX_HOTPLUG_NOTES) {
+				struct hotplug_note *n = &notes[(*num_notes)++];
+				n->event = HID_HOTPLUG_ARRIVED;
+				n->key = key;
+				n->vendor_id = e->vendor_id;
+				n->product_id = e->product_id;
+			}
+		}
 	}
+	libusb_free_config_descriptor(conf_desc);
+}
 
-	return 0;
+/* Forgets the interfaces of a device, or all of them if usb_dev is NULL.
+   The removed interfaces are appended to notes, if not NULL.
+   This should be called with path_index_mutex locked. */
+static void path_index_remove_device(libusb_device *usb_dev, struct hotplug_note *notes, int *num_notes)
+{
+	int b;
+	for (b = 0; b < PATH_INDEX_BUCKETS; b++) {
+		struct path_entry **link = &path_index[b];
+		while (*link) {
+			struct path_entry *e = *link;
+			if (usb_dev == NULL || e->device == usb_dev) {
+				if (notes && *num_notes < MAX_HOTPLUG_NOTES) {
+					struct hotplug_note *n = &notes[(*num_notes)++];
+					n->event = HID_HOTPLUG_LEFT;
+					n->key = e->key;
+					n->vendor_id = e->vendor_id;
+					n->product_id = e->product_id;
+				}
+				*link = e->next;
+				libusb_unref_device(e->device);
+				free(e);
+			}
+			else {
+				link = &e->next;
+			}
+		}
+	}
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+static void notify_hotplug(const struct hotplug_note *notes, int num_notes);
+
+static int path_index_hotplug_callback(libusb_context *ctx, libusb_device *usb_dev,
+                                       libusb_hotplug_event event, void *user_data)
+{
+	struct hotplug_note notes[MAX_HOTPLUG_NOTES];
+	int num_notes = 0;
+
+	pthread_mutex_lock(&path_index_mutex);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		path_index_add_device(usb_dev, notes, &num_notes);
+	else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+		path_index_remove_device(usb_dev, notes, &num_notes);
+	pthread_mutex_unlock(&path_index_mutex);
+
+	notify_hotplug(notes, num_notes);
+
+	return 0; /* stay registered */
+}
+
+/* Rebuilds the whole index from the current device list.
+   This should be called with path_index_mutex locked. */
+static void path_index_rebuild(void)
 {
 	libusb_device **devs;
-	libusb_device *dev;
-	libusb_device_handle *handle;
 	ssize_t num_devs;
-	int i = 0;
-	
-	struct hid_device_info *root = NULL; // return object
-	struct hid_device_info *cur_dev = NULL;
-	
-	setlocale(LC_ALL,"");
-	
-	if (!initialized)
-		hid_init();
+	ssize_t d;
 
-	num_devs = libusb_get_device_list(NULL, &devs);
-	if (num_devs < 0)
-		return NULL;
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int j, k;
-		int interface_num = 0;
+	path_index_remove_device(NULL, NULL, NULL);
 
-		int res = libusb_get_device_descriptor(dev, &desc);
-		unsigned short dev_vid = desc.idVendor;
-		unsigned short dev_pid = desc.idProduct;
-		
-		/* HID's are defined at the interface level. */
-		if (desc.bDeviceClass != LIBUSB_CLASS_PER_INTERFACE)
-			continue;
+	num_devs = libusb_get_device_list(usb_context, &devs);
+	for (d = 0; d < num_devs; d++)
+		path_index_add_device(devs[d], NULL, NULL);
+	if (num_devs >= 0)
+		libusb_free_device_list(devs, 1);
 
-		res = libusb_get_active_config_descriptor(dev, &conf_desc);
-		if (res < 0)
-			libusb_get_config_descriptor(dev, 0, &conf_desc);
-		if (conf_desc) {
-			for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-				const struct libusb_interface *intf = &conf_desc->interface[j];
-				for (k = 0; k < intf->num_altsetting; k++) {
-					const struct libusb_interface_descriptor *intf_desc;
-					intf_desc = &intf->altsetting[k];
-					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-						interface_num = intf_desc->bInterfaceNumber;
+	path_index_built = 1;
+}
 
-						/* Check the VID/PID against the arguments */
-						if ((vendor_id == 0x0 && product_id == 0x0) ||
-						    (vendor_id == dev_vid && product_id == dev_pid)) {
-							struct hid_device_info *tmp;
+/* Looks a path up, rebuilding the index on a miss or when rebuild is
+   set. On success the entry is copied to out, holding its own reference
+   on the device which the caller must drop with libusb_unref_device(). */
+static int path_index_lookup(uint32_t key, int rebuild, struct path_entry *out)
+{
+	struct path_entry *e;
 
-							/* VID/PID match. Create the record. */
-							tmp = calloc(1, sizeof(struct hid_device_info));
-							if (cur_dev) {
-								cur_dev->next = tmp;
-							}
-							else {
-								root = tmp;
-							}
-							cur_dev = tmp;
-							
-							/* Fill out the record */
-							cur_dev->next = NULL;
-							cur_dev->path = make_path(dev, interface_num);
-							
-							res = libusb_open(dev, &handle);
+	pthread_mutex_lock(&path_index_mutex);
+	if (!path_index_built || rebuild) {
+		path_index_rebuild();
+		rebuild = 1;
+	}
+	e = path_index_find(key);
+	if (!e && !rebuild) {
+		path_index_rebuild();
+		e = path_index_find(key);
+	}
+	if (e) {
+		*out = *e;
+		out->next = NULL;
+		libusb_ref_device(out->device);
+	}
+	pthread_mutex_unlock(&path_index_mutex);
 
-							if (res >= 0) {
-								/* Serial Number */
-								if (desc.iSerialNumber > 0)
-									cur_dev->serial_number =
-										get_usb_string(handle, desc.iSerialNumber);
+	return e ? 0 : -1;
+}
+
+/* Keeps the index up to date on hotplug capable systems. */
+static void path_index_listen(void)
+{
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+	    libusb_hotplug_register_callback(usb_context,
+	        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+	        LIBUSB_HOTPLUG_NO_FLAGS,
+	        LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+	        path_index_hotplug_callback, NULL,
+	        &path_index_hotplug_handle) == 0)
+		path_index_hotplug = 1;
+}
+
+static void path_index_free(void)
+{
+	if (path_index_hotplug) {
+		libusb_hotplug_deregister_callback(usb_context, path_index_hotplug_handle);
+		path_index_hotplug = 0;
+	}
+
+	pthread_mutex_lock(&path_index_mutex);
+	path_index_remove_device(NULL, NULL, NULL);
+	path_index_built = 0;
+	pthread_mutex_unlock(&path_index_mutex);
+}
+
+
+/* Devices currently open, so that a removal can stop them right away. */
+static pthread_mutex_t open_devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+static hid_device *open_devices = NULL;
+
+/* Callbacks registered with hid_hotplug_register() */
+#define MAX_HOTPLUG_CALLBACKS 16
+
+struct hotplug_callback {
+	hid_hotplug_callback callback;
+	void *user_data;
+};
+
+static pthread_mutex_t hotplug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hotplug_callback hotplug_callbacks[MAX_HOTPLUG_CALLBACKS];
+
+static int event_thread_acquire(void);
+static void event_thread_release(void);
+
+static void add_open_device(hid_device *dev)
+{
+	pthread_mutex_lock(&open_devices_mutex);
+	dev->next_open = open_devices;
+	open_devices = dev;
+	pthread_mutex_unlock(&open_devices_mutex);
+}
+
+static void remove_open_device(hid_device *dev)
+{
+	hid_device **link;
+
+	pthread_mutex_lock(&open_devices_mutex);
+	for (link = &open_devices; *link; link = &(*link)->next_open) {
+		if (*link == dev) {
+			*link = dev->next_open;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&open_devices_mutex);
+}
+
+/* Runs on the event thread, without the index locked. */
+static void notify_hotplug(const struct hotplug_note *notes, int num_notes)
+{
+	struct hotplug_callback callbacks[MAX_HOTPLUG_CALLBACKS];
+	int i, c;
+
+	/* Wake the readers of a removed device right away instead of
+	   waiting for its transfers to fail. */
+	pthread_mutex_lock(&open_devices_mutex);
+	for (i = 0; i < num_notes; i++) {
+		hid_device *dev;
+		if (notes[i].event != HID_HOTPLUG_LEFT)
+			continue;
+		for (dev = open_devices; dev; dev = dev->next_open) {
+			if (dev->key != notes[i].key)
+				continue;
+			pthread_mutex_lock(&dev->mutex);
+			dev->shutdown_thread = 1;
+			poll_fd_raise(dev);
+			pthread_cond_broadcast(&dev->condition);
+			pthread_mutex_unlock(&dev->mutex);
+		}
+	}
+	pthread_mutex_unlock(&open_devices_mutex);
+
+	/* Called unlocked, but they must only post work: opening or
+	   closing a device from here would wait on this very thread. */
+	pthread_mutex_lock(&hotplug_mutex);
+	memcpy(callbacks, hotplug_callbacks, sizeof(callbacks));
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	for (i = 0; i < num_notes; i++) {
+		char path[64];
+		snprintf(path, sizeof(path), "%04x:%04x:%02x",
+			(notes[i].key >> 16) & 0xff,
+			(notes[i].key >> 8) & 0xff,
+			notes[i].key & 0xff);
+		for (c = 0; c < MAX_HOTPLUG_CALLBACKS; c++) {
+			if (callbacks[c].callback)
+				callbacks[c].callback(notes[i].event, path,
+					notes[i].vendor_id, notes[i].product_id,
+					callbacks[c].user_data);
+		}
+	}
+}
+
+int HID_API_EXPORT hid_hotplug_register(hid_hotplug_callback callback, void *user_data)
+{
+	int handle = -1;
+	int c;
+
+	if (!initialized)
+		hid_init();
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return -1;
+
+	/* The index must be listening to hotplug events, and built so
+	   that removals of the devices present now are reported. */
+	if (!path_index_hotplug)
+		return -1;
+	pthread_mutex_lock(&path_index_mutex);
+	if (!path_index_built)
+		path_index_rebuild();
+	pthread_mutex_unlock(&path_index_mutex);
+
+	pthread_mutex_lock(&hotplug_mutex);
+	for (c = 0; c < MAX_HOTPLUG_CALLBACKS; c++) {
+		if (!hotplug_callbacks[c].callback) {
+			hotplug_callbacks[c].callback = callback;
+			hotplug_callbacks[c].user_data = user_data;
+			handle = c;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	/* Somebody has to handle the events even when no device is open,
+	   for the arrivals to be reported. */
+	if (handle >= 0 && event_thread_acquire() < 0) {
+		pthread_mutex_lock(&hotplug_mutex);
+		hotplug_callbacks[handle].callback = NULL;
+		pthread_mutex_unlock(&hotplug_mutex);
+		handle = -1;
+	}
+
+	return handle;
+}
+
+void HID_API_EXPORT hid_hotplug_deregister(int handle)
+{
+	int registered = 0;
+
+	if (handle < 0 || handle >= MAX_HOTPLUG_CALLBACKS)
+		return;
+
+	pthread_mutex_lock(&hotplug_mutex);
+	if (hotplug_callbacks[handle].callback) {
+		hotplug_callbacks[handle].callback = NULL;
+		hotplug_callbacks[handle].user_data = NULL;
+		registered = 1;
+	}
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	if (registered)
+		event_thread_release();
+}
+
+
+int HID_API_EXPORT hid_init(void)
+{
+	if (!initialized) {
+		if (libusb_init(&usb_context))
+			return -1;
+		path_index_listen();
+		initialized = 1;
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_exit(void)
+{
+	if (initialized) {
+		path_index_free();
+		libusb_exit(usb_context);
+		usb_context = NULL;
+		initialized = 0;
+	}
+
+	return 0;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	libusb_device **devs;
+	libusb_device *dev;
+	libusb_device_handle *handle;
+	ssize_t num_devs;
+	int i = 0;
+	
+	struct hid_device_info *root = NULL; // return object
+	struct hid_device_info *cur_dev = NULL;
+	
+	setlocale(LC_ALL,"");
+	
+	if (!initialized)
+		hid_init();
+
+	num_devs = libusb_get_device_list(usb_context, &devs);
+	if (num_devs < 0)
+		return NULL;
+	while ((dev = devs[i++]) != NULL) {
+		struct libusb_device_descriptor desc;
+		struct libusb_config_descriptor *conf_desc = NULL;
+		int j, k;
+		int interface_num = 0;
+
+		int res = libusb_get_device_descriptor(dev, &desc);
+		unsigned short dev_vid = desc.idVendor;
+		unsigned short dev_pid = desc.idProduct;
+		
+		/* HID's are defined at the interface level. */
+		if (desc.bDeviceClass != LIBUSB_CLASS_PER_INTERFACE)
+			continue;
+
+		res = libusb_get_active_config_descriptor(dev, &conf_desc);
+		if (res < 0)
+			libusb_get_config_descriptor(dev, 0, &conf_desc);
+		if (conf_desc) {
+			for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+				const struct libusb_interface *intf = &conf_desc->interface[j];
+				for (k = 0; k < intf->num_altsetting; k++) {
+					const struct libusb_interface_descriptor *intf_desc;
+					intf_desc = &intf->altsetting[k];
+					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+						interface_num = intf_desc->bInterfaceNumber;
+
+						/* Check the VID/PID against the arguments */
+						if ((vendor_id == 0x0 && product_id == 0x0) ||
+						    (vendor_id == dev_vid && product_id == dev_pid)) {
+							struct hid_device_info *tmp;
+
+							/* VID/PID match. Create the record. */
+							tmp = calloc(1, sizeof(struct hid_device_info));
+							if (cur_dev) {
+								cur_dev->next = tmp;
+							}
+							else {
+								root = tmp;
+							}
+							cur_dev = tmp;
+							
+							/* Fill out the record */
+							cur_dev->next = NULL;
+							cur_dev->path = make_path(dev, interface_num);
+							
+							res = libusb_open(dev, &handle);
+
+							if (res >= 0) {
+								/* Serial Number */
+								if (desc.iSerialNumber > 0)
+									cur_dev->serial_number =
+										get_usb_string(handle, desc.iSerialNumber);
 
 								/* Manufacturer and Product strings */
 								if (desc.iManufacturer > 0)
@@ -615,261 +1531,944 @@ hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar
 	return handle;
 }
 
+/* Whether a new report only moves the pointer compared to a queued one:
+   same length, same leading bytes (report ID and command) and same
+   button state. */
+static int is_same_move(hid_device *dev, const struct input_report *rpt, const uint8_t *data, size_t len)
+{
+	size_t prefix = dev->merge_prefix;
+
+	if (rpt->len != len)
+		return 0;
+	if (prefix > len)
+		prefix = len;
+	if (memcmp(rpt->data, data, prefix) != 0)
+		return 0;
+	if (dev->button_offset >= 0 && dev->button_offset < len) {
+		if ((rpt->data[dev->button_offset] & dev->button_mask) !=
+		    (data[dev->button_offset] & dev->button_mask))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Queues the payload of a completed transfer according to the queue
+   policy of the device. When swap is given (zero-copy mode) it points to
+   the buffer holding data, which is given to the ring in exchange for a
+   free one.
+   This should be called with dev->mutex locked. */
+static void queue_report(hid_device *dev, const uint8_t *data, size_t len, uint64_t timestamp, uint8_t **swap)
+{
+	struct input_ring *ring = &dev->input_reports;
+	unsigned int queued = input_ring_count(ring);
+
+	if (queued > 0) {
+		if (dev->queue_policy == HID_QUEUE_LATEST) {
+			/* Only the newest position matters, forget the
+			   unread ones. */
+			dev->stats.coalesced += queued;
+			ring->head = ring->tail;
+		}
+		else if (dev->queue_policy == HID_QUEUE_MERGE_MOVES &&
+		         is_same_move(dev, input_ring_back(ring), data, len)) {
+			/* Update the unread move in place. Button
+			   transitions always get their own report. */
+			input_report_set(ring, input_ring_back(ring), data, len, timestamp, swap);
+			dev->stats.reports++;
+			dev->stats.coalesced++;
+			return;
+		}
+	}
+
+	/* Pop the oldest one off if the ring is full. This way we
+	   keep the most recent reports if the user never reads
+	   anything from the device. */
+	if (input_ring_full(ring)) {
+		input_ring_pop(ring);
+		dev->stats.dropped++;
+	}
+
+	input_ring_push(ring, data, len, timestamp, swap);
+	dev->stats.reports++;
+
+	/* The ring was empty, wake up a waiting reader. */
+	if (input_ring_count(ring) == 1) {
+		pthread_cond_signal(&dev->condition);
+		poll_fd_raise(dev);
+	}
+}
+
 static void read_callback(struct libusb_transfer *transfer)
 {
-	hid_device *dev = transfer->user_data;
-	
-	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+	struct input_transfer *in = transfer->user_data;
+	hid_device *dev = in->dev;
+	struct input_transfer *head;
 
-		struct input_report *rpt = malloc(sizeof(*rpt));
-		rpt->data = malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
+	/* Stamp it before waiting for the lock */
+	in->timestamp = monotonic_ns();
 
-		pthread_mutex_lock(&dev->mutex);
+	pthread_mutex_lock(&dev->mutex);
 
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
+	in->submitted = 0;
+	in->completed = 1;
+	dev->in_flight--;
+
+	head = &dev->transfers[dev->next_deliver % dev->num_transfers];
+	if (in != head)
+		dev->stats.reordered++;
+
+	/* Deliver the completed transfers in submission order, and put
+	   each one back in the queue behind the ones still pending. */
+	while (head->completed) {
+		struct libusb_transfer *t = head->transfer;
+		head->completed = 0;
+		dev->next_deliver++;
+
+		if (t->status == LIBUSB_TRANSFER_COMPLETED) {
+			queue_report(dev, t->buffer, t->actual_length, head->timestamp,
+			             dev->zero_copy? &t->buffer: NULL);
+
+			/* Other transfers kept the endpoint polled while
+			   this one was being handled. */
+			if (dev->in_flight > 0)
+				dev->stats.gaps_avoided++;
+		}
+		else if (t->status == LIBUSB_TRANSFER_CANCELLED) {
+			dev->shutdown_thread = 1;
+		}
+		else if (t->status == LIBUSB_TRANSFER_NO_DEVICE) {
+			dev->shutdown_thread = 1;
+		}
+		else if (t->status == LIBUSB_TRANSFER_TIMED_OUT) {
+			//LOG("Timeout (normal)\n");
 		}
 		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
+			LOG("Unknown transfer code: %d\n", t->status);
+		}
+
+		/* Re-submit the transfer object. Delivery would wait for a
+		   slot which failed to go back for good, so reading stops
+		   and the readers are told right away. */
+		if (!dev->shutdown_thread) {
+			if (libusb_submit_transfer(t) == 0) {
+				head->submitted = 1;
+				dev->in_flight++;
+			}
+			else {
+				LOG("can't resubmit the transfer\n");
+				dev->shutdown_thread = 1;
+				pthread_cond_broadcast(&dev->condition);
+				poll_fd_raise(dev);
 			}
-			cur->next = rpt;
-			
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
-			}			
 		}
-		pthread_mutex_unlock(&dev->mutex);
+
+		head = &dev->transfers[dev->next_deliver % dev->num_transfers];
 	}
-	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
-		return;
+
+	/* Reading has stopped, either due to a disconnect or due to a
+	   call to hid_close(). Wake any threads which are waiting on data
+	   (in hid_read_timeout()) or on the transfers (in hid_close()). */
+	if (dev->shutdown_thread && dev->in_flight == 0) {
+		pthread_cond_broadcast(&dev->condition);
+		poll_fd_raise(dev);
 	}
-	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		dev->shutdown_thread = 1;
-		return;
+
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+
+/* Applies the scheduling options to a thread, returning the HID_SCHED_
+   flags of those in effect. */
+static int apply_thread_sched(pthread_t thread)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	int status = 0;
+	int n, res;
+
+	pthread_mutex_lock(&sched_mutex);
+
+	param.sched_priority = 0;
+	if (sched_policy == SCHED_FIFO || sched_policy == SCHED_RR) {
+		param.sched_priority = sched_priority;
+		if (param.sched_priority < sched_get_priority_min(sched_policy))
+			param.sched_priority = sched_get_priority_min(sched_policy);
+		if (param.sched_priority > sched_get_priority_max(sched_policy))
+			param.sched_priority = sched_get_priority_max(sched_policy);
 	}
-	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
-		//LOG("Timeout (normal)\n");
+	res = pthread_setschedparam(thread, sched_policy, &param);
+	if (res == 0 && sched_policy != SCHED_OTHER)
+		status |= HID_SCHED_REALTIME;
+	else if (res != 0)
+		LOG("real time scheduling not available: %d\n", res);
+
+	/* 0 lets it run anywhere */
+	CPU_ZERO(&cpus);
+	for (n = 0; n < 32; n++) {
+		if (sched_cpus == 0 || (sched_cpus & (1u << n)))
+			CPU_SET(n, &cpus);
 	}
-	else {
-		LOG("Unknown transfer code: %d\n", transfer->status);
+	res = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpus);
+	if (res == 0 && sched_cpus != 0)
+		status |= HID_SCHED_AFFINITY;
+	else if (res != 0)
+		LOG("cpu affinity not available: %d\n", res);
+
+	pthread_mutex_unlock(&sched_mutex);
+
+	return status;
+}
+
+/* libusb added or removed one of its fds, called from any thread. */
+static void event_thread_fd_added(int fd, short events, void *user_data)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&event_thread_fds_changed, 1, __ATOMIC_RELEASE);
+	if (write(event_thread_wake_fd, &one, sizeof(one)) < 0)
+		LOG("can't wake the event thread\n");
+}
+
+static void event_thread_fd_removed(int fd, void *user_data)
+{
+	event_thread_fd_added(fd, 0, user_data);
+}
+
+static void *event_thread_main(void *param)
+{
+	struct pollfd fds[EVENT_THREAD_MAX_FDS + 1];
+	const struct libusb_pollfd **usb_fds;
+	struct timeval tv;
+	int i, nfds, timeout, res;
+	uint64_t value;
+
+	fds[0].fd = event_thread_wake_fd;
+	fds[0].events = POLLIN;
+	nfds = 1;
+
+	/* Waits on the libusb fds and the wake fd together, instead of on
+	   libusb alone with a timeout bounding how late a quit is seen. The
+	   fd list is only taken again when the notifiers say it changed. */
+	while (!__atomic_load_n(&event_thread_quit, __ATOMIC_ACQUIRE)) {
+		if (__atomic_exchange_n(&event_thread_fds_changed, 0, __ATOMIC_ACQ_REL)) {
+			nfds = 1;
+			usb_fds = libusb_get_pollfds(usb_context);
+			if (usb_fds != NULL) {
+				for (i = 0; usb_fds[i] != NULL; i++) {
+					if (nfds > EVENT_THREAD_MAX_FDS) {
+						LOG("too many libusb fds\n");
+						break;
+					}
+					fds[nfds].fd = usb_fds[i]->fd;
+					fds[nfds].events = usb_fds[i]->events;
+					nfds++;
+				}
+				libusb_free_pollfds(usb_fds);
+			}
+		}
+
+		/* Without timerfd support libusb timeouts are ours to track */
+		timeout = -1;
+		if (libusb_get_next_timeout(usb_context, &tv) == 1)
+			timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+
+		res = poll(fds, nfds, timeout);
+		if (res < 0 && errno != EINTR)
+			LOG("poll failed: %d\n", errno);
+
+		if (fds[0].revents & POLLIN) {
+			if (read(event_thread_wake_fd, &value, sizeof(value)) < 0)
+				LOG("event thread wake up lost\n");
+		}
+
+		/* Whatever is ready, without blocking */
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		res = libusb_handle_events_timeout_completed(usb_context, &tv, NULL);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED)
+			LOG("libusb_handle_events failed: %d\n", res);
 	}
-	
-	/* Re-submit the transfer object. */
-	libusb_submit_transfer(transfer);
+
+	return NULL;
+}
+
+static int event_thread_acquire(void)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&event_thread_mutex);
+	if (event_thread_refs == 0) {
+		__atomic_store_n(&event_thread_quit, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&event_thread_fds_changed, 1, __ATOMIC_RELEASE);
+		event_thread_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (event_thread_wake_fd >= 0)
+			libusb_set_pollfd_notifiers(usb_context, event_thread_fd_added,
+			                            event_thread_fd_removed, NULL);
+		if (event_thread_wake_fd < 0 ||
+		    pthread_create(&event_thread, NULL, event_thread_main, NULL) != 0) {
+			if (event_thread_wake_fd >= 0) {
+				libusb_set_pollfd_notifiers(usb_context, NULL, NULL, NULL);
+				close(event_thread_wake_fd);
+			}
+			event_thread_wake_fd = -1;
+			res = -1;
+		}
+		else
+			event_thread_sched = apply_thread_sched(event_thread);
+	}
+	if (res == 0)
+		event_thread_refs++;
+	pthread_mutex_unlock(&event_thread_mutex);
+
+	return res;
 }
 
+static void event_thread_release(void)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&event_thread_mutex);
+	if (--event_thread_refs == 0) {
+		__atomic_store_n(&event_thread_quit, 1, __ATOMIC_RELEASE);
+		if (write(event_thread_wake_fd, &one, sizeof(one)) < 0)
+			LOG("can't wake the event thread\n");
+		pthread_join(event_thread, NULL);
+		libusb_set_pollfd_notifiers(usb_context, NULL, NULL, NULL);
+		close(event_thread_wake_fd);
+		event_thread_wake_fd = -1;
+	}
+	pthread_mutex_unlock(&event_thread_mutex);
+}
 
-static void *read_thread(void *param)
+static void stop_transfers(hid_device *dev);
+
+/* Allocates and submits the input transfers of a freshly opened device.
+   Delivery is in submission order, so a slot which can't be submitted
+   would hold back every report behind it: on any failure whatever was
+   submitted is cancelled and freed, and -1 is returned. */
+static int start_transfers(hid_device *dev)
 {
-	hid_device *dev = param;
-	unsigned char *buf;
 	const size_t length = dev->input_ep_max_packet_size;
+	unsigned char *buffer;
+	int i, res = 0;
 
-	/* Set up the transfer object. */
-	buf = malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
-	
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
+	/* Make sure someone handles the events before submitting. */
+	if (event_thread_acquire() < 0)
+		return -1;
 
-	// Notify the main thread that the read thread is up and running.
-	pthread_barrier_wait(&dev->barrier);
-	
-	/* Handle all the events. */
-	while (!dev->shutdown_thread) {
-		int res;
-		res = libusb_handle_events(NULL);
-		if (res < 0) {
-			/* There was an error. Break out of this loop. */
+	/* Set up the transfer objects. */
+	for (i = 0; i < dev->num_transfers; i++) {
+		struct input_transfer *in = &dev->transfers[i];
+		in->dev = dev;
+		in->transfer = libusb_alloc_transfer(0);
+		if (!in->transfer) {
+			res = -1;
+			break;
+		}
+		buffer = dev->zero_copy?
+			dev->input_reports.spare[--dev->input_reports.num_spare]:
+			malloc(length);
+		if (!buffer) {
+			res = -1;
 			break;
 		}
+		libusb_fill_interrupt_transfer(in->transfer,
+			dev->device_handle,
+			dev->input_endpoint,
+			buffer,
+			length,
+			read_callback,
+			in,
+			5000/*timeout*/);
 	}
-	
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	if (libusb_cancel_transfer(dev->transfer) == 0) {
-		/* The transfer was cancelled, so wait for its completion. */
-		libusb_handle_events(NULL);
+
+	/* Make the first submissions, in order. Further submissions are
+	   made from inside read_callback() */
+	pthread_mutex_lock(&dev->mutex);
+	for (i = 0; res == 0 && i < dev->num_transfers; i++) {
+		if (libusb_submit_transfer(dev->transfers[i].transfer) == 0) {
+			dev->transfers[i].submitted = 1;
+			dev->in_flight++;
+		}
+		else {
+			LOG("can't submit transfer %d\n", i);
+			res = -1;
+		}
 	}
-	
-	/* Now that the read thread is stopping, Wake any threads which are
-	   waiting on data (in hid_read_timeout()). Do this under a mutex to
-	   make sure that a thread which is about to go to sleep waiting on
-	   the condition acutally will go to sleep before the condition is
-	   signaled. */
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (res < 0) {
+		stop_transfers(dev);
+		event_thread_release();
+	}
+
+	return res;
+}
+
+/* Cancels the input transfers of a device, waits for their completion and
+   frees them. */
+static void stop_transfers(hid_device *dev)
+{
+	struct output_report failed[HID_MAX_WRITES];
+	int num_failed;
+	int i;
+
 	pthread_mutex_lock(&dev->mutex);
-	pthread_cond_broadcast(&dev->condition);
+	dev->shutdown_thread = 1;
+	for (i = 0; i < dev->num_transfers; i++) {
+		if (dev->transfers[i].submitted)
+			libusb_cancel_transfer(dev->transfers[i].transfer);
+	}
+
+	if (dev->write_in_flight)
+		libusb_cancel_transfer(dev->write_transfer);
+
+	/* read_callback() and write_callback() signal the condition once
+	   the last transfer is back. */
+	while (dev->in_flight > 0 || dev->write_in_flight)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+
+	/* Writes still queued are never sent */
+	num_failed = 0;
+	while (dev->write_head != dev->write_tail) {
+		failed[num_failed++] = dev->writes[dev->write_head % HID_MAX_WRITES];
+		dev->write_head++;
+	}
 	pthread_mutex_unlock(&dev->mutex);
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
-	
+	finish_writes(dev, failed, num_failed, -1);
+	if (dev->write_transfer) {
+		libusb_free_transfer(dev->write_transfer);
+		dev->write_transfer = NULL;
+	}
+
+	for (i = 0; i < dev->num_transfers; i++) {
+		if (dev->transfers[i].transfer) {
+			/* Zero-copy buffers belong to the ring slab */
+			if (!dev->zero_copy)
+				free(dev->transfers[i].transfer->buffer);
+			libusb_free_transfer(dev->transfers[i].transfer);
+			dev->transfers[i].transfer = NULL;
+		}
+	}
+}
+
+#ifdef HID_HIDRAW_BACKEND
+/* hidraw backend. The interface stays bound to usbhid and the reports are
+   read from its /dev/hidrawN node by a single epoll thread, which queues
+   them like read_callback() does. Bus, address and interface of a path
+   are matched against the USB attributes found in sysfs. */
+#define HIDRAW_SYSFS "/sys/class/hidraw"
+#define HIDRAW_MAX_EVENTS 16
+
+static pthread_mutex_t hidraw_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hidraw_condition = PTHREAD_COND_INITIALIZER;
+static pthread_t hidraw_thread;
+static int hidraw_refs = 0;
+static int hidraw_quit = 0;
+static int hidraw_stopping = 0; /* the last hidraw_stop() is tearing down */
+static int hidraw_sched = HID_SCHED_REALTIME | HID_SCHED_AFFINITY;
+static int hidraw_epoll_fd = -1;
+static int hidraw_wake_fd = -1;
+static unsigned long hidraw_pass = 0; /* loops of the reader thread */
+
+/* Reads an integer attribute from a sysfs directory. */
+static int sysfs_read_int(const char *dir, const char *attr, int base, int *value)
+{
+	char path[PATH_MAX];
+	char buf[32];
+	FILE *f;
+	int res = -1;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fgets(buf, sizeof(buf), f)) {
+		*value = strtol(buf, NULL, base);
+		res = 0;
+	}
+	fclose(f);
+	return res;
+}
+
+/* Largest IN endpoint packet of a USB interface directory, which bounds
+   the reports, like the transfers of the libusb backend. */
+static int sysfs_input_packet_size(const char *iface_dir)
+{
+	char ep_dir[PATH_MAX];
+	struct dirent *ent;
+	DIR *dir;
+	int size = 0;
+
+	dir = opendir(iface_dir);
+	if (!dir)
+		return 0;
+	while ((ent = readdir(dir)) != NULL) {
+		int address, packet_size;
+		if (strncmp(ent->d_name, "ep_", 3) != 0)
+			continue;
+		address = strtol(ent->d_name + 3, NULL, 16);
+		if (!(address & LIBUSB_ENDPOINT_IN))
+			continue;
+		snprintf(ep_dir, sizeof(ep_dir), "%s/%s", iface_dir, ent->d_name);
+		if (sysfs_read_int(ep_dir, "wMaxPacketSize", 16, &packet_size) == 0 &&
+		    packet_size > size)
+			size = packet_size;
+	}
+	closedir(dir);
+	return size;
+}
+
+/* Finds the hidraw node of the interface behind a path key. Returns -1 if
+   there is none. */
+static int hidraw_find(uint32_t key, char *node, size_t node_size, int *report_size)
+{
+	char link[PATH_MAX];
+	char hid_dir[PATH_MAX];
+	struct dirent *ent;
+	DIR *dir;
+	int res = -1;
+
+	dir = opendir(HIDRAW_SYSFS);
+	if (!dir)
+		return -1;
+
+	while (res < 0 && (ent = readdir(dir)) != NULL) {
+		char *slash;
+		int bus, address, interface_number;
+
+		if (strncmp(ent->d_name, "hidraw", 6) != 0)
+			continue;
+
+		/* .../<usb device>/<usb interface>/<hid device> */
+		snprintf(link, sizeof(link), HIDRAW_SYSFS "/%s/device", ent->d_name);
+		if (!realpath(link, hid_dir))
+			continue;
+		slash = strrchr(hid_dir, '/');
+		if (!slash)
+			continue;
+		*slash = '\0';
+		if (sysfs_read_int(hid_dir, "bInterfaceNumber", 16, &interface_number) < 0)
+			continue;
+		*report_size = sysfs_input_packet_size(hid_dir);
+
+		slash = strrchr(hid_dir, '/');
+		if (!slash)
+			continue;
+		*slash = '\0';
+		if (sysfs_read_int(hid_dir, "busnum", 10, &bus) < 0 ||
+		    sysfs_read_int(hid_dir, "devnum", 10, &address) < 0)
+			continue;
+
+		if (make_key(bus, address, interface_number) == key) {
+			snprintf(node, node_size, "/dev/%s", ent->d_name);
+			res = 0;
+		}
+	}
+	closedir(dir);
+
+	return res;
+}
+
+/* Reads every pending report of a device. Stops reading it on error. */
+static void hidraw_read_device(hid_device *dev)
+{
+	uint8_t buf[HID_HIDRAW_READ_SIZE];
+	ssize_t res;
+
+	for (;;) {
+		uint64_t timestamp;
+
+		res = read(dev->hidraw_fd, buf, sizeof(buf));
+		if (res < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		timestamp = monotonic_ns();
+
+		pthread_mutex_lock(&dev->mutex);
+		if (res > 0) {
+			/* Same bound as the transfers of the libusb backend */
+			if (res > dev->input_ep_max_packet_size)
+				res = dev->input_ep_max_packet_size;
+			queue_report(dev, buf, res, timestamp, NULL);
+		}
+		else {
+			/* Unplugged (ENODEV) or broken */
+			dev->shutdown_thread = 1;
+			pthread_cond_broadcast(&dev->condition);
+			poll_fd_raise(dev);
+			epoll_ctl(hidraw_epoll_fd, EPOLL_CTL_DEL, dev->hidraw_fd, NULL);
+		}
+		pthread_mutex_unlock(&dev->mutex);
+
+		if (res <= 0)
+			break;
+	}
+}
+
+static void *hidraw_thread_main(void *param)
+{
+	struct epoll_event events[HIDRAW_MAX_EVENTS];
+	int i, n;
+
+	pthread_mutex_lock(&hidraw_mutex);
+	while (!hidraw_quit) {
+		/* hidraw_stop() waits for this to know that no event of the
+		   device it removes is being handled anymore. */
+		hidraw_pass++;
+		pthread_cond_broadcast(&hidraw_condition);
+		pthread_mutex_unlock(&hidraw_mutex);
+
+		n = epoll_wait(hidraw_epoll_fd, events, HIDRAW_MAX_EVENTS, -1);
+
+		pthread_mutex_lock(&hidraw_mutex);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) {
+				uint64_t value;
+				if (read(hidraw_wake_fd, &value, sizeof(value)) < 0)
+					LOG("hidraw wake up lost\n");
+				continue;
+			}
+			hidraw_read_device(events[i].data.ptr);
+		}
+	}
+	pthread_mutex_unlock(&hidraw_mutex);
+
 	return NULL;
 }
 
+static void hidraw_stop(hid_device *dev);
+
+static void hidraw_wake(void)
+{
+	uint64_t one = 1;
+	if (write(hidraw_wake_fd, &one, sizeof(one)) < 0)
+		LOG("can't wake the hidraw thread\n");
+}
+
+/* Registers an opened hidraw device with the reader thread, starting it
+   for the first device. */
+static int hidraw_start(hid_device *dev)
+{
+	struct epoll_event ev;
+	int res = 0, counted = 0;
+
+	pthread_mutex_lock(&hidraw_mutex);
+	while (hidraw_stopping)
+		pthread_cond_wait(&hidraw_condition, &hidraw_mutex);
+	if (hidraw_refs == 0) {
+		hidraw_quit = 0;
+		hidraw_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		hidraw_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (hidraw_epoll_fd < 0 || hidraw_wake_fd < 0 ||
+		    epoll_ctl(hidraw_epoll_fd, EPOLL_CTL_ADD, hidraw_wake_fd, &ev) < 0 ||
+		    pthread_create(&hidraw_thread, NULL, hidraw_thread_main, NULL) != 0) {
+			if (hidraw_epoll_fd >= 0)
+				close(hidraw_epoll_fd);
+			if (hidraw_wake_fd >= 0)
+				close(hidraw_wake_fd);
+			hidraw_epoll_fd = hidraw_wake_fd = -1;
+			res = -1;
+		}
+		else
+			hidraw_sched = apply_thread_sched(hidraw_thread);
+	}
+	if (res == 0) {
+		hidraw_refs++;
+		counted = 1;
+		ev.events = EPOLLIN;
+		ev.data.ptr = dev;
+		if (epoll_ctl(hidraw_epoll_fd, EPOLL_CTL_ADD, dev->hidraw_fd, &ev) < 0) {
+			LOG("can't poll %d: %d\n", dev->hidraw_fd, errno);
+			res = -1;
+		}
+	}
+	pthread_mutex_unlock(&hidraw_mutex);
+
+	/* The reference taken is given back, the caller only stops
+	   devices that started. */
+	if (res < 0 && counted)
+		hidraw_stop(dev);
+
+	return res;
+}
+
+/* Unregisters a hidraw device. Once this returns the reader thread doesn't
+   touch it anymore. The last device stops the thread. */
+static void hidraw_stop(hid_device *dev)
+{
+	unsigned long pass;
+	pthread_t thread;
+	int epoll_fd, wake_fd;
+
+	pthread_mutex_lock(&hidraw_mutex);
+	if (hidraw_refs == 0) {
+		pthread_mutex_unlock(&hidraw_mutex);
+		return;
+	}
+
+	epoll_ctl(hidraw_epoll_fd, EPOLL_CTL_DEL, dev->hidraw_fd, NULL);
+
+	if (--hidraw_refs == 0) {
+		/* A hidraw_start() meanwhile waits until this one is gone
+		   instead of starting a thread that would be joined here. */
+		hidraw_stopping = 1;
+		thread = hidraw_thread;
+		epoll_fd = hidraw_epoll_fd;
+		wake_fd = hidraw_wake_fd;
+		hidraw_quit = 1;
+		hidraw_wake();
+		pthread_mutex_unlock(&hidraw_mutex);
+
+		pthread_join(thread, NULL);
+		close(epoll_fd);
+		close(wake_fd);
+
+		pthread_mutex_lock(&hidraw_mutex);
+		hidraw_epoll_fd = hidraw_wake_fd = -1;
+		hidraw_stopping = 0;
+		pthread_cond_broadcast(&hidraw_condition);
+		pthread_mutex_unlock(&hidraw_mutex);
+		return;
+	}
+
+	/* Events returned by an epoll_wait() before the removal may still
+	   point to the device, wait for the next pass. */
+	pass = hidraw_pass;
+	hidraw_wake();
+	while (hidraw_pass == pass)
+		pthread_cond_wait(&hidraw_condition, &hidraw_mutex);
+	pthread_mutex_unlock(&hidraw_mutex);
+}
+
+/* Opens the hidraw node of a path key into dev. */
+static int hidraw_open(hid_device *dev, uint32_t key, unsigned int queue_cap)
+{
+	char node[32];
+	int report_size = 0;
+
+	if (hidraw_find(key, node, sizeof(node), &report_size) < 0) {
+		LOG("no hidraw node for %06x\n", key);
+		return -1;
+	}
+
+	dev->hidraw_fd = open(node, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (dev->hidraw_fd < 0) {
+		LOG("can't open %s: %d\n", node, errno);
+		return -1;
+	}
+
+	if (report_size <= 0 || report_size > HID_HIDRAW_READ_SIZE)
+		report_size = HID_HIDRAW_READ_SIZE;
+	dev->interface = key & 0xff;
+	dev->input_ep_max_packet_size = report_size;
+
+	if (input_ring_init(&dev->input_reports, report_size, queue_cap,
+	                    dev->zero_copy? HID_MAX_HELD_REPORTS: 0) < 0) {
+		LOG("can't allocate the reports of %s\n", node);
+		close(dev->hidraw_fd);
+		dev->hidraw_fd = -1;
+		return -1;
+	}
+
+	/* On failure hidraw_start() holds no reference to give back */
+	if (hidraw_start(dev) < 0) {
+		LOG("can't start reading %s\n", node);
+		input_ring_free(&dev->input_reports);
+		close(dev->hidraw_fd);
+		dev->hidraw_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+#endif /* HID_HIDRAW_BACKEND */
+
+/* Backend used by an open call: the options, or the MRPDI_HID_BACKEND
+   environment variable ("libusb" or "hidraw"), or libusb. */
+static int select_backend(int backend)
+{
+	const char *env;
+
+	if (backend == HID_BACKEND_DEFAULT) {
+		env = getenv("MRPDI_HID_BACKEND");
+		if (env && strcmp(env, "hidraw") == 0)
+			backend = HID_BACKEND_HIDRAW;
+		else
+			backend = HID_BACKEND_LIBUSB;
+	}
+
+#ifndef HID_HIDRAW_BACKEND
+	if (backend == HID_BACKEND_HIDRAW) {
+		LOG("built without hidraw, using libusb\n");
+		backend = HID_BACKEND_LIBUSB;
+	}
+#endif
+
+	return backend;
+}
+
+
+void HID_API_EXPORT hid_init_open_options(struct hid_open_options *options)
+{
+	options->num_transfers = HID_DEFAULT_TRANSFERS;
+	options->queue_policy = HID_QUEUE_FIFO;
+	options->queue_cap = INPUT_QUEUE_DEFAULT_CAP;
+	options->merge_prefix = 1;
+	options->button_offset = -1;
+	options->button_mask = 0;
+	options->backend = HID_BACKEND_DEFAULT;
+	options->zero_copy = 0;
+}
 
 hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	return hid_open_path_ex(path, NULL);
+}
+
+hid_device * HID_API_EXPORT hid_open_path_ex(const char *path, const struct hid_open_options *options)
 {
 	hid_device *dev = NULL;
+	struct hid_open_options opts;
+
+	if (options)
+		opts = *options;
+	else
+		hid_init_open_options(&opts);
 
 	dev = new_hid_device();
 
-	libusb_device **devs;
-	libusb_device *usb_dev;
-	ssize_t num_devs;
+	dev->num_transfers = opts.num_transfers;
+	if (dev->num_transfers < 1)
+		dev->num_transfers = 1;
+	if (dev->num_transfers > HID_MAX_TRANSFERS)
+		dev->num_transfers = HID_MAX_TRANSFERS;
+
+	dev->queue_policy = opts.queue_policy;
+	if (opts.queue_cap < 1)
+		opts.queue_cap = 1;
+	if (opts.queue_cap > HID_MAX_QUEUE)
+		opts.queue_cap = HID_MAX_QUEUE;
+	if (dev->queue_policy == HID_QUEUE_LATEST)
+		opts.queue_cap = 1;
+	dev->merge_prefix = (opts.merge_prefix < 0)? 0: opts.merge_prefix;
+	dev->button_offset = opts.button_offset;
+	dev->button_mask = opts.button_mask;
+	dev->zero_copy = opts.zero_copy;
+
+	struct path_entry entry;
+	struct libusb_device_descriptor desc;
+	uint32_t key;
 	int res;
-	int d = 0;
-	int good_open = 0;
 	
 	setlocale(LC_ALL,"");
 	
 	if (!initialized)
 		hid_init();
 
-	num_devs = libusb_get_device_list(NULL, &devs);
-	while ((usb_dev = devs[d++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int i,j,k;
-		libusb_get_device_descriptor(usb_dev, &desc);
-
-		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
-			continue;
-		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-			const struct libusb_interface *intf = &conf_desc->interface[j];
-			for (k = 0; k < intf->num_altsetting; k++) {
-				const struct libusb_interface_descriptor *intf_desc;
-				intf_desc = &intf->altsetting[k];
-				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-					char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber);
-					if (!strcmp(dev_path, path)) {
-						/* Matched Paths. Open this device */
-
-						// OPEN HERE //
-						res = libusb_open(usb_dev, &dev->device_handle);
-						if (res < 0) {
-							LOG("can't open device\n");
-							free(dev_path);
- 							break;
-						}
-						good_open = 1;
-						
-						/* Detach the kernel driver, but only if the
-						   device is managed by the kernel */
-						if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
-							res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
-							if (res < 0) {
-								libusb_close(dev->device_handle);
-								LOG("Unable to detach Kernel Driver\n");
-								free(dev_path);
-								good_open = 0;
-								break;
-							}
-						}
-						
-						res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
-						if (res < 0) {
-							LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
-							free(dev_path);
-							libusb_close(dev->device_handle);
-							good_open = 0;
-							break;
-						}
+	if (path_key(path, &key) < 0) {
+		LOG("no HID interface at %s\n", path);
+		free_hid_device(dev);
+		return NULL;
+	}
 
-						/* Store off the string descriptor indexes */
-						dev->manufacturer_index = desc.iManufacturer;
-						dev->product_index      = desc.iProduct;
-						dev->serial_index       = desc.iSerialNumber;
-
-						/* Store off the interface number */
-						dev->interface = intf_desc->bInterfaceNumber;
-												
-						/* Find the INPUT and OUTPUT endpoints. An
-						   OUTPUT endpoint is not required. */
-						for (i = 0; i < intf_desc->bNumEndpoints; i++) {
-							const struct libusb_endpoint_descriptor *ep
-								= &intf_desc->endpoint[i];
-
-							/* Determine the type and direction of this
-							   endpoint. */
-							int is_interrupt =
-								(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
-							      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
-							int is_output = 
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_OUT;
-							int is_input = 
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_IN;
-
-							/* Decide whether to use it for intput or output. */
-							if (dev->input_endpoint == 0 &&
-							    is_interrupt && is_input) {
-								/* Use this endpoint for INPUT */
-								dev->input_endpoint = ep->bEndpointAddress;
-								dev->input_ep_max_packet_size = ep->wMaxPacketSize;
-							}
-							if (dev->output_endpoint == 0 &&
-							    is_interrupt && is_output) {
-								/* Use this endpoint for OUTPUT */
-								dev->output_endpoint = ep->bEndpointAddress;
-							}
-						}
-						
-						pthread_create(&dev->thread, NULL, read_thread, dev);
-						
-						// Wait here for the read thread to be initialized.
-						pthread_barrier_wait(&dev->barrier);
-						
-					}
-					free(dev_path);
-				}
-			}
+#ifdef HID_HIDRAW_BACKEND
+	if (select_backend(opts.backend) == HID_BACKEND_HIDRAW) {
+		if (hidraw_open(dev, key, opts.queue_cap) < 0) {
+			free_hid_device(dev);
+			return NULL;
 		}
-		libusb_free_config_descriptor(conf_desc);
+		read_report_layout(dev);
+		dev->key = key;
+		add_open_device(dev);
+		return dev;
+	}
+#else
+	select_backend(opts.backend);
+#endif
 
+	if (path_index_lookup(key, 0, &entry) < 0) {
+		LOG("no HID interface at %s\n", path);
+		free_hid_device(dev);
+		return NULL;
 	}
 
-	libusb_free_device_list(devs, 1);
+	// OPEN HERE //
+	res = libusb_open(entry.device, &dev->device_handle);
+	if (res < 0) {
+		/* The entry may be stale (device replugged and events not
+		   handled yet). Rebuild the index and try once more. */
+		libusb_unref_device(entry.device);
+		if (path_index_lookup(key, 1, &entry) < 0) {
+			LOG("no HID interface at %s\n", path);
+			free_hid_device(dev);
+			return NULL;
+		}
+		res = libusb_open(entry.device, &dev->device_handle);
+	}
+	if (res < 0) {
+		LOG("can't open device\n");
+		libusb_unref_device(entry.device);
+		free_hid_device(dev);
+		return NULL;
+	}
+	libusb_get_device_descriptor(entry.device, &desc);
+	libusb_unref_device(entry.device);
 	
-	// If we have a good handle, return it.
-	if (good_open) {
-		return dev;
+	/* Detach the kernel driver, but only if the
+	   device is managed by the kernel */
+	if (libusb_kernel_driver_active(dev->device_handle, entry.interface) == 1) {
+		res = libusb_detach_kernel_driver(dev->device_handle, entry.interface);
+		if (res < 0) {
+			libusb_close(dev->device_handle);
+			LOG("Unable to detach Kernel Driver\n");
+			free_hid_device(dev);
+			return NULL;
+		}
 	}
-	else {
-		// Unable to open any devices.
+	
+	res = libusb_claim_interface(dev->device_handle, entry.interface);
+	if (res < 0) {
+		LOG("can't claim interface %d: %d\n", entry.interface, res);
+		libusb_close(dev->device_handle);
+		free_hid_device(dev);
+		return NULL;
+	}
+
+	/* Store off the string descriptor indexes */
+	dev->manufacturer_index = desc.iManufacturer;
+	dev->product_index      = desc.iProduct;
+	dev->serial_index       = desc.iSerialNumber;
+
+	/* Store off the interface number and endpoints */
+	dev->interface = entry.interface;
+	dev->input_endpoint = entry.input_endpoint;
+	dev->input_ep_max_packet_size = entry.input_ep_max_packet_size;
+	dev->output_endpoint = entry.output_endpoint;
+
+	/* Compile the input fields before the transfers start, the
+	   descriptor is read on the control endpoint. */
+	read_report_layout(dev);
+
+	/* Preallocate the input report storage and start reading. The
+	   shared event thread takes it from here. */
+	if (input_ring_init(&dev->input_reports, dev->input_ep_max_packet_size, opts.queue_cap,
+	                    dev->zero_copy? HID_MAX_HELD_REPORTS + dev->num_transfers: 0) < 0 ||
+	    start_transfers(dev) < 0) {
+		LOG("can't start reading\n");
+		libusb_release_interface(dev->device_handle, dev->interface);
+		libusb_close(dev->device_handle);
 		free_hid_device(dev);
 		return NULL;
 	}
+
+	dev->key = key;
+	add_open_device(dev);
+
+	return dev;
 }
 
 
@@ -879,6 +2478,15 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	int report_number = data[0];
 	int skipped_report_id = 0;
 
+#ifdef HID_HIDRAW_BACKEND
+	if (dev->hidraw_fd >= 0) {
+		/* hidraw takes the report ID in the first byte, even if
+		   it is 0. */
+		res = write(dev->hidraw_fd, data, length);
+		return (res < 0)? -1: res;
+	}
+#endif
+
 	if (report_number == 0x0) {
 		data++;
 		length--;
@@ -923,19 +2531,169 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	}
 }
 
+/* Fills the output transfer of a device with the oldest queued write.
+   This should be called with dev->mutex locked. */
+static void fill_write_transfer(hid_device *dev, struct output_report *out)
+{
+	struct libusb_transfer *t = dev->write_transfer;
+
+	if (dev->output_endpoint <= 0) {
+		/* No interrupt out endpoint. Use the Control Endpoint */
+		libusb_fill_control_setup(out->buffer,
+			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+			0x09/*HID Set_Report*/,
+			(2/*HID output*/ << 8) | out->report_number,
+			dev->interface,
+			out->length);
+		libusb_fill_control_transfer(t, dev->device_handle, out->buffer,
+			write_callback, dev, 1000/*timeout millis*/);
+	}
+	else {
+		libusb_fill_interrupt_transfer(t, dev->device_handle,
+			dev->output_endpoint,
+			out->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+			out->length,
+			write_callback, dev, 1000/*timeout millis*/);
+	}
+}
+
+/* Submits the queued writes until one is in flight. The ones which can't
+   be submitted are moved to failed, for their callbacks to be called
+   once unlocked.
+   This should be called with dev->mutex locked. */
+static void submit_writes(hid_device *dev, struct output_report *failed, int *num_failed)
+{
+	while (!dev->write_in_flight && dev->write_head != dev->write_tail) {
+		struct output_report *out = &dev->writes[dev->write_head % HID_MAX_WRITES];
+
+		if (!dev->shutdown_thread) {
+			fill_write_transfer(dev, out);
+			if (libusb_submit_transfer(dev->write_transfer) == 0) {
+				dev->write_in_flight = 1;
+				break;
+			}
+		}
+
+		failed[(*num_failed)++] = *out;
+		dev->write_head++;
+	}
+}
+
+/* Calls the callbacks of finished writes and frees them. */
+static void finish_writes(hid_device *dev, struct output_report *done, int num_done, int result)
+{
+	int i;
+
+	for (i = 0; i < num_done; i++) {
+		if (done[i].callback)
+			done[i].callback(dev, (result < 0)? -1: done[i].length + done[i].skipped_report_id, done[i].user_data);
+		free(done[i].buffer);
+	}
+}
+
+static void write_callback(struct libusb_transfer *transfer)
+{
+	hid_device *dev = transfer->user_data;
+	struct output_report done;
+	struct output_report failed[HID_MAX_WRITES];
+	int num_failed = 0;
+	int result;
+
+	pthread_mutex_lock(&dev->mutex);
+
+	done = dev->writes[dev->write_head % HID_MAX_WRITES];
+	dev->write_head++;
+	dev->write_in_flight = 0;
+	result = (transfer->status == LIBUSB_TRANSFER_COMPLETED)? 0: -1;
+
+	/* One write at a time, in order */
+	submit_writes(dev, failed, &num_failed);
+
+	/* hid_close() waits for the last write to be back. */
+	if (dev->shutdown_thread && !dev->write_in_flight)
+		pthread_cond_broadcast(&dev->condition);
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	finish_writes(dev, &done, 1, result);
+	finish_writes(dev, failed, num_failed, -1);
+}
+
+int HID_API_EXPORT hid_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data)
+{
+	struct output_report *out;
+	struct output_report failed[HID_MAX_WRITES];
+	int num_failed = 0;
+	int skipped_report_id = 0;
+	int report_number = data[0];
+
+#ifdef HID_HIDRAW_BACKEND
+	if (dev->hidraw_fd >= 0) {
+		/* usbhid queues the output reports itself */
+		int res = hid_write(dev, data, length);
+		if (callback)
+			callback(dev, res, user_data);
+		return (res < 0)? -1: 0;
+	}
+#endif
+
+	if (report_number == 0x0) {
+		data++;
+		length--;
+		skipped_report_id = 1;
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+
+	if (dev->shutdown_thread ||
+	    dev->write_tail - dev->write_head >= HID_MAX_WRITES) {
+		pthread_mutex_unlock(&dev->mutex);
+		return -1;
+	}
+
+	if (!dev->write_transfer)
+		dev->write_transfer = libusb_alloc_transfer(0);
+
+	/* Room for the control setup packet in front, in case there is no
+	   interrupt out endpoint. */
+	out = &dev->writes[dev->write_tail % HID_MAX_WRITES];
+	out->buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + length);
+	if (!dev->write_transfer || !out->buffer) {
+		free(out->buffer);
+		pthread_mutex_unlock(&dev->mutex);
+		return -1;
+	}
+	memcpy(out->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+	out->length = length;
+	out->report_number = report_number;
+	out->skipped_report_id = skipped_report_id;
+	out->callback = callback;
+	out->user_data = user_data;
+	dev->write_tail++;
+
+	submit_writes(dev, failed, &num_failed);
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	finish_writes(dev, failed, num_failed, -1);
+
+	return 0;
+}
+
 /* Helper function, to simplify hid_read().
    This should be called with dev->mutex locked. */
-static int return_data(hid_device *dev, unsigned char *data, size_t length)
+static int return_data(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
+	/* Copy the data out of the oldest ring slot (rpt) into the
+	   return buffer (data), and release the slot. */
+	struct input_report *rpt = input_ring_front(&dev->input_reports);
 	size_t len = (length < rpt->len)? length: rpt->len;
 	if (len > 0)
 		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
+	if (timestamp)
+		*timestamp = rpt->timestamp;
+	input_ring_pop(&dev->input_reports);
+	poll_fd_lower(dev);
 	return len;
 }
 
@@ -946,42 +2704,26 @@ static void cleanup_mutex(void *param)
 }
 
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+/* Waits until an input report is queued. Returns 1 when there is one,
+   0 on timeout and -1 on error or disconnection.
+   This should be called with dev->mutex locked. */
+static int wait_for_data(hid_device *dev, int milliseconds)
 {
-	int bytes_read = -1;
-
-#if 0
-	int transferred;
-	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
-	LOG("transferred: %d\n", transferred);
-	return transferred;
-#endif
-
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cleanup_push(&cleanup_mutex, dev);
-
-	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
-	}
+	/* There's an input report queued up. */
+	if (input_ring_count(&dev->input_reports))
+		return 1;
 	
 	if (dev->shutdown_thread) {
 		/* This means the device has been disconnected.
 		   An error code of -1 should be returned. */
-		bytes_read = -1;
-		goto ret;
+		return -1;
 	}
 	
 	if (milliseconds == -1) {
 		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!input_ring_count(&dev->input_reports) && !dev->shutdown_thread) {
 			pthread_cond_wait(&dev->condition, &dev->mutex);
 		}
-		if (dev->input_reports) {
-			bytes_read = return_data(dev, data, length);
-		}
 	}
 	else if (milliseconds > 0) {
 		/* Non-blocking, but called with timeout. */
@@ -995,42 +2737,147 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			ts.tv_nsec -= 1000000000L;
 		}
 		
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!input_ring_count(&dev->input_reports) && !dev->shutdown_thread) {
 			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
-			if (res == 0) {
-				if (dev->input_reports) {
-					bytes_read = return_data(dev, data, length);
-					break;
-				}
-				
-				/* If we're here, there was a spurious wake up
-				   or the read thread was shutdown. Run the
-				   loop again (ie: don't break). */
-			}
-			else if (res == ETIMEDOUT) {
+			/* On res == 0 there was data, a spurious wake up or
+			   the reading was stopped. Run the loop again. */
+			if (res == ETIMEDOUT) {
 				/* Timed out. */
-				bytes_read = 0;
-				break;
+				return 0;
 			}
-			else {
+			else if (res != 0) {
 				/* Error. */
-				bytes_read = -1;
-				break;
+				return -1;
 			}
 		}
 	}
 	else {
 		/* Purely non-blocking */
-		bytes_read = 0;
+		return 0;
+	}
+
+	return input_ring_count(&dev->input_reports) ? 1 : -1;
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	return hid_read_timed(dev, data, length, milliseconds, NULL);
+}
+
+int HID_API_EXPORT hid_read_timed(hid_device *dev, unsigned char *data, size_t length, int milliseconds, unsigned long long *timestamp)
+{
+	int bytes_read = -1;
+	uint64_t ts;
+
+#if 0
+	int transferred;
+	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
+	LOG("transferred: %d\n", transferred);
+	return transferred;
+#endif
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	bytes_read = wait_for_data(dev, milliseconds);
+	if (bytes_read > 0) {
+		/* Return the first one */
+		bytes_read = return_data(dev, data, length, &ts);
+		if (timestamp)
+			*timestamp = ts;
 	}
 
-ret:
 	pthread_mutex_unlock(&dev->mutex);
 	pthread_cleanup_pop(0);
 
 	return bytes_read;
 }
 
+int HID_API_EXPORT hid_read_many(hid_device *dev, struct hid_report_buf *reports, size_t count, int milliseconds)
+{
+	int num_read = -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	num_read = wait_for_data(dev, milliseconds);
+	if (num_read > 0) {
+		/* Drain the queue under this single lock. */
+		num_read = 0;
+		while (num_read < count && input_ring_count(&dev->input_reports)) {
+			uint64_t ts;
+			reports[num_read].len = return_data(dev, reports[num_read].data, reports[num_read].size, &ts);
+			reports[num_read].timestamp = ts;
+			num_read++;
+		}
+	}
+
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	return num_read;
+}
+
+int HID_API_EXPORT hid_read_zc(hid_device *dev, struct hid_report_buf *reports, size_t count, int milliseconds)
+{
+	struct input_ring *ring = &dev->input_reports;
+	int num_read = -1;
+
+	if (!dev->zero_copy)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	num_read = wait_for_data(dev, milliseconds);
+	if (num_read > 0) {
+		/* Hand the slot buffers out and give the slots spare ones
+		   in exchange. */
+		num_read = 0;
+		while (num_read < count && input_ring_count(ring) && ring->num_spare > 0) {
+			struct input_report *rpt = input_ring_front(ring);
+			reports[num_read].data = rpt->data;
+			reports[num_read].size = ring->slot_size;
+			reports[num_read].len = rpt->len;
+			reports[num_read].timestamp = rpt->timestamp;
+			rpt->data = ring->spare[--ring->num_spare];
+			input_ring_pop(ring);
+			num_read++;
+		}
+		poll_fd_lower(dev);
+
+		/* Every spare buffer is held by the caller, the reports
+		   stay queued until some are released. */
+	}
+
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	return num_read;
+}
+
+void HID_API_EXPORT hid_release_reports(hid_device *dev, struct hid_report_buf *reports, size_t count)
+{
+	struct input_ring *ring = &dev->input_reports;
+	size_t i;
+
+	pthread_mutex_lock(&dev->mutex);
+	for (i = 0; i < count; i++) {
+		if (!reports[i].data)
+			continue;
+		/* More than were handed out, released twice or not ours */
+		if (ring->num_spare >= ring->max_spare ||
+		    reports[i].data < ring->slab ||
+		    reports[i].data >= ring->slab + (ring->mask + 1 + ring->max_spare) * ring->slot_size) {
+			LOG("unknown report buffer released\n");
+			continue;
+		}
+		ring->spare[ring->num_spare++] = reports[i].data;
+		reports[i].data = NULL;
+	}
+	pthread_mutex_unlock(&dev->mutex);
+}
+
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 {
 	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
@@ -1050,6 +2897,13 @@ int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char
 	int skipped_report_id = 0;
 	int report_number = data[0];
 
+#ifdef HID_HIDRAW_BACKEND
+	if (dev->hidraw_fd >= 0) {
+		res = ioctl(dev->hidraw_fd, HIDIOCSFEATURE(length), data);
+		return (res < 0)? -1: res;
+	}
+#endif
+
 	if (report_number == 0x0) {
 		data++;
 		length--;
@@ -1080,6 +2934,14 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 	int skipped_report_id = 0;
 	int report_number = data[0];
 
+#ifdef HID_HIDRAW_BACKEND
+	if (dev->hidraw_fd >= 0) {
+		/* The report ID stays in byte 0 and is counted. */
+		res = ioctl(dev->hidraw_fd, HIDIOCGFEATURE(length), data);
+		return (res < 0)? -1: res;
+	}
+#endif
+
 	if (report_number == 0x0) {
 		/* Offset the return buffer by 1, so that the report ID
 		   will remain in byte 0. */
@@ -1109,17 +2971,25 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 {
 	if (!dev)
 		return;
-	
-	/* Cause read_thread() to stop. */
-	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+	/* No more hotplug notifications for this device. */
+	remove_open_device(dev);
+
+#ifdef HID_HIDRAW_BACKEND
+	if (dev->hidraw_fd >= 0) {
+		/* Stop reading, the interface was never claimed. */
+		hidraw_stop(dev);
+		close(dev->hidraw_fd);
+		free_hid_device(dev);
+		return;
+	}
+#endif
 	
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+	/* Stop reading and clean up the Transfer objects. */
+	stop_transfers(dev);
+
+	/* The event thread is no longer needed by this device. */
+	event_thread_release();
 	
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1127,13 +2997,7 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 	
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
-	
+	/* The queue of received reports is released with the device. */
 	free_hid_device(dev);
 }
 
@@ -1157,6 +3021,10 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 {
 	wchar_t *str;
 
+	/* hidraw devices have no libusb handle to read strings with */
+	if (!dev->device_handle)
+		return -1;
+
 	str = get_usb_string(dev->device_handle, string_index);
 	if (str) {
 		wcsncpy(string, str, maxlen);
@@ -1169,6 +3037,107 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 }
 
 
+int HID_API_EXPORT_CALL hid_get_poll_fd(hid_device *dev)
+{
+	return dev->poll_fd;
+}
+
+int HID_API_EXPORT_CALL hid_get_report_layout(hid_device *dev, struct hid_report_layout *layout)
+{
+	if (dev->layout.num_fields == 0)
+		return -1;
+
+	*layout = dev->layout;
+	return 0;
+}
+
+const struct hid_field HID_API_EXPORT_CALL * hid_layout_find(const struct hid_report_layout *layout, int report_id, unsigned short usage_page, unsigned short usage)
+{
+	int i;
+
+	for (i = 0; i < layout->num_fields; i++) {
+		const struct hid_field *field = &layout->fields[i];
+		if (field->usage_page == usage_page && field->usage == usage &&
+		    (report_id < 0 || field->report_id == report_id))
+			return field;
+	}
+
+	return NULL;
+}
+
+int HID_API_EXPORT_CALL hid_field_value(const struct hid_field *field, const unsigned char *report, size_t length, int *value)
+{
+	uint64_t raw = 0;
+	int i;
+
+	if (field->byte_offset + field->byte_count > length)
+		return -1;
+	if (field->report_id != 0 && report[0] != field->report_id)
+		return -1;
+
+	/* Little endian, at most 5 bytes for a 32 bit field */
+	for (i = field->byte_count - 1; i >= 0; i--)
+		raw = (raw << 8) | report[field->byte_offset + i];
+	raw = (raw >> field->shift) & field->mask;
+
+	if (field->is_signed && field->bit_size < 32 && (raw & (1u << (field->bit_size - 1))))
+		raw |= ~(uint64_t)field->mask;
+
+	*value = (int)(int32_t)raw;
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_stats(hid_device *dev, struct hid_device_stats *stats)
+{
+	pthread_mutex_lock(&dev->mutex);
+	*stats = dev->stats;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+void HID_API_EXPORT_CALL hid_set_thread_sched(int policy, int priority, unsigned int cpus)
+{
+	pthread_mutex_lock(&sched_mutex);
+	sched_policy = policy;
+	sched_priority = priority;
+	sched_cpus = cpus;
+	pthread_mutex_unlock(&sched_mutex);
+
+	/* Threads not running get them when they start */
+	pthread_mutex_lock(&event_thread_mutex);
+	if (event_thread_refs > 0)
+		event_thread_sched = apply_thread_sched(event_thread);
+	pthread_mutex_unlock(&event_thread_mutex);
+
+#ifdef HID_HIDRAW_BACKEND
+	pthread_mutex_lock(&hidraw_mutex);
+	if (hidraw_refs > 0)
+		hidraw_sched = apply_thread_sched(hidraw_thread);
+	pthread_mutex_unlock(&hidraw_mutex);
+#endif
+}
+
+int HID_API_EXPORT_CALL hid_get_thread_sched(void)
+{
+	int status = HID_SCHED_REALTIME | HID_SCHED_AFFINITY;
+
+	pthread_mutex_lock(&event_thread_mutex);
+	if (event_thread_refs > 0)
+		status &= event_thread_sched;
+	pthread_mutex_unlock(&event_thread_mutex);
+
+#ifdef HID_HIDRAW_BACKEND
+	pthread_mutex_lock(&hidraw_mutex);
+	if (hidraw_refs > 0)
+		status &= hidraw_sched;
+	pthread_mutex_unlock(&hidraw_mutex);
+#endif
+
+	return status;
+}
+
+
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
 	return NULL;
@@ -0,0 +1,245 @@
+
+
+#include "params.h"
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+
+using namespace std;
+
+//seeds tried before giving up on a perfect hash
+#define PARAM_MAX_SEEDS 65536
+
+//no perfect hash found, lookups scan the table
+#define SEED_NONE 0xffffffff
+
+
+/**
+ * FNV-1a of the first len chars of name
+ */
+static unsigned int hash_name(const char * name,int len,unsigned int seed)
+{
+	unsigned int h=2166136261U ^ seed;
+	
+	for(int n=0;n<len;n++)
+	{
+		h^=(unsigned char)name[n];
+		h*=16777619U;
+	}
+	h^=h>>15;
+	
+	return h & (PARAM_SLOTS-1);
+}
+
+/**
+ * Index of the parameter named by the first len chars of name, or -1
+ */
+static int find_key(param_store * store,const char * name,int len)
+{
+	int n;
+	
+	if(store->seed==SEED_NONE)
+	{
+		for(n=0;n<store->count;n++)
+		{
+			if(strncmp(store->keys[n].name,name,len)==0 && store->keys[n].name[len]==0)
+				return n;
+		}
+		return -1;
+	}
+	
+	n=store->slots[hash_name(name,len,store->seed)];
+	if(n<0 || strncmp(store->keys[n].name,name,len)!=0 || store->keys[n].name[len]!=0)
+		return -1;
+	
+	return n;
+}
+
+/**
+ * Splits "name@address". Returns the parameter index or -1, address is set
+ * to 0 when missing
+ */
+static int parse_key(param_store * store,const char * key,unsigned int * address,bool * has_address)
+{
+	const char * at=strchr(key,'@');
+	char * end;
+	
+	*address=0;
+	*has_address=(at!=NULL);
+	
+	if(at==NULL)
+		return find_key(store,key,strlen(key));
+	
+	*address=strtoul(at+1,&end,0);
+	if(end==at+1 || *end!=0)
+		return -1;
+	
+	return find_key(store,key,at-key);
+}
+
+/**
+ * Sets the defaults and builds the hash. Returns 0 on success
+ */
+int params_init(param_store * store,const param_key * keys,int count)
+{
+	bool collision=true;
+	
+	if(count>PARAM_MAX)
+	{
+		cerr<<"[params] too many parameters"<<endl;
+		return -1;
+	}
+	
+	store->keys=keys;
+	store->count=count;
+	store->num_overrides=0;
+	store->generation=0;
+	pthread_mutex_init(&store->mutex,NULL);
+	
+	for(int n=0;n<count;n++)
+		*keys[n].value=keys[n].def;
+	
+	//look for a seed without collisions, small tables find one quickly
+	for(store->seed=0;store->seed<PARAM_MAX_SEEDS && collision;store->seed++)
+	{
+		collision=false;
+		memset(store->slots,-1,sizeof(store->slots));
+		
+		for(int n=0;n<count && !collision;n++)
+		{
+			unsigned int slot=hash_name(keys[n].name,strlen(keys[n].name),store->seed);
+			
+			if(store->slots[slot]>=0)
+				collision=true;
+			else
+				store->slots[slot]=n;
+		}
+	}
+	
+	if(collision)
+	{
+		cerr<<"[params] no perfect hash, falling back to scanning"<<endl;
+		store->seed=SEED_NONE;
+	}
+	else
+	{
+		store->seed--;
+	}
+	
+	return 0;
+}
+
+/**
+ * Sets a parameter, for every device or for "name@address" only.
+ * Returns 0, or -1 for unknown keys or too many overrides
+ */
+int params_set(param_store * store,const char * key,unsigned int value)
+{
+	unsigned int address;
+	bool has_address;
+	int n;
+	int res=0;
+	
+	n=parse_key(store,key,&address,&has_address);
+	if(n<0)
+		return -1;
+	
+	if(!has_address)
+	{
+		__atomic_store_n(store->keys[n].value,value,__ATOMIC_RELEASE);
+	}
+	else
+	{
+		int i;
+		
+		pthread_mutex_lock(&store->mutex);
+		for(i=0;i<store->num_overrides;i++)
+		{
+			if(store->overrides[i].address==address && store->overrides[i].key==n)
+				break;
+		}
+		
+		if(i<PARAM_OVERRIDES)
+		{
+			store->overrides[i].address=address;
+			store->overrides[i].key=n;
+			store->overrides[i].value=value;
+			if(i==store->num_overrides)
+				store->num_overrides++;
+		}
+		else
+		{
+			res=-1;
+		}
+		pthread_mutex_unlock(&store->mutex);
+	}
+	
+	//snapshots are stale now
+	__atomic_add_fetch(&store->generation,1,__ATOMIC_RELEASE);
+	
+	return res;
+}
+
+/**
+ * Gets a parameter, "name@address" gives the value seen by that device.
+ * Returns 0, or -1 for unknown keys
+ */
+int params_get(param_store * store,const char * key,unsigned int * value)
+{
+	unsigned int address;
+	bool has_address;
+	int n;
+	
+	n=parse_key(store,key,&address,&has_address);
+	if(n<0)
+		return -1;
+	
+	*value=__atomic_load_n(store->keys[n].value,__ATOMIC_ACQUIRE);
+	
+	if(has_address)
+	{
+		pthread_mutex_lock(&store->mutex);
+		for(int i=0;i<store->num_overrides;i++)
+		{
+			if(store->overrides[i].address==address && store->overrides[i].key==n)
+				*value=store->overrides[i].value;
+		}
+		pthread_mutex_unlock(&store->mutex);
+	}
+	
+	return 0;
+}
+
+/**
+ * Fills snapshot with the values seen by the device at address
+ */
+void params_snapshot(param_store * store,unsigned int address,param_snapshot * snapshot)
+{
+	//taken first, a change while copying just triggers another refresh
+	snapshot->generation=__atomic_load_n(&store->generation,__ATOMIC_ACQUIRE);
+	
+	for(int n=0;n<store->count;n++)
+		snapshot->values[n]=__atomic_load_n(store->keys[n].value,__ATOMIC_ACQUIRE);
+	
+	pthread_mutex_lock(&store->mutex);
+	for(int i=0;i<store->num_overrides;i++)
+	{
+		if(store->overrides[i].address==address)
+			snapshot->values[store->overrides[i].key]=store->overrides[i].value;
+	}
+	pthread_mutex_unlock(&store->mutex);
+}
+
+/**
+ * Takes a new snapshot only if some parameter changed since the last one.
+ * Returns true when it did
+ */
+bool params_refresh(param_store * store,unsigned int address,param_snapshot * snapshot)
+{
+	if(__atomic_load_n(&store->generation,__ATOMIC_ACQUIRE)==snapshot->generation)
+		return false;
+	
+	params_snapshot(store,address,snapshot);
+	
+	return true;
+}
@@ -0,0 +1,592 @@
+
+
+#include "reactor.h"
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+//events handled per epoll_wait
+#define REACTOR_MAX_EVENTS 32
+
+
+struct reactor_source
+{
+	int fd;
+	reactor_callback callback;
+	reactor_task timer_callback;
+	void * data;
+	bool removed;
+};
+
+struct reactor_job
+{
+	reactor_task task;
+	void * data;
+	bool sync;
+	bool done;
+};
+
+
+static pthread_mutex_t reactor_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reactor_cond=PTHREAD_COND_INITIALIZER;
+static pthread_t reactor_thread;
+static int reactor_refs=0;
+static bool reactor_quit=false;
+static bool reactor_stopping=false;
+static int reactor_epoll_fd=-1;
+static int reactor_wake_fd=-1;
+
+//loops of the reactor thread, see reactor_remove_fd()
+static unsigned long reactor_pass=0;
+
+//scheduling options, applied whenever the thread starts
+static unsigned int reactor_policy=REACTOR_SCHED_OTHER;
+static unsigned int reactor_priority=0;
+static unsigned int reactor_cpus=0;
+static bool reactor_mlock=false;
+static unsigned int reactor_status=0;
+
+static vector<reactor_source *> reactor_sources;
+static vector<reactor_source *> reactor_dead;
+static vector<reactor_job *> reactor_jobs;
+
+
+/**
+ * Wakes the reactor thread up from epoll_wait
+ */
+static void reactor_wake()
+{
+	uint64_t one=1;
+
+	if(write(reactor_wake_fd,&one,sizeof(one))<0)
+		cerr<<"[reactor] wake up lost"<<endl;
+}
+
+/**
+ * Runs the posted tasks, in order
+ */
+static void reactor_run_jobs()
+{
+	vector<reactor_job *> tmp;
+
+	pthread_mutex_lock(&reactor_mutex);
+	tmp.swap(reactor_jobs);
+	pthread_mutex_unlock(&reactor_mutex);
+
+	for(int n=0;n<tmp.size();n++)
+	{
+		reactor_job * job = tmp[n];
+
+		job->task(job->data);
+
+		if(job->sync)
+		{
+			pthread_mutex_lock(&reactor_mutex);
+			job->done=true;
+			pthread_cond_broadcast(&reactor_cond);
+			pthread_mutex_unlock(&reactor_mutex);
+		}
+		else
+		{
+			delete job;
+		}
+	}
+}
+
+/**
+ * Frees the sources removed during the last pass.
+ * Called with reactor_mutex locked
+ */
+static void reactor_free_dead()
+{
+	for(int n=0;n<reactor_dead.size();n++)
+		delete reactor_dead[n];
+	reactor_dead.clear();
+}
+
+/**
+ * Reactor thread
+ */
+static void * reactor_main(void * param)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	int n;
+
+	pthread_mutex_lock(&reactor_mutex);
+	while(!reactor_quit)
+	{
+		//nothing from the last epoll_wait points to them anymore
+		reactor_free_dead();
+		reactor_pass++;
+		pthread_cond_broadcast(&reactor_cond);
+		pthread_mutex_unlock(&reactor_mutex);
+
+		n=epoll_wait(reactor_epoll_fd,events,REACTOR_MAX_EVENTS,-1);
+
+		for(int i=0;i<n;i++)
+		{
+			reactor_source * src = (reactor_source *)events[i].data.ptr;
+			bool removed;
+
+			if(src==NULL)
+			{
+				uint64_t value;
+				if(read(reactor_wake_fd,&value,sizeof(value))<0)
+					cerr<<"[reactor] failed to read wake up"<<endl;
+				continue;
+			}
+
+			//a previous callback may have removed it
+			pthread_mutex_lock(&reactor_mutex);
+			removed=src->removed;
+			pthread_mutex_unlock(&reactor_mutex);
+			if(removed)
+				continue;
+
+			if(src->timer_callback!=NULL)
+			{
+				uint64_t expirations;
+				if(read(src->fd,&expirations,sizeof(expirations))>0)
+					src->timer_callback(src->data);
+			}
+			else
+			{
+				src->callback(src->fd,events[i].events,src->data);
+			}
+		}
+
+		reactor_run_jobs();
+
+		pthread_mutex_lock(&reactor_mutex);
+	}
+	reactor_free_dead();
+	pthread_mutex_unlock(&reactor_mutex);
+
+	//late posts, don't leak them
+	reactor_run_jobs();
+
+	return NULL;
+}
+
+/**
+ * Applies the scheduling options to the running thread. Every option
+ * that can't be applied, mostly for lack of privileges, is left at its
+ * default and reported. Called with reactor_mutex locked
+ */
+static void reactor_apply_sched()
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	int policy;
+	int res;
+
+	//SCHED_FIFO or SCHED_RR, priority clamped to what the policy takes
+	policy=reactor_sched_policy(reactor_policy);
+	param.sched_priority=0;
+	if(policy!=SCHED_OTHER)
+	{
+		param.sched_priority=reactor_priority;
+		if(param.sched_priority<sched_get_priority_min(policy))
+			param.sched_priority=sched_get_priority_min(policy);
+		if(param.sched_priority>sched_get_priority_max(policy))
+			param.sched_priority=sched_get_priority_max(policy);
+	}
+
+	res=pthread_setschedparam(reactor_thread,policy,&param);
+	if(res==0 && policy!=SCHED_OTHER)
+	{
+		reactor_status|=REACTOR_STATUS_REALTIME;
+	}
+	else
+	{
+		reactor_status&=~REACTOR_STATUS_REALTIME;
+		if(res!=0)
+			cerr<<"[reactor] real time scheduling not available: "<<strerror(res)<<endl;
+	}
+
+	//cpus is a mask of cores, 0 lets it run anywhere
+	CPU_ZERO(&cpus);
+	for(int n=0;n<32;n++)
+	{
+		if(reactor_cpus==0 || (reactor_cpus & (1u<<n)))
+			CPU_SET(n,&cpus);
+	}
+
+	res=pthread_setaffinity_np(reactor_thread,sizeof(cpu_set_t),&cpus);
+	if(res==0 && reactor_cpus!=0)
+	{
+		reactor_status|=REACTOR_STATUS_AFFINITY;
+	}
+	else
+	{
+		reactor_status&=~REACTOR_STATUS_AFFINITY;
+		if(res!=0)
+			cerr<<"[reactor] cpu affinity not available: "<<strerror(res)<<endl;
+	}
+
+	//the whole process gets locked in memory, page faults stall the input
+	//as much as preemption
+	if(reactor_mlock && !(reactor_status & REACTOR_STATUS_MLOCK))
+	{
+		if(mlockall(MCL_CURRENT | MCL_FUTURE)==0)
+			reactor_status|=REACTOR_STATUS_MLOCK;
+		else
+			cerr<<"[reactor] memory locking not available: "<<strerror(errno)<<endl;
+	}
+
+	if(!reactor_mlock && (reactor_status & REACTOR_STATUS_MLOCK))
+	{
+		munlockall();
+		reactor_status&=~REACTOR_STATUS_MLOCK;
+	}
+}
+
+/**
+ * Takes a reference to the reactor, starting it on first use
+ * Returns 0 on success
+ */
+int reactor_acquire()
+{
+	int res=0;
+
+	pthread_mutex_lock(&reactor_mutex);
+
+	//the last release may still be tearing the previous thread down
+	while(reactor_stopping)
+		pthread_cond_wait(&reactor_cond,&reactor_mutex);
+
+	if(reactor_refs==0)
+	{
+		struct epoll_event ev;
+
+		reactor_quit=false;
+		reactor_epoll_fd=epoll_create1(EPOLL_CLOEXEC);
+		reactor_wake_fd=eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+		ev.events=EPOLLIN;
+		ev.data.ptr=NULL;
+
+		if(reactor_epoll_fd<0 || reactor_wake_fd<0 ||
+			epoll_ctl(reactor_epoll_fd,EPOLL_CTL_ADD,reactor_wake_fd,&ev)<0 ||
+			pthread_create(&reactor_thread,NULL,reactor_main,NULL)!=0)
+		{
+			cerr<<"[reactor] Failed to start"<<endl;
+			if(reactor_epoll_fd>=0)
+				close(reactor_epoll_fd);
+			if(reactor_wake_fd>=0)
+				close(reactor_wake_fd);
+			reactor_epoll_fd=-1;
+			reactor_wake_fd=-1;
+			res=-1;
+		}
+		else
+		{
+			reactor_apply_sched();
+		}
+	}
+	if(res==0)
+		reactor_refs++;
+	pthread_mutex_unlock(&reactor_mutex);
+
+	return res;
+}
+
+/**
+ * Drops a reference to the reactor, the last one stops it.
+ * Must not be called from the reactor thread
+ */
+void reactor_release()
+{
+	pthread_t thread;
+	int epoll_fd;
+	int wake_fd;
+
+	pthread_mutex_lock(&reactor_mutex);
+	if(reactor_refs==0 || --reactor_refs>0)
+	{
+		pthread_mutex_unlock(&reactor_mutex);
+		return;
+	}
+
+	//a reactor_acquire() meanwhile waits for this one to be gone
+	reactor_stopping=true;
+	thread=reactor_thread;
+	epoll_fd=reactor_epoll_fd;
+	wake_fd=reactor_wake_fd;
+
+	reactor_quit=true;
+	reactor_wake();
+	pthread_mutex_unlock(&reactor_mutex);
+
+	pthread_join(thread,NULL);
+
+	pthread_mutex_lock(&reactor_mutex);
+	for(int n=0;n<reactor_sources.size();n++)
+		delete reactor_sources[n];
+	reactor_sources.clear();
+	close(epoll_fd);
+	close(wake_fd);
+	reactor_epoll_fd=-1;
+	reactor_wake_fd=-1;
+
+	//scheduling and affinity went away with the thread
+	reactor_status&=REACTOR_STATUS_MLOCK;
+
+	reactor_stopping=false;
+	pthread_cond_broadcast(&reactor_cond);
+	pthread_mutex_unlock(&reactor_mutex);
+}
+
+/**
+ * Registers a source. Called with reactor_mutex locked
+ */
+static int reactor_add_source(reactor_source * src,unsigned int events)
+{
+	struct epoll_event ev;
+
+	ev.events=events;
+	ev.data.ptr=src;
+	if(epoll_ctl(reactor_epoll_fd,EPOLL_CTL_ADD,src->fd,&ev)<0)
+	{
+		delete src;
+		return -1;
+	}
+	reactor_sources.push_back(src);
+
+	return 0;
+}
+
+/**
+ * Calls callback from the reactor thread whenever fd has any of the
+ * epoll events. Returns 0 on success
+ */
+int reactor_add_fd(int fd,unsigned int events,reactor_callback callback,void * data)
+{
+	reactor_source * src;
+	int res;
+
+	src = new reactor_source;
+	src->fd=fd;
+	src->callback=callback;
+	src->timer_callback=NULL;
+	src->data=data;
+	src->removed=false;
+
+	pthread_mutex_lock(&reactor_mutex);
+	res=reactor_add_source(src,events);
+	pthread_mutex_unlock(&reactor_mutex);
+
+	return res;
+}
+
+/**
+ * Unregisters fd. Once this returns its callback isn't running and won't
+ * be called again, unless this is called from a callback
+ */
+void reactor_remove_fd(int fd)
+{
+	unsigned long pass;
+	bool found=false;
+
+	pthread_mutex_lock(&reactor_mutex);
+	for(int n=0;n<reactor_sources.size();n++)
+	{
+		if(reactor_sources[n]->fd==fd)
+		{
+			reactor_source * src = reactor_sources[n];
+
+			epoll_ctl(reactor_epoll_fd,EPOLL_CTL_DEL,fd,NULL);
+			src->removed=true;
+			reactor_dead.push_back(src);
+			reactor_sources.erase(reactor_sources.begin()+n);
+			found=true;
+			break;
+		}
+	}
+
+	//events already returned by epoll_wait may still point to it, wait
+	//for the pass to end
+	if(found && !reactor_in_loop())
+	{
+		pass=reactor_pass;
+		reactor_wake();
+		while(pass==reactor_pass)
+			pthread_cond_wait(&reactor_cond,&reactor_mutex);
+	}
+	pthread_mutex_unlock(&reactor_mutex);
+}
+
+/**
+ * Calls callback from the reactor thread after first_ms, and then every
+ * period_ms if not 0. Returns the timer or -1 on error
+ */
+int reactor_add_timer(unsigned int first_ms,unsigned int period_ms,reactor_task callback,void * data)
+{
+	reactor_source * src;
+	int fd;
+
+	fd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd<0)
+		return -1;
+
+	src = new reactor_source;
+	src->fd=fd;
+	src->callback=NULL;
+	src->timer_callback=callback;
+	src->data=data;
+	src->removed=false;
+
+	pthread_mutex_lock(&reactor_mutex);
+	if(reactor_set_timer(fd,first_ms,period_ms)<0 || reactor_add_source(src,EPOLLIN)<0)
+	{
+		pthread_mutex_unlock(&reactor_mutex);
+		close(fd);
+		return -1;
+	}
+	pthread_mutex_unlock(&reactor_mutex);
+
+	return fd;
+}
+
+/**
+ * Arms a timer again, expirations not handled yet are dropped.
+ * Returns 0 on success
+ */
+int reactor_set_timer(int timer,unsigned int first_ms,unsigned int period_ms)
+{
+	struct itimerspec its;
+
+	//a zero value would disarm it
+	its.it_value.tv_sec=first_ms/1000;
+	its.it_value.tv_nsec=(first_ms%1000)*1000000 + ((first_ms==0) ? 1 : 0);
+	its.it_interval.tv_sec=period_ms/1000;
+	its.it_interval.tv_nsec=(period_ms%1000)*1000000;
+
+	return (timerfd_settime(timer,0,&its,NULL)<0) ? -1 : 0;
+}
+
+/**
+ * Stops a timer, same guarantees as reactor_remove_fd()
+ */
+void reactor_remove_timer(int timer)
+{
+	if(timer<0)
+		return;
+
+	reactor_remove_fd(timer);
+	close(timer);
+}
+
+/**
+ * Queues task to be run by the reactor thread. Returns 0 on success
+ */
+int reactor_post(reactor_task task,void * data)
+{
+	reactor_job * job;
+
+	job = new reactor_job;
+	job->task=task;
+	job->data=data;
+	job->sync=false;
+	job->done=false;
+
+	pthread_mutex_lock(&reactor_mutex);
+	if(reactor_refs==0)
+	{
+		pthread_mutex_unlock(&reactor_mutex);
+		delete job;
+		return -1;
+	}
+	reactor_jobs.push_back(job);
+	reactor_wake();
+	pthread_mutex_unlock(&reactor_mutex);
+
+	return 0;
+}
+
+/**
+ * Runs task on the reactor thread and waits for it
+ */
+void reactor_call(reactor_task task,void * data)
+{
+	reactor_job job;
+
+	if(reactor_in_loop())
+	{
+		task(data);
+		return;
+	}
+
+	job.task=task;
+	job.data=data;
+	job.sync=true;
+	job.done=false;
+
+	pthread_mutex_lock(&reactor_mutex);
+	reactor_jobs.push_back(&job);
+	reactor_wake();
+	while(!job.done)
+		pthread_cond_wait(&reactor_cond,&reactor_mutex);
+	pthread_mutex_unlock(&reactor_mutex);
+}
+
+/**
+ * Whether the caller is the reactor thread
+ */
+bool reactor_in_loop()
+{
+	return reactor_refs>0 && pthread_equal(pthread_self(),reactor_thread);
+}
+
+/**
+ * Sets the scheduling policy and priority, cpu mask and memory locking of
+ * the reactor thread, applied right away when it runs
+ */
+void reactor_set_sched(unsigned int policy,unsigned int priority,unsigned int cpus,bool lock_memory)
+{
+	pthread_mutex_lock(&reactor_mutex);
+	reactor_policy=policy;
+	reactor_priority=priority;
+	reactor_cpus=cpus;
+	reactor_mlock=lock_memory;
+	if(reactor_refs>0)
+		reactor_apply_sched();
+	pthread_mutex_unlock(&reactor_mutex);
+}
+
+/**
+ * SCHED_ policy of a REACTOR_SCHED_ one, for the threads the reactor
+ * doesn't run
+ */
+int reactor_sched_policy(unsigned int policy)
+{
+	if(policy==REACTOR_SCHED_FIFO)
+		return SCHED_FIFO;
+	if(policy==REACTOR_SCHED_RR)
+		return SCHED_RR;
+
+	return SCHED_OTHER;
+}
+
+/**
+ * Scheduling options in effect, REACTOR_STATUS_ flags
+ */
+unsigned int reactor_sched_status()
+{
+	unsigned int status;
+
+	pthread_mutex_lock(&reactor_mutex);
+	status=reactor_status;
+	pthread_mutex_unlock(&reactor_mutex);
+
+	return status;
+}
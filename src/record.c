@@ -0,0 +1,207 @@
+
+
+#include "record.h"
+#include "reactor.h"
+#include "utils.h"
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+
+/**
+ * Starts recording a device when enabled, returns NULL otherwise or on
+ * error
+ */
+record_file * record_open(bool enabled,const char * driver,unsigned int id,unsigned int address)
+{
+	record_header header;
+	record_file * record;
+	const char * dir;
+	stringstream ss;
+	FILE * file;
+
+	if(!enabled)
+		return NULL;
+
+	dir=getenv("MRPDI_RECORD_DIR");
+	if(dir==NULL)
+		dir="/tmp";
+
+	ss<<dir<<"/"<<driver<<"-"<<hex<<id<<"-"<<address<<".rec";
+	file=fopen(ss.str().c_str(),"wb");
+	if(file==NULL)
+	{
+		cerr<<"[record] can't write "<<ss.str()<<endl;
+		return NULL;
+	}
+
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,RECORD_MAGIC,8);
+	header.version=RECORD_VERSION;
+	header.id=id;
+	header.address=address;
+	fwrite(&header,sizeof(header),1,file);
+
+	cout<<"[record] recording to "<<ss.str()<<endl;
+
+	record = new record_file;
+	record->file=file;
+
+	return record;
+}
+
+/**
+ * Appends data read at timestamp. Buffered by stdio, the reactor thread
+ * only pays for a copy most of the time
+ */
+void record_write(record_file * record,const unsigned char * data,int length,unsigned long long timestamp)
+{
+	unsigned short len;
+
+	if(length<=0)
+		return;
+
+	len=(length>RECORD_MAX_LENGTH) ? RECORD_MAX_LENGTH : length;
+	fwrite(&timestamp,sizeof(timestamp),1,record->file);
+	fwrite(&len,sizeof(len),1,record->file);
+	fwrite(data,1,len,record->file);
+}
+
+/**
+ * Stops recording, NULL is fine
+ */
+void record_close(record_file * record)
+{
+	if(record==NULL)
+		return;
+
+	fclose(record->file);
+	delete record;
+}
+
+
+/**
+ * Reads the next record ahead, returns false at the end of the file
+ */
+static bool replay_read(replay_file * replay)
+{
+	replay->pending=
+		fread(&replay->timestamp,sizeof(replay->timestamp),1,replay->file)==1 &&
+		fread(&replay->length,sizeof(replay->length),1,replay->file)==1 &&
+		replay->length<=RECORD_MAX_LENGTH &&
+		fread(replay->buffer,1,replay->length,replay->file)==replay->length;
+
+	return replay->pending;
+}
+
+/**
+ * Timer callback, feeds the records that are due and waits for the next
+ */
+static void replay_step(void * param)
+{
+	replay_file * replay = (replay_file *)param;
+	unsigned long long now=monotonic_ns();
+	unsigned long long due;
+	int count=0;
+
+	while(replay->pending)
+	{
+		due=replay->start+(replay->timestamp-replay->first);
+		if(!replay->full_speed && due>now)
+			break;
+		if(replay->full_speed && count==REPLAY_BATCH)
+			break;
+
+		replay->feed(replay->data,replay->buffer,replay->length,monotonic_ns());
+		count++;
+		replay_read(replay);
+	}
+
+	if(!replay->pending)
+	{
+		cout<<"[record] replay done"<<endl;
+		return;
+	}
+
+	//one shot, armed again for the next record. Full speed yields to the
+	//other sources between batches
+	if(replay->full_speed)
+		reactor_set_timer(replay->timer,0,0);
+	else
+		reactor_set_timer(replay->timer,(due-now+999999)/1000000,0);
+}
+
+/**
+ * Opens $MRPDI_REPLAY for feed if it is a recording of a device with id.
+ * Returns NULL otherwise. Nothing is fed until replay_start()
+ */
+replay_file * replay_open(unsigned int id,replay_feed feed,void * data)
+{
+	record_header header;
+	replay_file * replay;
+	const char * path;
+	const char * speed;
+	FILE * file;
+
+	path=getenv("MRPDI_REPLAY");
+	if(path==NULL)
+		return NULL;
+
+	file=fopen(path,"rb");
+	if(file==NULL)
+		return NULL;
+
+	if(fread(&header,sizeof(header),1,file)!=1 || memcmp(header.magic,RECORD_MAGIC,8)!=0 ||
+		header.version!=RECORD_VERSION || header.id!=id)
+	{
+		fclose(file);
+		return NULL;
+	}
+
+	speed=getenv("MRPDI_REPLAY_SPEED");
+
+	replay = new replay_file;
+	replay->file=file;
+	replay->timer=-1;
+	replay->full_speed=(speed!=NULL && atoi(speed)==0);
+	replay->feed=feed;
+	replay->data=data;
+	replay->start=0;
+	replay->first=0;
+
+	if(replay_read(replay))
+		replay->first=replay->timestamp;
+
+	cout<<"[record] replaying "<<path<<endl;
+
+	return replay;
+}
+
+/**
+ * Starts feeding the records, from the reactor thread so the first one
+ * comes after whatever the caller pushes first
+ */
+void replay_start(replay_file * replay)
+{
+	replay->start=monotonic_ns();
+
+	replay->timer=reactor_add_timer(0,0,replay_step,replay);
+	if(replay->timer<0)
+		cerr<<"[record] can't start replaying"<<endl;
+}
+
+/**
+ * Stops replaying, NULL is fine
+ */
+void replay_close(replay_file * replay)
+{
+	if(replay==NULL)
+		return;
+
+	reactor_remove_timer(replay->timer);
+	fclose(replay->file);
+	delete replay;
+}
@@ -0,0 +1,215 @@
+
+
+#include "registry.h"
+#include <cstring>
+
+//key of a never used slot, and of a removed one
+#define KEY_EMPTY	0ULL
+#define KEY_DELETED	(~0ULL)
+
+
+static unsigned long long make_key(unsigned int id,unsigned int address)
+{
+	return ((unsigned long long)id<<32) | address;
+}
+
+/**
+ * First slot probed for an address, fibonacci hashing
+ */
+static unsigned int first_slot(unsigned int address)
+{
+	return (address*2654435769U)>>(32-REGISTRY_BITS);
+}
+
+static unsigned long long load_key(device_registry * registry,unsigned int n)
+{
+	return __atomic_load_n(&registry->slots[n].key,__ATOMIC_ACQUIRE);
+}
+
+/**
+ * Slot holding key, or -1
+ */
+static int find_slot(device_registry * registry,unsigned long long key)
+{
+	unsigned int n=first_slot((unsigned int)key);
+	unsigned long long k;
+
+	for(int i=0;i<REGISTRY_SIZE;i++)
+	{
+		k=load_key(registry,n);
+		if(k==key)
+			return n;
+		if(k==KEY_EMPTY)
+			break;
+		n=(n+1) & (REGISTRY_SIZE-1);
+	}
+
+	return -1;
+}
+
+/**
+ * Stores value under key, called with the mutex locked and key absent
+ */
+static int put_slot(device_registry * registry,unsigned long long key,void * value)
+{
+	unsigned int n=first_slot((unsigned int)key);
+	unsigned long long k;
+
+	for(int i=0;i<REGISTRY_SIZE;i++)
+	{
+		k=load_key(registry,n);
+		if(k==KEY_EMPTY || k==KEY_DELETED)
+		{
+			//value first, lookups only trust the key
+			registry->slots[n].value=value;
+			__atomic_store_n(&registry->slots[n].key,key,__ATOMIC_RELEASE);
+			registry->count++;
+			return 0;
+		}
+		n=(n+1) & (REGISTRY_SIZE-1);
+	}
+
+	return -1;
+}
+
+/**
+ * Empty registry
+ */
+void registry_init(device_registry * registry)
+{
+	memset(registry->slots,0,sizeof(registry->slots));
+	registry->count=0;
+	pthread_mutex_init(&registry->mutex,NULL);
+}
+
+/**
+ * Adds a device. Returns 0, or -1 if it is already there or there is no room
+ */
+int registry_insert(device_registry * registry,unsigned int id,unsigned int address,void * value)
+{
+	unsigned long long key=make_key(id,address);
+	int res=-1;
+
+	pthread_mutex_lock(&registry->mutex);
+	if(find_slot(registry,key)<0)
+		res=put_slot(registry,key,value);
+	pthread_mutex_unlock(&registry->mutex);
+
+	return res;
+}
+
+/**
+ * Removes a device, returning its value or NULL if it wasn't there
+ */
+void * registry_remove(device_registry * registry,unsigned int id,unsigned int address)
+{
+	void * value=NULL;
+	int n;
+
+	pthread_mutex_lock(&registry->mutex);
+	n=find_slot(registry,make_key(id,address));
+	if(n>=0)
+	{
+		value=registry->slots[n].value;
+		__atomic_store_n(&registry->slots[n].key,KEY_DELETED,__ATOMIC_RELEASE);
+		registry->count--;
+	}
+	pthread_mutex_unlock(&registry->mutex);
+
+	return value;
+}
+
+/**
+ * Changes the address of a device, once plugged again. Returns 0 on success
+ */
+int registry_move(device_registry * registry,unsigned int id,unsigned int address,unsigned int new_address)
+{
+	unsigned long long key=make_key(id,new_address);
+	void * value;
+	int n;
+	int res=-1;
+
+	pthread_mutex_lock(&registry->mutex);
+	n=find_slot(registry,make_key(id,address));
+	if(n>=0 && find_slot(registry,key)<0)
+	{
+		value=registry->slots[n].value;
+		__atomic_store_n(&registry->slots[n].key,KEY_DELETED,__ATOMIC_RELEASE);
+		registry->count--;
+		res=put_slot(registry,key,value);
+	}
+	pthread_mutex_unlock(&registry->mutex);
+
+	return res;
+}
+
+/**
+ * Whether some device runs at address, without locking
+ */
+bool registry_has_address(device_registry * registry,unsigned int address)
+{
+	unsigned int n=first_slot(address);
+	unsigned long long k;
+
+	for(int i=0;i<REGISTRY_SIZE;i++)
+	{
+		k=load_key(registry,n);
+		if(k==KEY_EMPTY)
+			break;
+		if(k!=KEY_DELETED && (unsigned int)k==address)
+			return true;
+		n=(n+1) & (REGISTRY_SIZE-1);
+	}
+
+	return false;
+}
+
+/**
+ * Copies up to max device values, returns how many
+ */
+int registry_list(device_registry * registry,void ** values,int max)
+{
+	unsigned long long k;
+	int count=0;
+
+	pthread_mutex_lock(&registry->mutex);
+	for(int n=0;n<REGISTRY_SIZE && count<max;n++)
+	{
+		k=registry->slots[n].key;
+		if(k!=KEY_EMPTY && k!=KEY_DELETED)
+			values[count++]=registry->slots[n].value;
+	}
+	pthread_mutex_unlock(&registry->mutex);
+
+	return count;
+}
+
+/**
+ * Calls visitor with the value of the device at address, with the lock
+ * held so it can't be removed and freed meanwhile. Returns -1 if there
+ * is no such device
+ */
+int registry_visit(device_registry * registry,unsigned int address,registry_visitor visitor,void * data)
+{
+	unsigned int n=first_slot(address);
+	unsigned long long k;
+	int res=-1;
+
+	pthread_mutex_lock(&registry->mutex);
+	for(int i=0;i<REGISTRY_SIZE;i++)
+	{
+		k=registry->slots[n].key;
+		if(k==KEY_EMPTY)
+			break;
+		if(k!=KEY_DELETED && (unsigned int)k==address)
+		{
+			visitor(registry->slots[n].value,data);
+			res=0;
+			break;
+		}
+		n=(n+1) & (REGISTRY_SIZE-1);
+	}
+	pthread_mutex_unlock(&registry->mutex);
+
+	return res;
+}
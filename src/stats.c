@@ -0,0 +1,138 @@
+
+
+#include "stats.h"
+#include <cstring>
+#include <cstdlib>
+
+using namespace std;
+
+
+/**
+ * Starts counting
+ */
+void stats_init(device_stats * stats)
+{
+	memset(stats,0,sizeof(device_stats));
+	stats->started=monotonic_ns();
+}
+
+/**
+ * Accounts a report read at timestamp, once its events are out
+ */
+void stats_report(device_stats * stats,unsigned long long timestamp)
+{
+	stats_count(&stats->reports);
+	update_latency(&stats->latency,timestamp);
+}
+
+/**
+ * Increments a counter of the device, from the reactor thread only
+ */
+void stats_count(unsigned long * counter)
+{
+	__atomic_store_n(counter,*counter+1,__ATOMIC_RELAXED);
+}
+
+/**
+ * Counters of the input queue of the open device handle, like those of
+ * hid_get_stats(). From the reactor thread only
+ */
+void stats_input(device_stats * stats,unsigned long drops,unsigned long coalesced)
+{
+	__atomic_store_n(&stats->open_drops,drops,__ATOMIC_RELAXED);
+	__atomic_store_n(&stats->open_coalesced,coalesced,__ATOMIC_RELAXED);
+}
+
+/**
+ * The handle is about to be closed, a new one counts from 0 again
+ */
+void stats_input_closed(device_stats * stats)
+{
+	__atomic_store_n(&stats->input_drops,stats->input_drops+stats->open_drops,__ATOMIC_RELAXED);
+	__atomic_store_n(&stats->input_coalesced,stats->input_coalesced+stats->open_coalesced,__ATOMIC_RELAXED);
+	stats_input(stats,0,0);
+}
+
+/**
+ * Reports lost or merged below the driver, closed handles included
+ */
+static unsigned long input_total(const unsigned long * closed,const unsigned long * open)
+{
+	return __atomic_load_n(closed,__ATOMIC_RELAXED)+__atomic_load_n(open,__ATOMIC_RELAXED);
+}
+
+/**
+ * Splits a "stats.<name>@address" key. Returns 0 if key is one
+ */
+int stats_parse_key(const char * key,char * name,int size,unsigned int * address)
+{
+	return parse_device_key(key,"stats.",name,size,address);
+}
+
+/**
+ * Per second rate of count since started
+ */
+static unsigned int rate(unsigned long count,unsigned long long started)
+{
+	unsigned long long elapsed=monotonic_ns()-started;
+
+	if(elapsed==0)
+		return 0;
+
+	return (unsigned int)((long double)count*1000000000.0L/elapsed);
+}
+
+/**
+ * Average of a latency in us
+ */
+static unsigned int average_us(const report_latency * latency)
+{
+	unsigned long count=__atomic_load_n(&latency->count,__ATOMIC_RELAXED);
+
+	if(count==0)
+		return 0;
+
+	return (unsigned int)(__atomic_load_n(&latency->sum,__ATOMIC_RELAXED)/count/1000);
+}
+
+/**
+ * Value of a counter, see stats.h for the names. Returns -1 for unknown ones
+ */
+int stats_get(device_stats * stats,event_queue * queue,const char * name,unsigned int * value)
+{
+	unsigned long reports=__atomic_load_n(&stats->reports,__ATOMIC_RELAXED);
+	unsigned long events=__atomic_load_n(&queue->pushed,__ATOMIC_RELAXED);
+
+	if(strcmp(name,"reports")==0)
+		*value=reports;
+	else if(strcmp(name,"reports_avg_per_s")==0)
+		*value=rate(reports,stats->started);
+	else if(strcmp(name,"events")==0)
+		*value=events;
+	else if(strcmp(name,"events_avg_per_s")==0)
+		*value=rate(events,stats->started);
+	else if(strcmp(name,"checksum_errors")==0)
+		*value=__atomic_load_n(&stats->checksum_errors,__ATOMIC_RELAXED);
+	else if(strcmp(name,"usb_errors")==0)
+		*value=__atomic_load_n(&stats->usb_errors,__ATOMIC_RELAXED);
+	else if(strcmp(name,"drops")==0)
+		*value=__atomic_load_n(&queue->overflow,__ATOMIC_RELAXED)+input_total(&stats->input_drops,&stats->open_drops);
+	else if(strcmp(name,"coalesced")==0)
+		*value=__atomic_load_n(&queue->coalesced,__ATOMIC_RELAXED)+input_total(&stats->input_coalesced,&stats->open_coalesced);
+	else if(strcmp(name,"latency_avg_us")==0)
+		*value=average_us(&stats->latency);
+	else if(strcmp(name,"latency_max_us")==0)
+		*value=__atomic_load_n(&stats->latency.max,__ATOMIC_RELAXED)/1000;
+	else if(strcmp(name,"latency_p99_us")==0)
+		*value=latency_percentile(&stats->latency,99)/1000;
+	else if(strcmp(name,"delivery_avg_us")==0)
+		*value=average_us(&queue->latency);
+	else if(strcmp(name,"delivery_max_us")==0)
+		*value=__atomic_load_n(&queue->latency.max,__ATOMIC_RELAXED)/1000;
+	else if(strcmp(name,"delivery_p99_us")==0)
+		*value=latency_percentile(&queue->latency,99)/1000;
+	else
+		return -1;
+
+	return 0;
+}
@@ -1,9 +1,10 @@
 
 
 #include "utils.h"
-#include <iostream>
-#include <sstream>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 
 using namespace std;
 
@@ -25,22 +26,126 @@ unsigned char get_iface(unsigned int id,driver_device_info * supported_devices)
 }
 
 
+/**
+ * Builds the hidapi path (bbbb:dddd:ii) of a device interface.
+ * out must hold at least 16 chars
+ */ 
 void build_path(unsigned int address,unsigned char iface,char * out)
 {
 	unsigned int bus,dev;
-	ostringstream path(ostringstream::out);
 
 	bus=(address & 0x00ff0000)>>16;
 	dev=(address & 0x0000ff00)>>8;
-	path.fill('0');
-	path.width(4);
-	path<<hex<<bus<<":";
-	path.fill('0');
-	path.width(4);
-	path<<hex<<dev<<":";
-	path.fill('0');
-	path.width(2);
-	path<<hex<<(int)iface;
-	
-	strcpy(out,path.str().c_str());
+	snprintf(out,16,"%04x:%04x:%02x",bus,dev,(unsigned int)iface);
+}
+
+
+/**
+ * Parses a hidapi path back into a device address and interface.
+ * Returns 0 on success
+ */ 
+int parse_path(const char * path,unsigned int * address,unsigned char * iface)
+{
+	unsigned int bus,dev,i;
+	
+	if(sscanf(path,"%x:%x:%x",&bus,&dev,&i)!=3)
+		return -1;
+	
+	*address=((bus & 0xff)<<16) | ((dev & 0xff)<<8);
+	*iface=i;
+	
+	return 0;
+}
+
+
+/**
+ * Splits a "<prefix><name>@address" key, a per device one not stored in
+ * the parameter table. Returns 0 if key is one
+ */ 
+int parse_device_key(const char * key,const char * prefix,char * name,int size,unsigned int * address)
+{
+	const char * at;
+	char * end;
+	int length=strlen(prefix);
+	
+	if(strncmp(key,prefix,length)!=0)
+		return -1;
+	
+	key+=length;
+	at=strchr(key,'@');
+	if(at==NULL || at-key>=size)
+		return -1;
+	
+	*address=strtoul(at+1,&end,0);
+	if(end==at+1 || *end!=0)
+		return -1;
+	
+	memcpy(name,key,at-key);
+	name[at-key]=0;
+	
+	return 0;
+}
+
+
+/**
+ * Current CLOCK_MONOTONIC time in ns, hidapi stamps its reports with it
+ */ 
+unsigned long long monotonic_ns()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	
+	return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+/**
+ * Accounts a report received at timestamp whose events have just been
+ * delivered
+ */ 
+void update_latency(report_latency * latency,unsigned long long timestamp)
+{
+	unsigned long long now = monotonic_ns();
+	unsigned long long value = (now>timestamp) ? now-timestamp : 0;
+	
+	unsigned long long us = value/1000;
+	int bucket=0;
+	
+	//single writer, plain stores that readers never see torn
+	while(us>0 && bucket<LATENCY_BUCKETS-1)
+	{
+		us>>=1;
+		bucket++;
+	}
+	
+	__atomic_store_n(&latency->last,value,__ATOMIC_RELAXED);
+	__atomic_store_n(&latency->sum,latency->sum+value,__ATOMIC_RELAXED);
+	__atomic_store_n(&latency->count,latency->count+1,__ATOMIC_RELAXED);
+	__atomic_store_n(&latency->buckets[bucket],latency->buckets[bucket]+1,__ATOMIC_RELAXED);
+	if(value>latency->max)
+		__atomic_store_n(&latency->max,value,__ATOMIC_RELAXED);
+}
+
+/**
+ * Latency under which percent of the reports were delivered, rounded up
+ * to a power of 2 us. In ns
+ */
+unsigned long long latency_percentile(const report_latency * latency,unsigned int percent)
+{
+	unsigned long count = __atomic_load_n(&latency->count,__ATOMIC_RELAXED);
+	unsigned long long target = ((unsigned long long)count*percent+99)/100;
+	unsigned long long seen=0;
+	
+	if(count==0)
+		return 0;
+	
+	for(int n=0;n<LATENCY_BUCKETS;n++)
+	{
+		seen+=__atomic_load_n(&latency->buckets[n],__ATOMIC_RELAXED);
+		if(seen>=target)
+			return (1ULL<<n)*1000;
+	}
+	
+	return __atomic_load_n(&latency->max,__ATOMIC_RELAXED);
 }